@@ -0,0 +1,42 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+
+// Authenticated encryption of DATA payloads (FEAT_AEAD).
+//
+// Both ends hold the same pre-shared key file. Every transfer gets its own
+// key, HMAC-SHA256(file contents, salt) with a fresh random salt from the
+// sender's SETUP, so the nonce can simply be the fragment number: a
+// fragment is only ever sent again with the same bytes. The DATA header is
+// the associated data, so it can't be altered either, and the tag follows
+// the ciphertext. The cipher context keeps its key schedule, a packet costs
+// one IV set up; OpenSSL picks AES-NI/VAES and AVX2 code paths by itself.
+
+#define AEAD_KEY_FILE_MAX 256
+
+struct aead_ctx
+{
+    void *cipher; // EVP_CIPHER_CTX, keyed once per transfer
+    uint32_t id;  // AEAD_AES_256_GCM or AEAD_CHACHA20_POLY1305
+};
+
+// Reads a key file, which must hold at least 16 bytes; returns its length or -1
+int aead_load_key(const char *path, uint8_t *psk, size_t size);
+// AES-GCM where the CPU has AES and carry-less multiply instructions, ChaCha20-Poly1305 elsewhere
+uint32_t aead_preferred(void);
+const char *aead_name(uint32_t id);
+
+// Returns -1 for an unknown cipher
+int aead_init(struct aead_ctx *a, uint32_t id, const uint8_t *psk, size_t psk_len, const uint8_t salt[AEAD_SALT_LEN]);
+void aead_free(struct aead_ctx *a);
+
+// Encrypts len bytes of in to out (which may be in) and puts the tag after them
+int aead_seal(struct aead_ctx *a, uint64_t frag_no, const uint8_t *aad, size_t aad_len, const uint8_t *in,
+              size_t len, uint8_t *out);
+// Decrypts len bytes in place, the tag follows them; -1 if anything was altered
+int aead_open(struct aead_ctx *a, uint64_t frag_no, const uint8_t *aad, size_t aad_len, uint8_t *buf, size_t len);
+
+#endif
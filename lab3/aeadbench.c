@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "protocol.h"
+#include "aead.h"
+
+// What encrypting fragments costs next to sending them in the clear. The
+// clear path is what build_fragment and the server do per fragment with
+// FEAT_CRC: copy the payload behind the header and CRC it. The encrypted
+// path seals it into the packet instead, then opens it again in place.
+//
+//   ./aeadbench [MB per run]
+
+#define HEADER_BYTES 32 // about what a DATA header with a short file name takes
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_clear(const uint8_t *data, uint8_t *packet, size_t frag, uint64_t count)
+{
+    volatile uint32_t sink = 0;
+    double start = now_seconds();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        memcpy(packet + HEADER_BYTES, data, frag);
+        sink ^= crc32c(0, packet + HEADER_BYTES, frag); // sender
+        sink ^= crc32c(0, packet + HEADER_BYTES, frag); // receiver
+    }
+    (void)sink;
+    return now_seconds() - start;
+}
+
+static double bench_sealed(struct aead_ctx *a, const uint8_t *data, uint8_t *packet, size_t frag, uint64_t count)
+{
+    double start = now_seconds();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (aead_seal(a, i, packet, HEADER_BYTES, data, frag, packet + HEADER_BYTES) != 0 ||
+            aead_open(a, i, packet, HEADER_BYTES, packet + HEADER_BYTES, frag) != 0)
+        {
+            fprintf(stderr, "%s failed on fragment %llu\n", aead_name(a->id), (unsigned long long)i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return now_seconds() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    double megabytes = argc > 1 ? atof(argv[1]) : 512;
+    if (megabytes <= 0)
+    {
+        fprintf(stderr, "Usage: %s [MB per run]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static uint8_t data[FRAG_SIZE_MAX];
+    static uint8_t packet[FRAG_SIZE_MAX + FRAG_HEADER_MAX];
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t)(i * 131 + 7);
+    }
+    memset(packet, 0x11, HEADER_BYTES);
+
+    uint8_t psk[32], salt[AEAD_SALT_LEN];
+    memset(psk, 0x42, sizeof(psk));
+    memset(salt, 0x24, sizeof(salt));
+    const uint32_t ciphers[] = {AEAD_AES_256_GCM, AEAD_CHACHA20_POLY1305};
+    const size_t frags[] = {FRAG_SIZE_DEFAULT, 8192};
+
+    printf("Preferred on this CPU: %s\n", aead_name(aead_preferred()));
+    printf("%-20s %8s %10s %8s\n", "path", "frag", "MB/s", "vs clear");
+    for (size_t f = 0; f < sizeof(frags) / sizeof(frags[0]); f++)
+    {
+        size_t frag = frags[f];
+        uint64_t count = (uint64_t)(megabytes * 1e6 / frag) + 1;
+        double clear = bench_clear(data, packet, frag, count);
+        double clearRate = count * frag / clear / 1e6;
+        printf("%-20s %8zu %10.0f %7.0f%%\n", "memcpy+crc32c", frag, clearRate, 100.0);
+
+        for (size_t c = 0; c < sizeof(ciphers) / sizeof(ciphers[0]); c++)
+        {
+            struct aead_ctx a;
+            if (aead_init(&a, ciphers[c], psk, sizeof(psk), salt) != 0)
+            {
+                fprintf(stderr, "Can't set up %s\n", aead_name(ciphers[c]));
+                return EXIT_FAILURE;
+            }
+            double secs = bench_sealed(&a, data, packet, frag, count);
+            double rate = count * frag / secs / 1e6;
+            printf("%-20s %8zu %10.0f %7.0f%%\n", aead_name(ciphers[c]), frag, rate, 100.0 * rate / clearRate);
+            aead_free(&a);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <math.h>
+#include "autotune.h"
+
+void tune_init(struct tuner *t, uint64_t total, double now, double seconds)
+{
+    t->count = 0;
+    t->current = -1;
+    t->deadline = now + seconds;
+    t->round_start = now;
+    t->round_bytes = total;
+    t->best = 0;
+    t->rounds = 0;
+    t->finished = false;
+}
+
+int tune_add(struct tuner *t, const char *name, uint32_t value, uint32_t min, uint32_t max)
+{
+    if (t->count == TUNE_KNOBS)
+    {
+        return -1;
+    }
+    struct tune_knob *k = &t->knobs[t->count];
+    k->name = name;
+    k->min = min;
+    k->max = max;
+    k->value = k->kept = value < min ? min : value > max ? max : value;
+    k->factor = TUNE_FACTOR;
+    k->dir = 1;
+    k->turned = false;
+    k->settled = false;
+    return t->count++;
+}
+
+// The knob's next value in its direction; its own value at the end of its range
+static uint32_t knob_step(const struct tune_knob *k)
+{
+    double v = k->dir > 0 ? ceil(k->value * k->factor) : floor(k->value / k->factor);
+    return v < k->min ? k->min : v > k->max ? k->max : (uint32_t)v;
+}
+
+// A move that didn't pay: turn around, and once both ways have lost take smaller steps
+static void knob_lost(struct tune_knob *k)
+{
+    k->dir = -k->dir;
+    if (k->turned)
+    {
+        k->factor = sqrt(k->factor);
+        k->settled = k->factor < TUNE_FACTOR_MIN;
+    }
+    k->turned = !k->turned;
+}
+
+// Puts the next knob's move on trial; false once every knob has settled
+static bool next_trial(struct tuner *t)
+{
+    for (int i = 1; i <= t->count; i++)
+    {
+        int n = (t->current + i + t->count) % t->count;
+        struct tune_knob *k = &t->knobs[n];
+        while (!k->settled)
+        {
+            uint32_t v = knob_step(k);
+            if (v != k->value)
+            {
+                k->kept = k->value;
+                k->value = v;
+                t->current = n;
+                return true;
+            }
+            knob_lost(k); // up against the end of its range
+        }
+    }
+    return false;
+}
+
+bool tune_update(struct tuner *t, uint64_t total, double now, double round)
+{
+    if (t->finished || now - t->round_start < round)
+    {
+        return false;
+    }
+    double goodput = (total - t->round_bytes) / (now - t->round_start);
+    t->round_start = now;
+    t->round_bytes = total;
+    t->rounds++;
+
+    if (t->current < 0)
+    {
+        t->best = goodput;
+    }
+    else if (goodput > t->best * (1 + TUNE_GAIN))
+    {
+        t->best = goodput;
+        t->knobs[t->current].turned = false;
+    }
+    else
+    {
+        struct tune_knob *k = &t->knobs[t->current];
+        k->value = k->kept;
+        knob_lost(k);
+    }
+
+    if (now >= t->deadline || !next_trial(t))
+    {
+        t->finished = true;
+    }
+    return true;
+}
+
+void tune_finish(struct tuner *t)
+{
+    if (!t->finished && t->current >= 0)
+    {
+        t->knobs[t->current].value = t->knobs[t->current].kept;
+    }
+    t->finished = true;
+}
@@ -0,0 +1,59 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hill climbing on goodput over a few integer settings, while the transfer
+// they are for is running.
+//
+// Time is cut into rounds, each long enough to see a few round trips. The
+// first round measures the settings as they are. After that every round
+// tries one knob moved by its factor, knobs taking turns: a move that
+// raises goodput by more than TUNE_GAIN stays and the next one goes the
+// same way, one that doesn't is undone and the knob turns around. A knob
+// that has lost in both directions takes smaller steps, down to
+// TUNE_FACTOR_MIN, and then stays put. Once every knob has, or the time is
+// up, tuning is over and the settings in force are the ones kept.
+
+#define TUNE_KNOBS 4
+#define TUNE_GAIN 0.05       // goodput a move has to add to stay
+#define TUNE_FACTOR 2.0      // first step, as a multiple
+#define TUNE_FACTOR_MIN 1.15 // smallest step worth a round
+
+struct tune_knob
+{
+    const char *name;
+    uint32_t value; // in force, the one on trial during its round
+    uint32_t min, max;
+    uint32_t kept;  // before the move on trial
+    double factor;
+    int dir;        // +1 or -1
+    bool turned;    // lost going the other way at this factor
+    bool settled;
+};
+
+struct tuner
+{
+    struct tune_knob knobs[TUNE_KNOBS];
+    int count;
+    int current; // knob on trial, -1 while measuring the starting point
+    double deadline;
+    double round_start;
+    uint64_t round_bytes; // the caller's total when the round started
+    double best;          // goodput of the settings in force, bytes per second
+    unsigned rounds;      // measured so far, best means nothing until the first
+    bool finished;
+};
+
+// Tunes for `seconds` from now; total is what tune_update() will be counting from
+void tune_init(struct tuner *t, uint64_t total, double now, double seconds);
+// Returns the knob's index, -1 if there are TUNE_KNOBS already
+int tune_add(struct tuner *t, const char *name, uint32_t value, uint32_t min, uint32_t max);
+// total: bytes delivered so far. Ends the round once it has lasted `round`
+// seconds; returns true if that changed a value or ended the tuning.
+bool tune_update(struct tuner *t, uint64_t total, double now, double round);
+// Ends the tuning early, undoing the move on trial
+void tune_finish(struct tuner *t);
+
+#endif
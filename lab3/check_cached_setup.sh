@@ -0,0 +1,24 @@
+#!/bin/sh
+# A second transfer to a server in the peer cache has to start without
+# waiting for a setup round trip. Runs deliver and server over loopback.
+set -e
+port=${PORT:-40199}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+head -c 200000 /dev/urandom > "$dir/in"
+
+for run in 1 2; do
+    ./server -o "file:$dir/out" "$port" > "$dir/server$run.log" 2>&1 &
+    srv=$!
+    sleep 0.2
+    echo "ftp $dir/in" | ./deliver -c "$dir/peers" 127.0.0.1 "$port" > "$dir/deliver$run.log" 2>&1
+    wait $srv
+    cmp "$dir/in" "$dir/out"
+done
+
+if ! grep -q "reusing cached parameters" "$dir/deliver2.log"; then
+    echo "FAIL: the second transfer did a full setup"
+    cat "$dir/deliver2.log"
+    exit 1
+fi
+echo "PASS: the second transfer reused the cached setup"
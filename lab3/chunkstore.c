@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include "chunkstore.h"
+
+// FastCDC masks for an 8 KiB average: harder to match before the average
+// size, easier after it, which keeps chunk sizes close to the average
+#define MASK_S 0x0003590703530000ULL
+#define MASK_L 0x0000d90003530000ULL
+
+#define INDEX_MAGIC "CHUNKIX1"
+#define INDEX_INITIAL_SLOTS (1u << 16)
+
+struct index_slot
+{
+    uint8_t hash[CHUNK_HASH_LEN];
+    uint64_t offset; // in chunks.pack
+    uint32_t length;
+    uint32_t used;
+};
+
+struct index_header
+{
+    char magic[8];
+    uint64_t slots; // power of two
+    uint64_t used;
+    uint8_t pad[sizeof(struct index_slot) - 24];
+    struct index_slot table[];
+};
+
+static uint64_t gear[256];
+
+// Same table on every host, so the same data always chunks the same way
+static void gear_init(void)
+{
+    if (gear[0] != 0)
+    {
+        return;
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ULL; // splitmix64
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk starting at p; n bytes are available and the caller
+// guarantees n >= CHUNK_MAX_SIZE unless the stream ends within n
+static size_t cdc_cut(const uint8_t *p, size_t n)
+{
+    if (n <= CHUNK_MIN_SIZE)
+    {
+        return n;
+    }
+    size_t normal = n < CHUNK_AVG_SIZE ? n : CHUNK_AVG_SIZE;
+    size_t max = n < CHUNK_MAX_SIZE ? n : CHUNK_MAX_SIZE;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    for (; i < normal; i++)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & MASK_S))
+        {
+            return i + 1;
+        }
+    }
+    for (; i < max; i++)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & MASK_L))
+        {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+int chunker_init(struct chunker *ck, FILE *fp)
+{
+    gear_init();
+    memset(ck, 0, sizeof(*ck));
+    ck->fp = fp;
+    ck->buf = malloc(2 * CHUNK_MAX_SIZE);
+    return ck->buf ? 0 : -1;
+}
+
+int chunker_next(struct chunker *ck, const uint8_t **data, size_t *len)
+{
+    // Keep at least one max-size chunk buffered so a cut never depends on
+    // where a read happened to stop
+    if (ck->len - ck->pos < CHUNK_MAX_SIZE && !ck->eof)
+    {
+        memmove(ck->buf, ck->buf + ck->pos, ck->len - ck->pos);
+        ck->len -= ck->pos;
+        ck->pos = 0;
+        while (ck->len < 2 * CHUNK_MAX_SIZE && !ck->eof)
+        {
+            size_t n = fread(ck->buf + ck->len, 1, 2 * CHUNK_MAX_SIZE - ck->len, ck->fp);
+            if (n == 0)
+            {
+                if (ferror(ck->fp))
+                {
+                    return -1;
+                }
+                ck->eof = true;
+            }
+            ck->len += n;
+        }
+    }
+
+    if (ck->pos == ck->len)
+    {
+        return 0;
+    }
+    size_t cut = cdc_cut(ck->buf + ck->pos, ck->len - ck->pos);
+    *data = ck->buf + ck->pos;
+    *len = cut;
+    ck->pos += cut;
+    return 1;
+}
+
+void chunker_free(struct chunker *ck)
+{
+    free(ck->buf);
+    ck->buf = NULL;
+}
+
+void chunk_hash(const uint8_t *data, size_t len, uint8_t hash[CHUNK_HASH_LEN])
+{
+    EVP_Digest(data, len, hash, NULL, EVP_sha256(), NULL);
+}
+
+static size_t index_file_size(uint64_t slots)
+{
+    return sizeof(struct index_header) + slots * sizeof(struct index_slot);
+}
+
+static int index_map(struct chunkstore *cs, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    cs->index_fd = fd;
+    cs->index = map;
+    cs->index_map_size = st.st_size;
+    return 0;
+}
+
+static int index_create(int dir_fd, const char *name, uint64_t slots)
+{
+    int fd = openat(dir_fd, name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // ftruncate leaves the table sparse and zeroed (all slots unused)
+    if (ftruncate(fd, index_file_size(slots)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    struct index_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.slots = slots;
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Hashes are uniformly distributed, so their leading bytes pick the bucket
+static struct index_slot *index_find(struct index_header *ix, const uint8_t hash[CHUNK_HASH_LEN])
+{
+    uint64_t mask = ix->slots - 1;
+    uint64_t i;
+    memcpy(&i, hash, sizeof(i));
+    for (i &= mask;; i = (i + 1) & mask)
+    {
+        struct index_slot *slot = &ix->table[i];
+        if (!slot->used || memcmp(slot->hash, hash, CHUNK_HASH_LEN) == 0)
+        {
+            return slot;
+        }
+    }
+}
+
+// Rebuild the index at twice the size once it is 70% full
+static int index_grow(struct chunkstore *cs)
+{
+    struct index_header *old = cs->index;
+    int fd = index_create(cs->dir_fd, "index.tmp", old->slots * 2);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct chunkstore grown = *cs;
+    if (index_map(&grown, fd) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    for (uint64_t i = 0; i < old->slots; i++)
+    {
+        if (old->table[i].used)
+        {
+            *index_find(grown.index, old->table[i].hash) = old->table[i];
+        }
+    }
+    grown.index->used = old->used;
+
+    if (msync(grown.index, grown.index_map_size, MS_SYNC) < 0 ||
+        renameat(cs->dir_fd, "index.tmp", cs->dir_fd, "index") < 0)
+    {
+        munmap(grown.index, grown.index_map_size);
+        close(fd);
+        return -1;
+    }
+    munmap(cs->index, cs->index_map_size);
+    close(cs->index_fd);
+    *cs = grown;
+    return 0;
+}
+
+int chunkstore_open(struct chunkstore *cs, const char *dir)
+{
+    memset(cs, 0, sizeof(*cs));
+    cs->pack_fd = cs->index_fd = -1;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    cs->dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (cs->dir_fd < 0)
+    {
+        return -1;
+    }
+
+    cs->pack_fd = openat(cs->dir_fd, "chunks.pack", O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (cs->pack_fd < 0 || fstat(cs->pack_fd, &st) < 0)
+    {
+        chunkstore_close(cs);
+        return -1;
+    }
+    cs->pack_size = st.st_size;
+    cs->block = st.st_blksize > 0 ? (uint32_t)st.st_blksize : 4096;
+
+    int fd = openat(cs->dir_fd, "index", O_RDWR);
+    if (fd < 0 && errno == ENOENT)
+    {
+        fd = index_create(cs->dir_fd, "index", INDEX_INITIAL_SLOTS);
+    }
+    if (fd < 0 || index_map(cs, fd) < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        chunkstore_close(cs);
+        return -1;
+    }
+    // index_find() masks with slots - 1 and probes until it meets a free
+    // slot, so the table has to be a power of two, fit the file and have
+    // room left. Slots are counted from the file size, as a count big
+    // enough to overflow index_file_size() could still match it.
+    uint64_t slots = cs->index_map_size >= sizeof(struct index_header)
+                         ? (cs->index_map_size - sizeof(struct index_header)) / sizeof(struct index_slot)
+                         : 0;
+    if (cs->index_map_size < sizeof(struct index_header) ||
+        memcmp(cs->index->magic, INDEX_MAGIC, sizeof(cs->index->magic)) != 0 ||
+        cs->index->slots == 0 || (cs->index->slots & (cs->index->slots - 1)) != 0 ||
+        cs->index->slots != slots || cs->index_map_size != index_file_size(slots) ||
+        cs->index->used >= cs->index->slots)
+    {
+        fprintf(stderr, "chunkstore: %s/index is corrupt\n", dir);
+        chunkstore_close(cs);
+        return -1;
+    }
+    return 0;
+}
+
+void chunkstore_close(struct chunkstore *cs)
+{
+    if (cs->index)
+    {
+        munmap(cs->index, cs->index_map_size);
+        cs->index = NULL;
+    }
+    if (cs->index_fd >= 0)
+    {
+        close(cs->index_fd);
+    }
+    if (cs->pack_fd >= 0)
+    {
+        close(cs->pack_fd);
+    }
+    if (cs->dir_fd >= 0)
+    {
+        close(cs->dir_fd);
+    }
+    cs->index_fd = cs->pack_fd = cs->dir_fd = -1;
+}
+
+bool chunkstore_has(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN])
+{
+    return index_find(cs->index, hash)->used;
+}
+
+int chunkstore_put(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN],
+                   const uint8_t *data, uint32_t len)
+{
+    uint8_t actual[CHUNK_HASH_LEN];
+    chunk_hash(data, len, actual);
+    if (memcmp(actual, hash, CHUNK_HASH_LEN) != 0)
+    {
+        return -1;
+    }
+
+    if ((cs->index->used + 1) * 10 > cs->index->slots * 7 && index_grow(cs) < 0)
+    {
+        return -1;
+    }
+    struct index_slot *slot = index_find(cs->index, hash);
+    if (slot->used)
+    {
+        return 0;
+    }
+
+    // Data first, then the slot that points at it. On a block of its own,
+    // so chunkstore_copy_to() can clone it.
+    uint64_t offset = (cs->pack_size + cs->block - 1) / cs->block * cs->block;
+    if (pwrite(cs->pack_fd, data, len, (off_t)offset) != (ssize_t)len)
+    {
+        return -1;
+    }
+    memcpy(slot->hash, hash, CHUNK_HASH_LEN);
+    slot->offset = offset;
+    slot->length = len;
+    slot->used = 1;
+    cs->index->used++;
+    cs->pack_size = offset + len;
+    return 0;
+}
+
+int64_t chunkstore_copy_to(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN],
+                           int out_fd, uint64_t out_off)
+{
+    struct index_slot *slot = index_find(cs->index, hash);
+    if (!slot->used)
+    {
+        return -1;
+    }
+
+    loff_t in = (loff_t)slot->offset;
+    loff_t out = (loff_t)out_off;
+    size_t left = slot->length;
+
+    // Only whole blocks at block-aligned offsets on both sides can be
+    // shared. Chunks in the pack start on a block, so that takes an output
+    // offset on one too; a chunk that lands anywhere else is copied.
+    size_t blocks = out_off % cs->block == 0 && slot->offset % cs->block == 0 ? left / cs->block * cs->block : 0;
+    struct file_clone_range clone = {cs->pack_fd, (uint64_t)in, blocks, (uint64_t)out};
+    if (blocks > 0 && ioctl(out_fd, FICLONERANGE, &clone) == 0)
+    {
+        in += blocks;
+        out += blocks;
+        left -= blocks;
+    }
+
+    // copy_file_range copies in the kernel, and falls back to nothing
+    // across filesystems on older kernels
+    while (left > 0)
+    {
+        ssize_t n = copy_file_range(cs->pack_fd, &in, out_fd, &out, left, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        left -= n;
+    }
+
+    // Fall back to a plain copy (cross-filesystem, old kernels, ...)
+    uint8_t buf[CHUNK_MAX_SIZE];
+    while (left > 0)
+    {
+        size_t want = left < sizeof(buf) ? left : sizeof(buf);
+        ssize_t n = pread(cs->pack_fd, buf, want, in);
+        if (n <= 0 || pwrite(out_fd, buf, n, out) != n)
+        {
+            return -1;
+        }
+        in += n;
+        out += n;
+        left -= n;
+    }
+    return slot->length;
+}
@@ -0,0 +1,78 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Content-defined chunking + content-addressed chunk store used for
+// deduplicated transfers.
+//
+// Chunk boundaries come from a gear rolling hash (FastCDC style, normalized
+// chunking), so an insertion early in a file only moves the boundaries next
+// to it and the rest of the chunks still match what the receiver already has.
+// Chunks are named by their SHA-256.
+//
+// On disk a store is a directory holding:
+//   chunks.pack  append-only chunk data, every chunk starting on a
+//                filesystem block so it can be cloned (half a block of
+//                padding per chunk, on average)
+//   index        open-addressing hash table of (hash, pack offset, length)
+// The index is mmap'd, so memory use is whatever the page cache decides to
+// keep resident rather than a function of how many chunks are stored.
+
+#define CHUNK_HASH_LEN 32
+#define CHUNK_MIN_SIZE 2048
+#define CHUNK_AVG_SIZE 8192
+#define CHUNK_MAX_SIZE 65536
+
+// Reads a stream and hands back one chunk at a time
+struct chunker
+{
+    FILE *fp;
+    uint8_t *buf; // 2 * CHUNK_MAX_SIZE
+    size_t len;   // valid bytes in buf
+    size_t pos;   // start of the next chunk in buf
+    bool eof;
+};
+
+int chunker_init(struct chunker *ck, FILE *fp);
+// Returns 1 and sets data/len for the next chunk, 0 at end of stream, -1 on read error.
+// data stays valid until the next call.
+int chunker_next(struct chunker *ck, const uint8_t **data, size_t *len);
+void chunker_free(struct chunker *ck);
+
+void chunk_hash(const uint8_t *data, size_t len, uint8_t hash[CHUNK_HASH_LEN]);
+
+struct index_header;
+
+struct chunkstore
+{
+    int dir_fd;
+    int pack_fd;
+    uint64_t pack_size;
+    uint32_t block; // the pack's filesystem block size
+    int index_fd;
+    struct index_header *index; // mmap'd index file
+    size_t index_map_size;
+};
+
+int chunkstore_open(struct chunkstore *cs, const char *dir);
+void chunkstore_close(struct chunkstore *cs);
+
+bool chunkstore_has(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN]);
+
+// Verifies data against hash before storing it. Storing a chunk that is
+// already present is a no-op. Returns 0 on success, -1 on error or mismatch.
+int chunkstore_put(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN],
+                   const uint8_t *data, uint32_t len);
+
+// Copies a stored chunk into out_fd at out_off. Where out_off is on a block
+// boundary the chunk's whole blocks are cloned (reflink) on filesystems
+// that can, the rest is copied. Returns the chunk length, or -1 if the
+// chunk is missing or the copy fails.
+int64_t chunkstore_copy_to(struct chunkstore *cs, const uint8_t hash[CHUNK_HASH_LEN],
+                           int out_fd, uint64_t out_off);
+
+#endif
@@ -10,6 +10,25 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <openssl/rand.h>
+#include "protocol.h"
+#include "chunkstore.h"
+#include "stats.h"
+#include "trace.h"
+#include "peercache.h"
+#include "timerwheel.h"
+#include "tcpxfer.h"
+#include "xferio.h"
+#include "merkle.h"
+#include "aead.h"
+#include "zerocopy.h"
+#include "shmring.h"
+#include "autotune.h"
 // How to set TCP timeout value? -> Longer than RTT but RTT varies
 
 // SampleRTT:measured time from segment transmission until ACK receipt (ignore retransmissions)
@@ -27,31 +46,253 @@
 // If packet is retransmitted, do not use its ACK for the update of the timeout
 // When a timeout happens, double timeout value (do not use previous formula)
 
-#define MAX_DATA_SIZE 1000
-#define PACKET_BUFFER_SIZE 1500
+#define PACKET_BUFFER_SIZE (FRAG_SIZE_MAX + FRAG_HEADER_MAX) // FRAG_HEADER_MAX leaves room for an AEAD tag
+#define SEND_WINDOW 256         // what we propose, the server may want fewer
+#define SOCK_BUF_SIZE (1 << 20) // proposed SO_SNDBUF/SO_RCVBUF
+#define IP_UDP_HEADERS 28
+#define WHEEL_TICK_NS 100000 // retransmission timers have 0.1 ms resolution
+#define RTO_MAX 60.0
+#define ACK_DELAY_MAX_US 25000 // the longest we let the server hold back an ACK
+#define DUP_THRESH 3           // fragments SACKed past a hole before it is resent early
 #define ALFA 0.125
 #define BETA 0.25
+#define STREAM_ZC_BUFFERS 256 // -z in NACK mode: packets the kernel may still be sending from
+#define SHM_FRAG_SIZE (64 << 10) // payload bytes per fragment through the shared memory ring
+#define SOCK_BUF_MIN (64 << 10)  // auto-tuning never sizes the socket buffers below this
+#define SOCK_BUF_MAX (16 << 20)  // nor above this
+#define TUNE_SECONDS 2.0         // how long into a windowed transfer window and batch depth are tuned
+#define TUNE_ROUND_MIN 0.05      // a tuning round lasts at least this long
+#define TUNE_ROUND_RTTS 4        // and at least this many round trips
+#define TUNE_FRAG_MIN 512        // the fragment size climb goes no lower
+#define TUNE_FRAG_STEP_MIN 32    // a step smaller than this and the fragment size has settled
+#define TUNE_SAMPLE_MIN 0.5      // seconds of sending it takes for a transfer to count in the climb
+
+// USDT probes (trace.h), nothing unless built against <sys/sdt.h>
+#define PROBE_SEND(retransmit, frag_no, bytes)                          \
+    do                                                                  \
+    {                                                                   \
+        if (retransmit)                                                 \
+            PROBE2(frag_retransmit, (uint64_t)(frag_no), (int)(bytes)); \
+        else                                                            \
+            PROBE2(frag_send, (uint64_t)(frag_no), (int)(bytes));       \
+    } while (0)
+// srtt, rttvar and the RTO in microseconds, whenever the RTO changes
+#define PROBE_RTO()                                                               \
+    PROBE3(rto_update, (uint64_t)(estimatedRTT * 1e6), (uint64_t)(devRTT * 1e6), \
+           (uint64_t)(timeoutInterval * 1e6))
 
 // Global variables
 static double timeoutInterval = 1;
 static double estimatedRTT = 0.5;
 static double devRTT = 0.25;
+static bool rttMeasured = false;  // estimatedRTT is more than the initial guess
+static uint32_t pathCwnd = 0;     // fragments in flight the last stream sustained, 0 = not measured
+static double maxAckDelay = 0;    // how long the server may sit on an ACK, added to every RTO
+static bool sparse = false;       // the server takes zero runs as FRAG_FLAG_ZERO headers
+static bool zeroCopy = false;     // -z, DATA goes out with MSG_ZEROCOPY
+static struct merkle_tree fileTree; // -V, built before the setup
+static bool merkle = false;         // the server checks every block against fileTree
+static bool serverDone = false;     // DONE arrived while still sending, the server has checked the file
+static uint8_t psk[AEAD_KEY_FILE_MAX]; // -K, shared with the server
+static int pskLen = 0;
+static struct aead_ctx cipher;         // this transfer's key, when the server agreed to FEAT_AEAD
+// A slot per window slot, so nothing in flight shares one
+static struct shm_ring shmRing = {.fd = -1};
+static bool autoTune = true;       // -F turns it off
+static bool tuneFragSize = false;  // this transfer is a step of the fragment size climb, see save_peer()
+static uint32_t fragTried = 0;     // fragment size transferGoodput was measured at, 0 = no sample
+static double transferGoodput = 0; // payload bytes per second while sending
+
+static struct xfer_stats stats;
+static const char *statsPath = NULL; // -j, NULL = only dump on SIGUSR1 (to stderr)
+static const char *cachePath = NULL; // -c, servers we have set up transfers with before
+
+// Zero round trip start: SETUP went out right in front of the data and the
+// server hasn't answered it yet. Until it does, at most params.early
+// fragments are sent and every timeout repeats the SETUP.
+static struct
+{
+    bool pending;
+    bool confirmed; // YES arrived, params holds what the server agreed to
+    bool rejected;  // NO arrived, the transfer has to start over
+    struct xfer_params params;
+    uint8_t packet[PACKET_BUFFER_SIZE];
+    int len;
+    unsigned sends;
+    struct timespec sent_at; // first send, for an RTT sample if the SETUP isn't repeated
+} early;
+
+// A byte range of the file that has to go over the wire. A hole is sent as
+// one FRAG_FLAG_ZERO fragment however long it is.
+struct region
+{
+    uint64_t offset;
+    uint64_t length;
+    bool hole;
+};
+
+struct region_list
+{
+    struct region *items;
+    size_t count;
+    size_t capacity;
+};
 
-int send_fragment(int sockfd, FILE *fp, long fileSize, int frag_no, int num_frags,
-                  const char *fileName, struct sockaddr_in *serverAddr);
+// Fragment numbers laid over the regions: region r starts at first_frag[r]
+struct frag_map
+{
+    const struct region_list *regions;
+    uint64_t *first_frag;
+    uint64_t num_frags;
+    uint32_t frag_size; // payload bytes per fragment, as negotiated
+    struct frag_template header; // what every fragment's header starts with
+};
+
+int negotiate(int sockfd, const struct xfer_params *local, struct xfer_params *agreed,
+              struct sockaddr_in *serverAddr);
+int send_early_setup(int sockfd, const struct xfer_params *params, uint32_t fragments,
+                     struct sockaddr_in *serverAddr);
+static void resend_early_setup(int sockfd, struct sockaddr_in *serverAddr);
+static void rtt_sample(double sampleRTT);
+static double now_seconds(void);
+static void seed_path_metrics(const struct peer_entry *cached);
+static int sock_buf_for(double bytes);
+static void save_peer(const struct sockaddr_in *addr, const struct xfer_params *agreed, uint32_t asked,
+                      const struct peer_entry *cached);
+static int early_answer(const uint8_t *reply, size_t len);
+int run_transfer(int sockfd, struct xfer_source *src, uint64_t fileSize, const char *fileName, bool dedup, bool nackMode,
+                 double rateMbps, int receivers, const struct xfer_params *agreed,
+                 struct sockaddr_in *serverAddr);
+int frag_map_init(struct frag_map *map, const struct region_list *regions, uint32_t frag_size);
+void frag_lookup(const struct frag_map *map, uint64_t frag_no, uint64_t *offset, uint64_t *length, bool *hole);
+int build_fragment(struct xfer_source *src, const struct frag_map *map, uint64_t frag_no, uint8_t flags,
+                   uint8_t *packet_buffer);
+int window_fragments(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                     uint32_t window, uint32_t rwnd, struct sockaddr_in *serverAddr);
+int stream_fragments(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                     double rateMbps, int receivers,
+                     struct sockaddr_in *serverAddr);
+int offer_chunks(int sockfd, struct xfer_source *src, struct region_list *regions, struct sockaddr_in *serverAddr);
+static void region_add(struct region_list *list, uint64_t offset, uint64_t length, bool hole);
+static void sparse_regions(struct xfer_source *src, struct region_list *regions);
+static int build_tree(struct xfer_source *src, uint64_t fileSize);
+struct retransmit_queue;
+static int verify_answer(int sockfd, const uint8_t *reply, size_t len, const struct frag_map *map,
+                         struct retransmit_queue *queue, struct sockaddr_in *serverAddr);
+int await_verdict(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                  struct sockaddr_in *serverAddr);
+ssize_t send_and_wait(int sockfd, const uint8_t *packet, size_t packetSize, uint8_t replyType,
+                      uint64_t seq, uint8_t *reply, size_t replySize, unsigned *transmissions,
+                      const char *what, struct sockaddr_in *serverAddr);
 
 int main(int argc, char *argv[])
 { // argc is the # of args, argv are the actual args strings
+    bool dedup = false;
+    bool nackMode = false;
+    bool tcpMode = false;
+    bool verify = false;
+    const char *keyFile = NULL;
+    const char *sourceSpec = "file";
+    double rateMbps = 100;
+    int receivers = 1;
+    const char *mcastIf = NULL;
+    uint32_t fragSize = FRAG_SIZE_DEFAULT;
+    bool fragSizeSet = false;
+    uint32_t weight = 1;
+    int opt;
+    cachePath = peercache_default_path();
+    while ((opt = getopt(argc, argv, "dnTVzFK:S:r:N:i:f:w:c:j:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dedup = true; // offer chunk hashes first, send only what the server lacks
+            break;
+        case 'n':
+            nackMode = true; // stream at the paced rate, the server NACKs gaps
+            break;
+        case 'T':
+            tcpMode = true; // plain TCP with sendfile, to compare against (server needs -T too)
+            break;
+        case 'V':
+            verify = true; // hash the file first, the server checks every block and asks for damaged ones again
+            break;
+        case 'z':
+            zeroCopy = true; // the kernel sends DATA from our buffers instead of copying it, pays off with big fragments
+            break;
+        case 'F':
+            autoTune = false; // keep window, batch, socket buffers and fragment size as set up, don't tune them
+            break;
+        case 'K':
+            keyFile = optarg; // encrypt and authenticate every payload with this pre-shared key (server needs the same -K)
+            break;
+        case 'S':
+            sourceSpec = optarg; // file, mem or pattern:<size>, see xferio.h
+            break;
+        case 'r':
+            rateMbps = atof(optarg); // pacing rate for -n, in Mbit/s
+            if (rateMbps <= 0)
+            {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'N':
+            receivers = atoi(optarg); // multicast: receivers that must report DONE
+            if (receivers < 1)
+            {
+                fprintf(stderr, "Invalid receiver count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            mcastIf = optarg; // multicast: address of the interface to send on
+            break;
+        case 'f':
+            fragSize = (uint32_t)atoi(optarg); // fragment size to propose, the server may lower it
+            if (fragSize < 1 || fragSize > FRAG_SIZE_MAX)
+            {
+                fprintf(stderr, "Fragment size must be 1..%d bytes\n", FRAG_SIZE_MAX);
+                return EXIT_FAILURE;
+            }
+            fragSizeSet = true;
+            break;
+        case 'w':
+            weight = (uint32_t)atoi(optarg); // share of a busy server next to other transfers, it may grant less
+            if (weight < 1)
+            {
+                fprintf(stderr, "Invalid weight: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            cachePath = optarg[0] ? optarg : NULL; // known servers, "" = always do the full handshake
+            break;
+        case 'j':
+            statsPath = optarg; // write transfer stats as JSON here at completion
+            break;
+        case 't':
+            if (trace_init(optarg) != 0) // binary per-packet trace, decode with tracedump
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-n] [-T] [-V] [-z] [-F] [-K <key file>] [-S <source>] [-r <Mbit/s>] [-N <receivers>] [-i <mcast if addr>] [-f <frag bytes>] [-w <weight>] [-c <peer cache>] [-j <stats.json>] [-t <trace file>] <server IP> <server Port>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     // Check number of arguments passed in the command-line
-    if (argc < 3)
+    if (argc - optind < 2)
     {
-        fprintf(stderr, "Usage: %s <server IP> <server Port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-d] [-n] [-T] [-V] [-z] [-F] [-K <key file>] [-S <source>] [-r <Mbit/s>] [-N <receivers>] [-i <mcast if addr>] [-f <frag bytes>] [-w <weight>] [-c <peer cache>] [-j <stats.json>] [-t <trace file>] <server IP> <server Port>\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     // Parse inputs
-    const char *serverIp = argv[1];
-    int serverPort = atoi(argv[2]); // from string to int
+    const char *serverIp = argv[optind];
+    int serverPort = atoi(argv[optind + 1]); // from string to int
 
     // Create udp socket
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0); // af_inet is ipv4, sock_dgram is udp, 0 is std protocol
@@ -75,6 +316,28 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // A multicast group as the destination means one-to-many distribution:
+    // always streamed, receivers NACK what they miss and repairs go to the group
+    bool multicast = IN_MULTICAST(ntohl(serverAddr.sin_addr.s_addr));
+    if (multicast)
+    {
+        unsigned char ttl = 1, loop = 1; // stay on the local network, deliver to local receivers too
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        if (mcastIf)
+        {
+            struct in_addr ifAddr;
+            if (inet_pton(AF_INET, mcastIf, &ifAddr) <= 0 ||
+                setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifAddr, sizeof(ifAddr)) < 0)
+            {
+                perror("IP_MULTICAST_IF");
+                close(sockfd);
+                return EXIT_FAILURE;
+            }
+        }
+        nackMode = true;
+    }
+
     // Ask for input command
     printf("Please enter your command in the format: ftp <filename>\n");
     char userInput[256], command[8], fileName[128];
@@ -101,48 +364,227 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // Check if file exists
-    FILE *fp = fopen(fileName, "rb");
-    if (!fp)
+    // Check if file exists (or set up whatever else -S asked for)
+    struct xfer_source *src = source_open(sourceSpec, fileName);
+    if (!src)
     {
-        perror("fopen");
         close(sockfd);
         return EXIT_FAILURE;
     }
+    uint64_t fileSize = source_size(src);
 
-    // determine file size
-    fseek(fp, 0, SEEK_END);
-    long fileSize = ftell(fp); // get file size
+    printf("File size: %" PRIu64 " bytes\n", fileSize);
 
-    rewind(fp); // reset pointer
+    // Start timer
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats_init(&stats);
+    stats_install_sigusr1();
+    stats_publish(&stats, "sender");
+    stats_on_state(&stats, XS_SETUP);
 
-    int num_frags;
-    if (fileSize == 0)
+    if (dedup && multicast)
     {
-        num_frags = 1; // if file is empty send one fragment with size = 0
+        fprintf(stderr, "Deduplication needs a single receiver, ignoring -d for multicast.\n");
+        dedup = false;
     }
-    else
+    if (dedup && !source_stream(src))
     {
-        num_frags = (int)((fileSize + MAX_DATA_SIZE - 1) / MAX_DATA_SIZE);
+        fprintf(stderr, "A generated source has no chunks to offer, ignoring -d.\n");
+        dedup = false;
+    }
+    if (tcpMode && multicast)
+    {
+        fprintf(stderr, "TCP mode needs a single receiver.\n");
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
+    if (tcpMode && (dedup || nackMode))
+    {
+        fprintf(stderr, "TCP mode sends the whole file, ignoring -d and -n.\n");
+    }
+    if (verify && (tcpMode || multicast))
+    {
+        fprintf(stderr, "Only a single UDP receiver checks the file, ignoring -V.\n");
+        verify = false;
+    }
+    if (verify && dedup)
+    {
+        // Reused chunks never arrive, so the server can't tell when a block is complete
+        fprintf(stderr, "Deduplicated transfers aren't verified, ignoring -V.\n");
+        verify = false;
+    }
+    if (keyFile && (tcpMode || multicast))
+    {
+        // Neither has a SETUP to carry the salt in
+        fprintf(stderr, "Only a single UDP receiver gets an encrypted transfer, ignoring -K.\n");
+        keyFile = NULL;
+    }
+    if (keyFile && (pskLen = aead_load_key(keyFile, psk, sizeof(psk))) < 0)
+    {
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
+    if (verify && build_tree(src, fileSize) != 0)
+    {
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
     }
 
-    printf("File size: %ld bytes\n", fileSize);
-    printf("Number of fragments: %u\n", num_frags);
-
-    // Start timer
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct peer_entry cached;
+    bool known = !tcpMode && !multicast && cachePath && peercache_lookup(cachePath, &serverAddr, &cached);
+    tuneFragSize = autoTune && !fragSizeSet && !tcpMode && !multicast && cachePath;
+    if (known)
+    {
+        seed_path_metrics(&cached);
+        if (!fragSizeSet && cached.mtu > IP_UDP_HEADERS + FRAG_HEADER_MAX)
+        {
+            // Biggest fragment the path carried last time without IP fragmentation
+            uint32_t fit = cached.mtu - IP_UDP_HEADERS - FRAG_HEADER_MAX;
+            fragSize = fit < FRAG_SIZE_MAX ? fit : FRAG_SIZE_MAX;
+        }
+        double age = difftime(time(NULL), cached.last_seen);
+        if (age < 0 || age > PEERCACHE_METRICS_MAX_AGE)
+        {
+            // The path may not be the same one, the climb starts over
+            cached.frag_best = 0;
+            cached.frag_step = 0;
+        }
+        else if (tuneFragSize && cached.frag_best)
+        {
+            // The next step of the climb, never past what the path carries
+            int64_t next = (int64_t)cached.frag_best + cached.frag_step;
+            fragSize = next > fragSize ? fragSize : next < TUNE_FRAG_MIN ? TUNE_FRAG_MIN : (uint32_t)next;
+            if (cached.frag_step)
+            {
+                printf("Trying %u byte fragments (%u did best so far)\n", fragSize, cached.frag_best);
+            }
+        }
+    }
 
-    // Read and send packets
-    for (int i = 1; i <= num_frags; i++)
+    // Ask only for the features this transfer would use
+    struct xfer_params local, agreed;
+    local.version = PROTO_VERSION;
+    local.features = FEAT_CRC | FEAT_SPARSE | (dedup ? FEAT_DEDUP : 0) |
+                     (nackMode ? FEAT_NACK : FEAT_SACK | FEAT_RWND) | (verify ? FEAT_MERKLE : 0) |
+                     (keyFile ? FEAT_AEAD : 0);
+    local.max_frag = fragSize;
+    local.window = SEND_WINDOW;
+    local.sock_buf = SOCK_BUF_SIZE;
+    if (autoTune && known && cached.cwnd)
+    {
+        // Room for what the path held last time, if that is more
+        int size = sock_buf_for((double)cached.cwnd * (fragSize + IP_UDP_HEADERS + FRAG_HEADER_MAX));
+        local.sock_buf = size > SOCK_BUF_SIZE ? (uint32_t)size : SOCK_BUF_SIZE;
+    }
+    local.early = 0;
+    local.frag_limit = 0;
+    local.ack_every = SEND_WINDOW; // capped at half the window when negotiated
+    local.ack_delay_us = ACK_DELAY_MAX_US;
+    local.tree_block = verify ? fileTree.block : 0;
+    local.tree_size = verify ? fileTree.size : 0;
+    memset(local.tree_root, 0, sizeof(local.tree_root));
+    if (verify)
+    {
+        memcpy(local.tree_root, merkle_root(&fileTree), TREE_HASH_LEN);
+    }
+    local.aead = keyFile ? aead_preferred() : 0;
+    memset(local.aead_salt, 0, sizeof(local.aead_salt));
+    local.weight = weight;
+    // A server on this machine can take payloads straight from shared memory.
+    // The ring costs nothing until it is written to. The cache has no host
+    // id, so a cached server never gets it and the early setup goes ahead
+    // without it, over the socket.
+    memset(local.host_id, 0, sizeof(local.host_id));
+    local.shm_ring = 0;
+    if (!tcpMode && !multicast && shm_host_id(local.host_id) == 0 &&
+        shm_ring_create(&shmRing, SEND_WINDOW, SHM_FRAG_SIZE + AEAD_TAG_LEN) == 0)
+    {
+        local.features |= FEAT_SHM;
+        local.shm_ring = shmRing.id;
+    }
+    if (keyFile && RAND_bytes(local.aead_salt, sizeof(local.aead_salt)) != 1)
+    {
+        fprintf(stderr, "Couldn't get a random salt\n");
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
+    int status = 0;
+    if (tcpMode)
+    {
+        // The kernel's TCP does it all, no setup and nothing worth caching
+        status = tcp_send_file(src, fileName, &serverAddr, &stats, statsPath);
+    }
+    else if (multicast)
     {
-        if (send_fragment(sockfd, fp, fileSize, i, num_frags, fileName, &serverAddr) != 0)
+        // No handshake with a group; DATA says everything a receiver needs
+        agreed = local;
+    }
+    else if (known && params_negotiate(&local, &cached.params, &agreed) == 0 &&
+             ((agreed.features ^ local.features) & ~FEAT_SHM) == 0)
+    {
+        // Seen this server before and it had everything we want: offer what
+        // it agreed to last time and start sending without waiting for the answer
+        // Send what the path held last time, so the answer arrives as it drains
+        uint32_t fragments = cached.cwnd && cached.cwnd < agreed.window ? cached.cwnd : agreed.window;
+        // The cache doesn't keep ACK settings, the server picks them again
+        agreed.ack_every = local.ack_every;
+        agreed.ack_delay_us = local.ack_delay_us;
+        if (send_early_setup(sockfd, &agreed, fragments, &serverAddr) != 0)
         {
-            fclose(fp);
+            source_close(src);
             close(sockfd);
             return EXIT_FAILURE;
         }
     }
+    else if (negotiate(sockfd, &local, &agreed, &serverAddr) != 0)
+    {
+        if (shmRing.base)
+        {
+            shm_ring_unlink(&shmRing);
+        }
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
+    if (shmRing.base)
+    {
+        shm_ring_unlink(&shmRing); // the server has it open by now, or never will
+    }
+    if (!tcpMode)
+    {
+        status = run_transfer(sockfd, src, fileSize, fileName, dedup, nackMode, rateMbps, receivers, &agreed,
+                              &serverAddr);
+    }
+    if (status != 0 && early.rejected)
+    {
+        // The server changed since we cached it: full handshake and start over
+        early.rejected = false;
+        // Fragment numbers may cover other bytes now, so they can't be nonces under the old key
+        if (keyFile && RAND_bytes(local.aead_salt, sizeof(local.aead_salt)) != 1)
+        {
+            status = -1;
+        }
+        else
+        {
+            status = negotiate(sockfd, &local, &agreed, &serverAddr);
+        }
+        if (status == 0)
+        {
+            status = run_transfer(sockfd, src, fileSize, fileName, dedup, nackMode, rateMbps, receivers,
+                                  &agreed, &serverAddr);
+        }
+    }
+    if (status != 0)
+    {
+        source_close(src);
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
 
     printf("File transfer completed.\n");
 
@@ -152,144 +594,1977 @@ int main(int argc, char *argv[])
 
     printf("Round-trip time: %.6f seconds\n", rtt);
 
-    fclose(fp);
+    if (cachePath && !tcpMode && !multicast && !early.pending)
+    {
+        save_peer(&serverAddr, early.confirmed ? &early.params : &agreed, local.features,
+                  known ? &cached : NULL);
+    }
+
+    stats_finish(&stats);
+    if (statsPath)
+    {
+        stats_dump_json(&stats, "sender", statsPath);
+    }
+
+    merkle_free(&fileTree);
+    aead_free(&cipher);
+    shm_ring_close(&shmRing);
+    source_close(src);
     close(sockfd);
     return 0;
 }
 
-int send_fragment(int sockfd, FILE *fp, long fileSize, int frag_no, int num_frags,
-                  const char *fileName, struct sockaddr_in *serverAddr)
+// Everything after the setup: work out what to send and send it
+int run_transfer(int sockfd, struct xfer_source *src, uint64_t fileSize, const char *fileName, bool dedup, bool nackMode,
+                 double rateMbps, int receivers, const struct xfer_params *agreed,
+                 struct sockaddr_in *serverAddr)
 {
-    char packet_buffer[PACKET_BUFFER_SIZE];
-    char data[MAX_DATA_SIZE];
-    size_t bytesRead = 0;
-
-    // Calculate how many bytes we should read for this fragment
-    long offset = (frag_no - 1) * MAX_DATA_SIZE; // Starting byte for this fragment
-    long bytesRemaining = fileSize - offset;     // Bytes left in the file from this point
-    size_t bytesToRead = (bytesRemaining > MAX_DATA_SIZE) ? MAX_DATA_SIZE : bytesRemaining;
-
-    if (fileSize > 0 && bytesToRead > 0)
+    if (agreed->sock_buf)
+    {
+        int size = (int)agreed->sock_buf;
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (dedup && !(agreed->features & FEAT_DEDUP))
+    {
+        fprintf(stderr, "Server can't deduplicate, sending the whole file.\n");
+        dedup = false;
+    }
+    maxAckDelay = agreed->ack_delay_us / 1e6;
+    sparse = agreed->features & FEAT_SPARSE;
+    merkle = agreed->features & FEAT_MERKLE;
+    serverDone = false;
+    if (fileTree.levels && !merkle)
+    {
+        fprintf(stderr, "Server can't check the file against a tree, sending it unverified.\n");
+    }
+    aead_free(&cipher);
+    if (pskLen > 0 && !(agreed->features & FEAT_AEAD))
+    {
+        fprintf(stderr, "Server can't decrypt, refusing to send the file in the clear.\n");
+        return -1;
+    }
+    if (agreed->features & FEAT_AEAD)
     {
-        // Ensure file pointer is at the correct position
-        if (fseek(fp, offset, SEEK_SET) != 0)
+        if (aead_init(&cipher, agreed->aead, psk, (size_t)pskLen, agreed->aead_salt) != 0)
         {
-            perror("fseek");
+            fprintf(stderr, "Can't set up %s\n", aead_name(agreed->aead));
             return -1;
         }
+        printf("Encrypting with %s\n", aead_name(agreed->aead));
+    }
+    if (nackMode && !(agreed->features & FEAT_NACK))
+    {
+        fprintf(stderr, "Server doesn't do NACK mode, falling back to stop-and-wait.\n");
+        nackMode = false;
+    }
+
+    bool shm = false;
+    if (agreed->features & FEAT_SHM)
+    {
+        shm = shm_ring_reserve(&shmRing) == 0;
+        if (shm)
+        {
+            printf("Server is on this host, payloads go through shared memory\n");
+        }
+        else
+        {
+            fprintf(stderr, "No room for the shared memory ring (%s), sending through the socket.\n",
+                    strerror(errno));
+        }
+    }
 
-        bytesRead = fread(data, 1, bytesToRead, fp);
-        if (bytesRead != bytesToRead && !feof(fp))
+    // Work out which parts of the file need sending
+    struct region_list regions = {0};
+    // The tag catches corruption as well, a CRC on top would be wasted. So
+    // would one over shared memory, where a slot changing under the reader
+    // is caught by its stamp.
+    uint8_t flags = (agreed->features & FEAT_AEAD)  ? FRAG_FLAG_AEAD
+                    : shm                           ? 0
+                    : (agreed->features & FEAT_CRC) ? FRAG_FLAG_CRC
+                                                    : 0;
+    flags |= shm ? FRAG_FLAG_SHM : 0;
+    if (dedup)
+    {
+        flags |= FRAG_FLAG_DEDUP;
+        stats_on_state(&stats, XS_OFFER);
+        if (offer_chunks(sockfd, src, &regions, serverAddr) != 0)
         {
-            perror("fread error");
+            free(regions.items);
             return -1;
         }
-        printf("Bytes read %zu\n", bytesRead);
     }
-    else if (fileSize == 0 && frag_no == 1)
+    else if (sparse)
     {
-        bytesRead = 0; // Empty file case
+        sparse_regions(src, &regions);
     }
-    else
+    else if (fileSize > 0)
     {
-        printf("No more data to read for fragment %d\n", frag_no);
-        bytesRead = 0;
+        region_add(&regions, 0, fileSize, false);
     }
 
-    // Create packet header
-    int header_len = snprintf(packet_buffer, PACKET_BUFFER_SIZE, "%u:%u:%u:%s:",
-                              num_frags, frag_no, (int)bytesRead, fileName);
-
-    if (header_len < 0 || header_len >= PACKET_BUFFER_SIZE)
+    struct frag_map map;
+    if (frag_map_init(&map, &regions, shm ? SHM_FRAG_SIZE : agreed->max_frag) != 0)
+    {
+        perror("malloc");
+        free(regions.items);
+        return -1;
+    }
+    uint64_t num_frags = map.num_frags;
+    if (frag_template_init(&map.header, num_frags, fileName) != 0)
     {
         fprintf(stderr, "Header creation failed\n");
+        free(map.first_frag);
+        free(regions.items);
         return -1;
     }
+    uint64_t payloadBytes = 0;
+    for (size_t r = 0; r < regions.count; r++)
+    {
+        payloadBytes += regions.items[r].hole ? 0 : regions.items[r].length;
+    }
+
+    printf("Number of fragments: %" PRIu64 "\n", num_frags);
+    stats_on_start(&stats, fileName, payloadBytes, num_frags);
+    bool climbing = tuneFragSize && !shm; // the ring's fragments are a size of their own
+    stats.tuned_frag_size = climbing ? map.frag_size : 0;
 
-    if (header_len + bytesRead > PACKET_BUFFER_SIZE)
+    // Read and send packets
+    int status = 0;
+    double sendStart = now_seconds();
+    if (nackMode)
     {
-        fprintf(stderr, "Packet size exceeds buffer\n");
-        return -1;
+        status = stream_fragments(sockfd, src, &map, flags | FRAG_FLAG_NACK, rateMbps,
+                                  receivers, serverAddr);
+    }
+    else
+    {
+        status = window_fragments(sockfd, src, &map, flags, agreed->window,
+                                  (agreed->features & FEAT_RWND) ? RWND_INITIAL : 0, serverAddr);
+        if (status == 0 && merkle && !serverDone && early.pending)
+        {
+            // Everything went out with the early SETUP and was taken without it
+            fprintf(stderr, "Server never answered the setup, the file wasn't checked.\n");
+        }
+        else if (status == 0 && merkle && !serverDone)
+        {
+            status = await_verdict(sockfd, src, &map, flags, serverAddr);
+        }
+    }
+    double sendTime = now_seconds() - sendStart;
+    if (status == 0 && climbing && sendTime >= TUNE_SAMPLE_MIN)
+    {
+        fragTried = map.frag_size;
+        transferGoodput = payloadBytes / sendTime;
+    }
+    free(map.first_frag);
+    free(regions.items);
+    return status;
+}
+
+static void region_add(struct region_list *list, uint64_t offset, uint64_t length, bool hole)
+{
+    // Adjacent missing chunks become one region
+    if (list->count > 0)
+    {
+        struct region *last = &list->items[list->count - 1];
+        if (last->offset + last->length == offset && last->hole == hole)
+        {
+            last->length += length;
+            return;
+        }
+    }
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->items = realloc(list->items, list->capacity * sizeof(struct region));
+        if (!list->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->items[list->count].offset = offset;
+    list->items[list->count].length = length;
+    list->items[list->count].hole = hole;
+    list->count++;
+}
+
+// The file's data extents, with a hole region for every gap between them
+// and after the last one, so the server ends up with the same layout
+static void sparse_regions(struct xfer_source *src, struct region_list *regions)
+{
+    uint64_t size = source_size(src);
+    uint64_t offset = 0, start, end;
+    while (source_next_data(src, offset, &start, &end) == 0)
+    {
+        if (start > offset)
+        {
+            region_add(regions, offset, start - offset, true);
+        }
+        region_add(regions, start, end - start, false);
+        offset = end;
+    }
+    if (offset < size)
+    {
+        region_add(regions, offset, size - offset, true);
     }
+}
 
-    // Copy file data into the packet buffer after header
-    memcpy(packet_buffer + header_len, data, bytesRead);
+static int tree_read(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+    return source_read(ctx, offset, buf, len);
+}
 
-    // Rest of your retransmission and ACK logic remains unchanged
-    bool ackReceived = false;
-    bool secondTry = false;
-    char ack_buffer[256];
+// -V: hash the file on every core before the setup, which carries the root
+static int build_tree(struct xfer_source *src, uint64_t fileSize)
+{
+    if (merkle_init(&fileTree, fileSize, MERKLE_BLOCK_DEFAULT) != 0)
+    {
+        perror("malloc");
+        return -1;
+    }
+    double started = now_seconds();
+    if (merkle_build(&fileTree, tree_read, src, 0) != 0)
+    {
+        fprintf(stderr, "Couldn't hash the file.\n");
+        merkle_free(&fileTree);
+        return -1;
+    }
+    double secs = now_seconds() - started;
+    printf("Merkle tree: %" PRIu64 " blocks of %u bytes in %.3f s (%.0f MB/s)\n", merkle_blocks(&fileTree),
+           fileTree.block, secs, secs > 0 ? fileSize / secs / 1e6 : 0);
+    return 0;
+}
 
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+// Offer one batch of chunk hashes and record the chunks the server is missing
+static int send_offer(int sockfd, struct chunk_offer *offer, const uint64_t *chunkOffsets,
+                      struct region_list *regions, uint64_t *missing, struct sockaddr_in *serverAddr)
+{
+    uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    uint8_t bitmap[(OFFER_MAX_CHUNKS + 7) / 8];
+
+    int len = encode_offer(offer, packet_buffer, sizeof(packet_buffer));
+    if (len < 0)
+    {
+        fprintf(stderr, "Offer creation failed\n");
+        return -1;
+    }
+    TRACE(TR_OFFER, offer->seq, offer->count);
 
-    while (!ackReceived)
+    unsigned transmissions;
+    ssize_t replyLen = send_and_wait(sockfd, packet_buffer, len, PKT_WANT, offer->seq,
+                                     reply, sizeof(reply), &transmissions, "offer", serverAddr);
+    uint64_t seq;
+    if (replyLen < 0 || decode_want(reply, replyLen, &seq, bitmap, offer->count) < 0)
     {
-        ssize_t packetSize = header_len + bytesRead;
-        ssize_t sentBytes = sendto(sockfd, packet_buffer, packetSize, 0,
-                                   (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+        return -1;
+    }
 
-        if (sentBytes < 0)
+    for (uint32_t i = 0; i < offer->count; i++)
+    {
+        if (bitmap[i / 8] & (1u << (i % 8)))
         {
-            perror("sendto");
-            return -1;
+            region_add(regions, chunkOffsets[i], offer->length[i], false);
+            (*missing)++;
         }
+    }
+    return 0;
+}
+
+// Chunk the file, offer every chunk hash to the server in order and collect
+// the byte ranges it still needs
+int offer_chunks(int sockfd, struct xfer_source *src, struct region_list *regions, struct sockaddr_in *serverAddr)
+{
+    struct chunker ck;
+    struct chunk_offer offer;
+    uint64_t chunkOffsets[OFFER_MAX_CHUNKS];
+    uint64_t offset = 0, chunks = 0, missing = 0;
+    const uint8_t *data;
+    size_t len;
+    int rc;
+
+    if (chunker_init(&ck, source_stream(src)) < 0) // rewound, this may be a second attempt
+    {
+        perror("malloc");
+        return -1;
+    }
+    memset(&offer, 0, sizeof(offer));
+    offer.seq = 1;
+
+    while ((rc = chunker_next(&ck, &data, &len)) > 0)
+    {
+        chunkOffsets[offer.count] = offset;
+        offer.length[offer.count] = (uint32_t)len;
+        chunk_hash(data, len, offer.hash[offer.count]);
+        offer.count++;
+        offset += len;
+        chunks++;
 
-        if (secondTry)
+        if (offer.count == OFFER_MAX_CHUNKS)
         {
-            printf("Packet %d/%d being retransmitted\n", frag_no, num_frags);
+            if (send_offer(sockfd, &offer, chunkOffsets, regions, &missing, serverAddr) != 0)
+            {
+                chunker_free(&ck);
+                return -1;
+            }
+            offer.seq++;
+            offer.count = 0;
         }
-        else
+    }
+    chunker_free(&ck);
+    if (rc < 0)
+    {
+        perror("fread error");
+        return -1;
+    }
+
+    // The last offer may be empty, it just tells the server the manifest is complete
+    offer.flags = OFFER_FLAG_LAST;
+    if (send_offer(sockfd, &offer, chunkOffsets, regions, &missing, serverAddr) != 0)
+    {
+        return -1;
+    }
+
+    uint64_t sendBytes = 0;
+    for (size_t r = 0; r < regions->count; r++)
+    {
+        sendBytes += regions->items[r].length;
+    }
+    printf("Dedup: %" PRIu64 " chunks, %" PRIu64 " missing on server, sending %" PRIu64 " of %" PRIu64 " bytes\n",
+           chunks, missing, sendBytes, offset);
+    return 0;
+}
+
+// Propose our configuration with SETUP ("ftp") and keep retransmitting it
+// until the server answers YES with the configuration it picked, or NO.
+// The exchange also gives the first RTT sample.
+int negotiate(int sockfd, const struct xfer_params *local, struct xfer_params *agreed,
+              struct sockaddr_in *serverAddr)
+{
+    uint8_t packet[PACKET_BUFFER_SIZE];
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    char reason[SETUP_REASON_MAX];
+    bool secondTry = false;
+    bool needSend = true;
+
+    int len = encode_setup(local, packet, sizeof(packet));
+    if (len < 0)
+    {
+        fprintf(stderr, "Setup creation failed\n");
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1)
+    {
+        if (needSend)
         {
-            printf("Sent packet %u/%u (header %d bytes, data %zu bytes)\n",
-                   frag_no, num_frags, header_len, bytesRead);
+            if (sendto(sockfd, packet, len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) < 0)
+            {
+                perror("sendto");
+                return -1;
+            }
+            stats_on_send(&stats, len, secondTry);
+            TRACE(TR_SETUP, local->version, local->features);
+            needSend = false;
         }
 
         struct timeval t1;
         t1.tv_sec = (int)timeoutInterval;
         t1.tv_usec = (int)((timeoutInterval - (int)timeoutInterval) * 1e6);
-
         setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t1, sizeof(t1));
 
         socklen_t addrLen = sizeof(*serverAddr);
-        memset(&ack_buffer, 0, sizeof(ack_buffer));
-        ssize_t ackBytes = recvfrom(sockfd, ack_buffer, sizeof(ack_buffer) - 1, 0,
-                                    (struct sockaddr *)serverAddr, &addrLen);
-
-        if (ackBytes < 0)
+        ssize_t replyBytes = recvfrom(sockfd, reply, sizeof(reply), 0,
+                                      (struct sockaddr *)serverAddr, &addrLen);
+        if (replyBytes < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                printf("Timeout waiting for ACK on packet %d/%d\n", frag_no, num_frags);
+                TRACE(TR_TIMEOUT, 0, (uint64_t)(timeoutInterval * 1e6));
+                PROBE2(frag_timeout, 0, (uint64_t)(timeoutInterval * 1e6));
                 timeoutInterval *= 2;
+                PROBE_RTO();
                 secondTry = true;
+                needSend = true;
+                stats_on_timeout(&stats);
                 continue;
             }
             perror("recvfrom");
             return -1;
         }
-        ackReceived = true;
-        ack_buffer[ackBytes] = '\0';
-    }
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    double sampleRTT = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
-
-    if (strcmp(ack_buffer, "received") == 0)
-    {
-        printf("ACK received for packet %u/%u\n", frag_no, num_frags);
-        if (!secondTry)
+        struct xfer_params offered;
+        int rc = decode_setup_reply(reply, replyBytes, &offered, reason, sizeof(reason));
+        if (rc < 0)
         {
-            estimatedRTT = (1 - ALFA) * estimatedRTT + ALFA * sampleRTT;
-            devRTT = (1 - BETA) * devRTT + BETA * fabs(sampleRTT - estimatedRTT);
-            timeoutInterval = estimatedRTT + 4 * devRTT;
+            continue; // not an answer to SETUP
+        }
+        if (rc == 0)
+        {
+            fprintf(stderr, "Server refused the transfer: %s\n", reason);
+            return -1;
+        }
+        // Whatever the server says, never go beyond what we proposed
+        if (params_negotiate(local, &offered, agreed) != 0)
+        {
+            fprintf(stderr, "Server picked an unusable configuration\n");
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double sampleRTT = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        agreed->frag_limit = offered.frag_limit;
+        if (!secondTry)
+        {
+            rtt_sample(sampleRTT);
+            stats_on_ack(&stats, (uint64_t)(sampleRTT * 1e6), 1);
+        }
+        printf("Setup: version %u, features 0x%x, fragment %u bytes, window %u, socket buffers %u bytes\n",
+               agreed->version, agreed->features, agreed->max_frag, agreed->window, agreed->sock_buf);
+        return 0;
+    }
+}
+
+// Zero round trip start: SETUP with parameters the server is known to accept,
+// sent without waiting for the answer
+int send_early_setup(int sockfd, const struct xfer_params *params, uint32_t fragments,
+                     struct sockaddr_in *serverAddr)
+{
+    early.params = *params;
+    early.params.early = fragments;
+    early.len = encode_setup(&early.params, early.packet, sizeof(early.packet));
+    if (early.len < 0)
+    {
+        fprintf(stderr, "Setup creation failed\n");
+        return -1;
+    }
+    early.pending = true;
+    resend_early_setup(sockfd, serverAddr);
+    printf("Setup: reusing cached parameters, fragment %u bytes, %u fragment(s) before the answer\n",
+           params->max_frag, fragments);
+    return 0;
+}
+
+static void resend_early_setup(int sockfd, struct sockaddr_in *serverAddr)
+{
+    if (sendto(sockfd, early.packet, early.len, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr)) < 0)
+    {
+        perror("sendto");
+        return;
+    }
+    if (early.sends++ == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &early.sent_at);
+    }
+    stats_on_send(&stats, early.len, early.sends > 1);
+    TRACE(TR_SETUP, early.params.version, early.params.features);
+}
+
+// Check whether a reply answers the early SETUP. Returns 0 if it isn't a
+// setup answer at all, 1 if it was (and has been dealt with), -1 if the
+// server refused and the transfer has to start over with a full handshake.
+static int early_answer(const uint8_t *reply, size_t len)
+{
+    struct xfer_params answer;
+    char reason[SETUP_REASON_MAX];
+    int rc = decode_setup_reply(reply, len, &answer, reason, sizeof(reason));
+    if (rc < 0)
+    {
+        return 0;
+    }
+    if (!early.pending)
+    {
+        return 1; // repeated answer
+    }
+    early.pending = false;
+    if (rc == 0)
+    {
+        fprintf(stderr, "Server refused the cached parameters: %s\n", reason);
+        early.rejected = true;
+        return -1;
+    }
+    early.confirmed = true;
+    early.params = answer;
+    maxAckDelay = answer.ack_delay_us / 1e6; // we assumed the most we offered until now
+    if (early.sends == 1)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double sampleRTT = (now.tv_sec - early.sent_at.tv_sec) + (now.tv_nsec - early.sent_at.tv_nsec) / 1e9;
+        rtt_sample(sampleRTT);
+        stats_on_ack(&stats, (uint64_t)(sampleRTT * 1e6), 1);
+    }
+    return 1;
+}
+
+// Karn: never called for a reply to something that was retransmitted
+static void rtt_sample(double sampleRTT)
+{
+    if (!rttMeasured)
+    {
+        // First measurement replaces the initial guess outright (RFC 6298)
+        estimatedRTT = sampleRTT;
+        devRTT = sampleRTT / 2;
+        rttMeasured = true;
+    }
+    else
+    {
+        estimatedRTT = (1 - ALFA) * estimatedRTT + ALFA * sampleRTT;
+        devRTT = (1 - BETA) * devRTT + BETA * fabs(sampleRTT - estimatedRTT);
+    }
+    timeoutInterval = estimatedRTT + 4 * devRTT;
+    PROBE_RTO();
+}
+
+// Start the estimator from the last transfer to this destination instead of
+// the 0.5 s guess, like the kernel's TCP metrics cache. The older the entry,
+// the less it is trusted: the variance grows by a full srtt over
+// PEERCACHE_METRICS_MAX_AGE, after which the entry is ignored.
+static void seed_path_metrics(const struct peer_entry *cached)
+{
+    double age = difftime(time(NULL), cached->last_seen);
+    if (cached->srtt_us == 0 || age < 0 || age > PEERCACHE_METRICS_MAX_AGE)
+    {
+        return;
+    }
+    double srtt = cached->srtt_us / 1e6;
+    estimatedRTT = srtt;
+    devRTT = cached->rttvar_us / 1e6 + srtt * age / PEERCACHE_METRICS_MAX_AGE;
+    timeoutInterval = estimatedRTT + 4 * devRTT;
+    rttMeasured = true;
+    PROBE_RTO();
+    stats_on_window(&stats, 1, estimatedRTT, timeoutInterval);
+}
+
+// MTU of the route to addr as the kernel knows it (including what path MTU
+// discovery found), 0 if it can't tell
+static uint32_t route_mtu(const struct sockaddr_in *addr)
+{
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0 ||
+        getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) != 0)
+    {
+        mtu = 0;
+    }
+    close(fd);
+    return mtu > 0 ? (uint32_t)mtu : 0;
+}
+
+// One step of the fragment size climb. A fragment's number fixes its
+// offset, so the size can't change within a transfer; each transfer to the
+// server tries the best size so far plus a step instead. A size that beats
+// the best by TUNE_GAIN takes its place and the next step goes the same
+// way, otherwise the step turns around at half the length, until it is
+// under TUNE_FRAG_STEP_MIN and the best size is the one every transfer uses.
+// goodput is in kB/s.
+static void tune_frag_size(struct peer_entry *entry, uint32_t tried, double goodput)
+{
+    if (!entry->frag_best)
+    {
+        entry->frag_best = tried;
+        entry->frag_goodput = (uint32_t)goodput;
+        entry->frag_step = -(int32_t)(tried / 4); // the path's MTU is where it starts, so down
+    }
+    else if (tried == entry->frag_best)
+    {
+        // Settled, or the step went nowhere: keep the best's goodput current
+        entry->frag_goodput = (uint32_t)((1 - ALFA) * entry->frag_goodput + ALFA * goodput);
+        if (entry->frag_step)
+        {
+            entry->frag_step = -entry->frag_step / 2;
+        }
+    }
+    else if (goodput > entry->frag_goodput * (1 + TUNE_GAIN))
+    {
+        entry->frag_best = tried;
+        entry->frag_goodput = (uint32_t)goodput;
+    }
+    else
+    {
+        entry->frag_step = -entry->frag_step / 2;
+    }
+    if (entry->frag_step > -TUNE_FRAG_STEP_MIN && entry->frag_step < TUNE_FRAG_STEP_MIN)
+    {
+        entry->frag_step = 0;
+    }
+}
+
+// Remember the server and the path to it for the next transfer
+static void save_peer(const struct sockaddr_in *addr, const struct xfer_params *agreed, uint32_t asked,
+                      const struct peer_entry *cached)
+{
+    struct peer_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.addr = *addr;
+    entry.last_seen = time(NULL);
+    entry.params = *agreed;
+    if (agreed->frag_limit)
+    {
+        entry.params.max_frag = agreed->frag_limit; // so a later transfer can ask for more
+    }
+    if (cached)
+    {
+        // Still remember what it had that this transfer didn't ask for
+        entry.params.features |= cached->params.features & ~asked;
+        entry.cwnd = cached->cwnd;
+    }
+    if (rttMeasured)
+    {
+        entry.srtt_us = (uint32_t)(estimatedRTT * 1e6);
+        entry.rttvar_us = (uint32_t)(devRTT * 1e6);
+    }
+    if (pathCwnd)
+    {
+        entry.cwnd = pathCwnd;
+    }
+    entry.mtu = route_mtu(addr);
+    if (cached)
+    {
+        entry.frag_best = cached->frag_best;
+        entry.frag_goodput = cached->frag_goodput;
+        entry.frag_step = cached->frag_step;
+    }
+    if (fragTried)
+    {
+        tune_frag_size(&entry, fragTried, transferGoodput / 1000);
+    }
+
+    if (peercache_store(cachePath, &entry) != 0)
+    {
+        perror("peercache_store");
+    }
+}
+
+// Send a packet and wait for the reply of the given type that carries seq,
+// retransmitting with exponential backoff on timeout. Returns the reply length.
+ssize_t send_and_wait(int sockfd, const uint8_t *packet, size_t packetSize, uint8_t replyType,
+                      uint64_t seq, uint8_t *reply, size_t replySize, unsigned *transmissions,
+                      const char *what, struct sockaddr_in *serverAddr)
+{
+    bool secondTry = false;
+    bool needSend = true;
+    *transmissions = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1)
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            stats_dump_json(&stats, "sender", statsPath);
+        }
+
+        if (needSend)
+        {
+            ssize_t sentBytes = sendto(sockfd, packet, packetSize, 0,
+                                       (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+            if (sentBytes < 0)
+            {
+                perror("sendto");
+                return -1;
+            }
+            stats_on_send(&stats, packetSize, secondTry);
+            (*transmissions)++;
+            TRACE(secondTry ? TR_RETRANSMIT : TR_SEND, seq, packetSize);
+            PROBE_SEND(secondTry, seq, packetSize);
+            needSend = false;
+        }
+
+        struct timeval t1;
+        t1.tv_sec = (int)timeoutInterval;
+        t1.tv_usec = (int)((timeoutInterval - (int)timeoutInterval) * 1e6);
+
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &t1, sizeof(t1));
+
+        socklen_t addrLen = sizeof(*serverAddr);
+        ssize_t replyBytes = recvfrom(sockfd, reply, replySize, 0,
+                                      (struct sockaddr *)serverAddr, &addrLen);
+
+        if (replyBytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue; // SIGUSR1, the dump happens at the top of the loop
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                TRACE(TR_TIMEOUT, seq, (uint64_t)(timeoutInterval * 1e6));
+                PROBE2(frag_timeout, seq, (uint64_t)(timeoutInterval * 1e6));
+                timeoutInterval *= 2;
+                PROBE_RTO();
+                secondTry = true;
+                needSend = true;
+                if (early.pending)
+                {
+                    resend_early_setup(sockfd, serverAddr);
+                }
+                stats_on_timeout(&stats);
+                stats_on_window(&stats, 1, estimatedRTT, timeoutInterval);
+                continue;
+            }
+            perror("recvfrom");
+            return -1;
+        }
+
+        int answer = early_answer(reply, replyBytes);
+        if (answer < 0)
+        {
+            return -1;
+        }
+        if (answer > 0)
+        {
+            continue;
+        }
+
+        // ACK and WANT both carry the sequence number right after the type byte
+        uint64_t replySeq;
+        if (replyBytes < 2 || reply[0] != replyType ||
+            varint_decode(reply + 1, replyBytes - 1, &replySeq) == 0)
+        {
+            fprintf(stderr, "Unexpected reply to %s %" PRIu64 " (%zd bytes)\n", what, seq, replyBytes);
+            return -1;
+        }
+        if (replySeq != seq)
+        {
+            // Late reply to something that was already retransmitted, keep waiting
+            TRACE(TR_STALE_ACK, replySeq, seq);
+            stats.stale_acks++;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double sampleRTT = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (!secondTry)
+        {
+            rtt_sample(sampleRTT);
+        }
+        TRACE(TR_ACK, seq, (uint64_t)(sampleRTT * 1e6));
+        PROBE2(frag_ack, seq, (uint64_t)(sampleRTT * 1e6));
+        // Stop-and-wait: the window is always a single fragment
+        stats_on_ack(&stats, (uint64_t)(sampleRTT * 1e6), !secondTry);
+        stats_on_window(&stats, 1, estimatedRTT, timeoutInterval);
+        return replyBytes;
+    }
+}
+
+// Whether len bytes are all zero. ORs 64 bytes at a time into 16 byte
+// vectors, which the compiler keeps in SIMD registers, and only looks at
+// the result once per block.
+static bool all_zero(const uint8_t *p, size_t len)
+{
+    typedef uint8_t bytes16 __attribute__((vector_size(16)));
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        bytes16 a, b, c, d;
+        memcpy(&a, p + i, 16);
+        memcpy(&b, p + i + 16, 16);
+        memcpy(&c, p + i + 32, 16);
+        memcpy(&d, p + i + 48, 16);
+        bytes16 acc = a | b | c | d;
+        uint64_t words[2];
+        memcpy(words, &acc, sizeof(words));
+        if (words[0] | words[1])
+        {
+            return false;
+        }
+    }
+    uint8_t rest = 0;
+    for (; i < len; i++)
+    {
+        rest |= p[i];
+    }
+    return rest == 0;
+}
+
+// Put fragment frag_no, header and payload, into packet_buffer
+// (PACKET_BUFFER_SIZE bytes). Returns the packet length or -1.
+// The header comes from the map's template, the payload is read straight
+// in behind it and then checksummed or encrypted where it lies. With
+// FRAG_FLAG_SHM the payload goes to the fragment's ring slot instead and
+// the packet is just the header.
+int build_fragment(struct xfer_source *src, const struct frag_map *map, uint64_t frag_no, uint8_t flags,
+                   uint8_t *packet_buffer)
+{
+    uint64_t offset, length;
+    bool hole;
+    frag_lookup(map, frag_no, &offset, &length, &hole);
+    size_t tag = (flags & FRAG_FLAG_AEAD) ? AEAD_TAG_LEN : 0;
+    bool shm = flags & FRAG_FLAG_SHM;
+
+    if (!hole)
+    {
+        int header_len = frag_template_fill(&map->header, flags, frag_no, offset, length, 0, packet_buffer,
+                                            PACKET_BUFFER_SIZE);
+        if (header_len < 0 || (shm ? length + tag > shmRing.slot_size
+                                   : header_len + length + tag > PACKET_BUFFER_SIZE))
+        {
+            fprintf(stderr, "Packet size exceeds buffer\n");
+            return -1;
+        }
+        uint8_t *payload = shm ? shm_slot_begin(&shmRing, frag_no) : packet_buffer + header_len;
+        int status = source_read(src, offset, payload, (size_t)length);
+        // Zeros inside a data extent go the same way as a hole: header only
+        bool data = status == 0 && (!sparse || !all_zero(payload, (size_t)length));
+        if (data)
+        {
+            if (flags & FRAG_FLAG_CRC)
+            {
+                frag_patch_crc(packet_buffer, (size_t)header_len, crc32c(0, payload, (size_t)length));
+            }
+            if (tag && aead_seal(&cipher, frag_no, packet_buffer, (size_t)header_len, payload, (size_t)length,
+                                 payload) != 0)
+            {
+                fprintf(stderr, "Encryption failed\n");
+                status = -1;
+            }
+        }
+        if (shm)
+        {
+            shm_slot_end(&shmRing, frag_no);
+        }
+        if (status != 0)
+        {
+            return -1;
+        }
+        if (data)
+        {
+            return shm ? header_len : header_len + (int)(length + tag);
+        }
+    }
+
+    // A zero run has nothing to check a CRC against, nor a slot to put in;
+    // with AEAD the tag covers the header alone
+    int header_len = frag_template_fill(&map->header,
+                                        (uint8_t)((flags & ~(FRAG_FLAG_CRC | FRAG_FLAG_SHM)) | FRAG_FLAG_ZERO),
+                                        frag_no, offset, length, 0, packet_buffer, PACKET_BUFFER_SIZE);
+    if (header_len < 0 || header_len + tag > PACKET_BUFFER_SIZE)
+    {
+        fprintf(stderr, "Header creation failed\n");
+        return -1;
+    }
+    if (tag && aead_seal(&cipher, frag_no, packet_buffer, (size_t)header_len, NULL, 0, packet_buffer + header_len) != 0)
+    {
+        fprintf(stderr, "Encryption failed\n");
+        return -1;
+    }
+    return header_len + (int)tag;
+}
+
+// A fragment that is out and not acknowledged yet. The timer comes first so
+// the wheel's callback can get from the timer back to the fragment.
+struct inflight
+{
+    struct wheel_timer timer; // retransmission deadline
+    uint64_t frag_no;         // 0 = acknowledged, slot free
+    struct timespec sent;     // last transmission
+    int length;               // of the packet in this slot's buffer, built on the first transmission
+    unsigned transmissions;
+    double rto; // this fragment's timeout, doubles with each of its timeouts
+};
+
+// Selective repeat: up to `window` fragments in flight, each ACKed on its
+// own and retransmitted on its own deadline
+struct window_sender
+{
+    int sockfd;
+    struct xfer_source *src;
+    const struct frag_map *map;
+    uint8_t flags;
+    struct sockaddr_in *serverAddr;
+    struct inflight *slots; // indexed by frag_no % window
+    uint8_t *packets;       // one PACKET_BUFFER_SIZE buffer per slot
+    struct zc_pool *zc;     // -z: the slots' buffers come from here instead
+    uint32_t window;
+    uint32_t rwnd;    // FEAT_RWND: what the server's last SACK allowed, 0 = no limit
+    uint32_t rwndLow; // the smallest it got
+    uint64_t base; // oldest fragment not acknowledged
+    uint64_t next; // first fragment never sent
+    uint64_t resentUpTo; // fragments below this had their chance at an early resend
+    struct timer_wheel wheel;
+    struct wheel_timer setupTimer; // repeats an unanswered early SETUP
+    double lastBackoff;
+    int status;
+};
+
+static uint64_t wheel_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) / WHEEL_TICK_NS;
+}
+
+static uint64_t seconds_to_ticks(double seconds)
+{
+    uint64_t ticks = (uint64_t)ceil(seconds * 1e9 / WHEEL_TICK_NS);
+    return ticks ? ticks : 1;
+}
+
+// Fragments in flight that keep a path with this RTT busy at the given rate
+static uint32_t bdp_fragments(double bytesPerSecond, uint32_t fragSize)
+{
+    double fragBytes = fragSize + IP_UDP_HEADERS + 32; // 32: typical DATA header
+    double frags = ceil(bytesPerSecond * estimatedRTT / fragBytes);
+    return frags < 2 ? 2 : frags > UINT32_MAX ? UINT32_MAX : (uint32_t)frags;
+}
+
+// Socket buffers that hold twice `bytes`, within SOCK_BUF_MIN..SOCK_BUF_MAX
+static int sock_buf_for(double bytes)
+{
+    double size = 2 * bytes;
+    return size < SOCK_BUF_MIN ? SOCK_BUF_MIN : size > SOCK_BUF_MAX ? SOCK_BUF_MAX : (int)size;
+}
+
+// Window and batch depth are settled: size the socket buffers for the path
+// as it was measured at the settings kept, wireRate in bytes per second,
+// and for a whole batch going out at once. A transfer over before the
+// first round was measured has nothing to go on and keeps what it had.
+static void tune_done(struct window_sender *ws, const struct tuner *t, uint32_t depth, uint32_t batch,
+                      double wireRate)
+{
+    if (t->rounds == 0)
+    {
+        printf("Not tuned, the transfer was over first: window %u, batch %u\n", depth, batch);
+        return;
+    }
+    uint32_t datagram = IP_UDP_HEADERS + FRAG_HEADER_MAX + (ws->flags & FRAG_FLAG_SHM ? 0 : ws->map->frag_size);
+    double bdp = wireRate * estimatedRTT;
+    int size = sock_buf_for(bdp > (double)batch * datagram ? bdp : (double)batch * datagram);
+    setsockopt(ws->sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(ws->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    stats.tuned_window = depth;
+    stats.tuned_batch = batch;
+    stats.tuned_sock_buf = (uint32_t)size;
+    printf("Tuned: window %u, batch %u, socket buffers %d bytes (%.1f Mbit/s)\n", depth, batch, size,
+           t->best * 8 / 1e6);
+}
+
+// Falls back to copying (returns false) where the kernel has no MSG_ZEROCOPY
+static bool zc_start(struct zc_pool *zc, int sockfd, uint32_t buffers)
+{
+    if (zc_init(zc, sockfd, buffers, PACKET_BUFFER_SIZE) != 0)
+    {
+        perror("MSG_ZEROCOPY, copying instead");
+        return false;
+    }
+    return true;
+}
+
+// Waits for the kernel to let go of every buffer, then frees them
+static void zc_finish(struct zc_pool *zc)
+{
+    for (uint32_t i = 0; i < zc->count; i++)
+    {
+        zc_wait(zc, i);
+    }
+    printf("Zero-copy: %" PRIu64 " sends, %" PRIu64 " copied by the kernel after all\n", zc->sends, zc->copied);
+    zc_free(zc);
+}
+
+// Every slot keeps its packet until it takes the next fragment, so a
+// retransmission sends the same bytes again without reading, checksumming
+// or encrypting anything. With -z the kernel may still hold the buffer
+// from the slot's last fragment; that has been acknowledged, so it is only
+// a matter of waiting for the completion.
+static int window_transmit(struct window_sender *ws, struct inflight *in)
+{
+    uint32_t slot = (uint32_t)(in - ws->slots);
+    uint8_t *packet = ws->zc ? zc_buffer(ws->zc, slot) : ws->packets + (size_t)slot * PACKET_BUFFER_SIZE;
+    if (in->transmissions == 0)
+    {
+        if (ws->zc && zc_wait(ws->zc, slot) != 0)
+        {
+            return -1;
+        }
+        in->length = build_fragment(ws->src, ws->map, in->frag_no, ws->flags, packet);
+        if (in->length < 0)
+        {
+            return -1;
+        }
+    }
+    int packetSize = in->length;
+    if ((ws->zc ? zc_send(ws->zc, slot, packetSize, (struct sockaddr *)ws->serverAddr, sizeof(*ws->serverAddr))
+                : sendto(ws->sockfd, packet, packetSize, 0, (struct sockaddr *)ws->serverAddr,
+                         sizeof(*ws->serverAddr))) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    stats_on_send(&stats, packetSize, in->transmissions > 0);
+    TRACE(in->transmissions > 0 ? TR_RETRANSMIT : TR_SEND, in->frag_no, packetSize);
+    PROBE_SEND(in->transmissions > 0, in->frag_no, packetSize);
+    in->transmissions++;
+    clock_gettime(CLOCK_MONOTONIC, &in->sent);
+    wheel_add(&ws->wheel, &in->timer, wheel_ticks() + seconds_to_ticks(in->rto + maxAckDelay));
+    return 0;
+}
+
+static void window_on_timeout(struct wheel_timer *timer, void *arg)
+{
+    struct window_sender *ws = arg;
+    if (timer == &ws->setupTimer)
+    {
+        resend_early_setup(ws->sockfd, ws->serverAddr); // re-armed by the loop while unanswered
+        return;
+    }
+
+    struct inflight *in = (struct inflight *)timer;
+    TRACE(TR_TIMEOUT, in->frag_no, (uint64_t)(in->rto * 1e6));
+    PROBE2(frag_timeout, in->frag_no, (uint64_t)(in->rto * 1e6));
+    stats_on_timeout(&stats);
+
+    // Back the shared estimate off once per RTO, not once for every
+    // fragment that was in flight when the path stalled
+    double now = now_seconds();
+    if (now - ws->lastBackoff >= timeoutInterval)
+    {
+        timeoutInterval = timeoutInterval * 2 < RTO_MAX ? timeoutInterval * 2 : RTO_MAX;
+        ws->lastBackoff = now;
+        PROBE_RTO();
+        stats_on_window(&stats, ws->window, estimatedRTT, timeoutInterval);
+    }
+    in->rto = in->rto * 2 < RTO_MAX ? in->rto * 2 : RTO_MAX;
+    if (window_transmit(ws, in) != 0)
+    {
+        ws->status = -1;
+    }
+}
+
+// Retires frag_no if it is still outstanding; returns false if it wasn't.
+// Only one fragment per ACK may give an RTT sample.
+static bool window_acked(struct window_sender *ws, uint64_t frag_no, bool sample)
+{
+    struct inflight *in = &ws->slots[frag_no % ws->window];
+    if (frag_no < ws->base || frag_no >= ws->next || in->frag_no != frag_no)
+    {
+        return false;
+    }
+    wheel_cancel(&ws->wheel, &in->timer);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double sampleRTT = (now.tv_sec - in->sent.tv_sec) + (now.tv_nsec - in->sent.tv_nsec) / 1e9;
+    bool valid = sample && in->transmissions == 1; // Karn's rule
+    if (valid && !rttMeasured)
+    {
+        // Everything in flight was timed with the initial guess (or a
+        // backed off one); give it the measured RTO instead
+        rtt_sample(sampleRTT);
+        uint64_t now_ticks = wheel_ticks();
+        for (uint64_t f = ws->base; f < ws->next; f++)
+        {
+            struct inflight *other = &ws->slots[f % ws->window];
+            if (other->frag_no == f && other != in)
+            {
+                other->rto = timeoutInterval;
+                wheel_add(&ws->wheel, &other->timer, now_ticks + seconds_to_ticks(other->rto + maxAckDelay));
+            }
+        }
+    }
+    else if (valid)
+    {
+        rtt_sample(sampleRTT);
+    }
+    TRACE(TR_ACK, frag_no, (uint64_t)(sampleRTT * 1e6));
+    PROBE2(frag_ack, frag_no, (uint64_t)(sampleRTT * 1e6));
+    if (sample)
+    {
+        stats_on_ack(&stats, (uint64_t)(sampleRTT * 1e6), valid);
+    }
+
+    uint64_t offset, length;
+    bool hole;
+    frag_lookup(ws->map, frag_no, &offset, &length, &hole);
+    stats_on_frag_done(&stats, hole ? 0 : length, in->transmissions);
+    in->frag_no = 0;
+    return true;
+}
+
+static void window_slide(struct window_sender *ws)
+{
+    while (ws->base < ws->next && ws->slots[ws->base % ws->window].frag_no != ws->base)
+    {
+        ws->base++;
+    }
+    stats_on_window(&stats, ws->window, estimatedRTT, timeoutInterval);
+}
+
+static void window_on_ack(struct window_sender *ws, uint64_t frag_no)
+{
+    if (!window_acked(ws, frag_no, true))
+    {
+        // Duplicate ACK for a retransmitted fragment
+        TRACE(TR_STALE_ACK, frag_no, ws->base);
+        stats.stale_acks++;
+        return;
+    }
+    window_slide(ws);
+}
+
+static bool outstanding(const struct window_sender *ws, uint64_t frag_no)
+{
+    return frag_no >= ws->base && frag_no < ws->next && ws->slots[frag_no % ws->window].frag_no == frag_no;
+}
+
+// A SACK retires everything up to its cumulative point and every range it
+// lists. The newest of those fragments was the one that triggered the ACK,
+// so it alone gives the RTT sample; the others were held back on purpose.
+static void window_on_sack(struct window_sender *ws, uint64_t cumulative, const struct nack_range *ranges,
+                           uint32_t count)
+{
+    uint64_t newest = 0, highest = cumulative;
+    for (uint64_t f = ws->base; f <= cumulative && f < ws->next; f++)
+    {
+        newest = outstanding(ws, f) ? f : newest;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t end = ranges[i].start + ranges[i].length;
+        for (uint64_t f = ranges[i].start > ws->base ? ranges[i].start : ws->base; f < end && f < ws->next; f++)
+        {
+            newest = outstanding(ws, f) && f > newest ? f : newest;
+        }
+        highest = end - 1 > highest ? end - 1 : highest;
+    }
+    if (newest == 0)
+    {
+        TRACE(TR_STALE_ACK, cumulative, ws->base);
+        stats.stale_acks++;
+        return;
+    }
+
+    for (uint64_t f = ws->base; f <= cumulative && f < ws->next; f++)
+    {
+        window_acked(ws, f, f == newest);
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t end = ranges[i].start + ranges[i].length;
+        for (uint64_t f = ranges[i].start > ws->base ? ranges[i].start : ws->base; f < end && f < ws->next; f++)
+        {
+            window_acked(ws, f, f == newest);
+        }
+    }
+    window_slide(ws);
+
+    // A hole that DUP_THRESH later fragments made it past was lost, not
+    // reordered: resend it now instead of waiting out its timeout. Only once,
+    // after that its timer takes over, with the RTO as it is now rather than
+    // whatever it was when the fragment first went out.
+    uint64_t from = ws->resentUpTo > ws->base ? ws->resentUpTo : ws->base;
+    for (uint64_t f = from; f + DUP_THRESH <= highest && f < ws->next; f++)
+    {
+        struct inflight *in = &ws->slots[f % ws->window];
+        if (outstanding(ws, f) && in->transmissions == 1)
+        {
+            in->rto = timeoutInterval;
+            if (window_transmit(ws, in) != 0)
+            {
+                ws->status = -1;
+                return;
+            }
+        }
+        ws->resentUpTo = f + 1;
+    }
+}
+
+// ACK mode: keep up to `window` fragments in flight. Every fragment has its
+// own retransmission deadline in a timer wheel and the loop sleeps in
+// epoll_wait on the socket and a timerfd set to the earliest deadline, so
+// there is no per-packet timeout syscall and no limit of one packet out.
+// With window = 1 this is plain stop-and-wait. rwnd is the server's window
+// until it sends one of its own, 0 = it won't.
+int window_fragments(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                     uint32_t window, uint32_t rwnd, struct sockaddr_in *serverAddr)
+{
+    struct window_sender ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.sockfd = sockfd;
+    ws.src = src;
+    ws.map = map;
+    ws.flags = flags;
+    ws.serverAddr = serverAddr;
+    ws.window = window ? window : 1;
+    ws.rwnd = ws.rwndLow = rwnd;
+    ws.base = ws.next = 1;
+    ws.slots = calloc(ws.window, sizeof(struct inflight));
+    if (!ws.slots)
+    {
+        perror("calloc");
+        return -1;
+    }
+    wheel_init(&ws.wheel, wheel_ticks());
+    struct zc_pool zc;
+    if (zeroCopy && zc_start(&zc, sockfd, ws.window))
+    {
+        ws.zc = &zc;
+    }
+    else if (!(ws.packets = malloc((size_t)ws.window * PACKET_BUFFER_SIZE)))
+    {
+        perror("malloc");
+        free(ws.slots);
+        return -1;
+    }
+
+    int epfd = epoll_create1(0);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = sockfd;
+    if (epfd < 0 || tfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    {
+        perror("epoll");
+        ws.status = -1;
+    }
+    ev.data.fd = tfd;
+    if (ws.status == 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        ws.status = -1;
+    }
+
+    uint64_t num_frags = map->num_frags;
+    uint64_t armed = UINT64_MAX;
+    uint64_t wireBytes = stats.bytes_on_wire;
+    double started = now_seconds();
+    uint8_t reply[PACKET_BUFFER_SIZE];
+
+    // How much of the window is used and how many fragments go out in one
+    // go before the replies are read start as set up, then are hill-climbed
+    // on goodput for the first TUNE_SECONDS
+    struct tuner tuner;
+    tune_init(&tuner, stats.payload_bytes_acked, started, TUNE_SECONDS);
+    int depthKnob = tune_add(&tuner, "window", ws.window, ws.window > 1 ? 2 : 1, ws.window);
+    int batchKnob = tune_add(&tuner, "batch", ws.window, 1, ws.window);
+    if (!autoTune)
+    {
+        tune_finish(&tuner);
+    }
+
+    while (ws.status == 0 && ws.base <= num_frags)
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            stats_dump_json(&stats, "sender", statsPath);
+        }
+
+        // Fill the window, as far as the server's window goes; an
+        // unanswered early SETUP only allows its first window
+        uint32_t depth = tuner.knobs[depthKnob].value;
+        uint64_t limit = ws.base + (ws.rwnd && ws.rwnd < depth ? ws.rwnd : depth);
+        if (early.pending && limit > 1 + (uint64_t)early.params.early)
+        {
+            limit = 1 + (uint64_t)early.params.early;
+        }
+        if (ws.next <= num_frags && ws.next >= limit && ws.next < ws.base + depth && !early.pending)
+        {
+            stats.rwnd_limited++;
+        }
+        uint32_t batch = tuner.knobs[batchKnob].value;
+        while (ws.status == 0 && ws.next <= num_frags && ws.next < limit && batch-- > 0)
+        {
+            struct inflight *in = &ws.slots[ws.next % ws.window];
+            in->frag_no = ws.next++;
+            in->transmissions = 0;
+            in->rto = timeoutInterval;
+            ws.status = window_transmit(&ws, in);
+        }
+        if (early.pending && !wheel_pending(&ws.setupTimer))
+        {
+            wheel_add(&ws.wheel, &ws.setupTimer, wheel_ticks() + seconds_to_ticks(timeoutInterval));
+        }
+        else if (!early.pending)
+        {
+            wheel_cancel(&ws.wheel, &ws.setupTimer);
+        }
+
+        // Sleep until a reply comes in or the earliest deadline
+        uint64_t due = wheel_next_expiry(&ws.wheel);
+        if (due != armed)
+        {
+            struct itimerspec its;
+            memset(&its, 0, sizeof(its));
+            if (due != UINT64_MAX)
+            {
+                uint64_t ns = due * WHEEL_TICK_NS;
+                its.it_value.tv_sec = ns / 1000000000ULL;
+                its.it_value.tv_nsec = ns % 1000000000ULL;
+            }
+            timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+            armed = due;
+        }
+
+        // Only a look at the socket if the batch ended before the window did
+        struct epoll_event events[2];
+        int n = epoll_wait(epfd, events, 2, ws.next <= num_frags && ws.next < limit ? 0 : -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue; // SIGUSR1, the dump happens at the top of the loop
+            }
+            perror("epoll_wait");
+            ws.status = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.fd == tfd)
+            {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) > 0)
+                {
+                    armed = UINT64_MAX; // one-shot, needs arming again
+                }
+                continue;
+            }
+
+            if (ws.zc && zc_reap(ws.zc, false) != 0)
+            {
+                ws.status = -1;
+                break;
+            }
+
+            // Take everything that is queued, one wakeup can cover many ACKs
+            ssize_t len;
+            while ((len = recvfrom(sockfd, reply, sizeof(reply), MSG_DONTWAIT, NULL, NULL)) > 0)
+            {
+                int answer = early_answer(reply, len);
+                if (answer < 0)
+                {
+                    ws.status = -1;
+                    break;
+                }
+                uint64_t frag_no, receiverId;
+                struct nack_range ranges[SACK_MAX_RANGES];
+                uint32_t count, rwnd;
+                if (answer == 0 && decode_ack(reply, len, &frag_no) > 0)
+                {
+                    window_on_ack(&ws, frag_no);
+                }
+                else if (answer == 0 && decode_sack(reply, len, &frag_no, ranges, &count, &rwnd) > 0)
+                {
+                    window_on_sack(&ws, frag_no, ranges, count);
+                    if (rwnd)
+                    {
+                        ws.rwnd = rwnd;
+                        ws.rwndLow = ws.rwndLow < rwnd ? ws.rwndLow : rwnd;
+                    }
+                }
+                else if (answer == 0 && merkle && decode_done(reply, len, &frag_no, &receiverId) > 0 &&
+                         frag_no == num_frags)
+                {
+                    // Everything arrived and checked out, the final SACK was lost
+                    window_on_sack(&ws, num_frags, NULL, 0);
+                    ws.base = num_frags + 1;
+                    serverDone = true;
+                }
+                else if (answer == 0 && merkle)
+                {
+                    verify_answer(sockfd, reply, len, map, NULL, serverAddr);
+                }
+            }
+        }
+        wheel_advance(&ws.wheel, wheel_ticks(), window_on_timeout, &ws);
+
+        double now = now_seconds();
+        double round = TUNE_ROUND_RTTS * estimatedRTT;
+        if (tune_update(&tuner, stats.payload_bytes_acked, now, round > TUNE_ROUND_MIN ? round : TUNE_ROUND_MIN) &&
+            tuner.finished)
+        {
+            tune_done(&ws, &tuner, tuner.knobs[depthKnob].value, tuner.knobs[batchKnob].value,
+                      (stats.bytes_on_wire - wireBytes) / (now - started));
+        }
+    }
+
+    if (autoTune && !tuner.finished)
+    {
+        // Over before tuning was; what was kept is still worth reporting
+        tune_finish(&tuner);
+        double secs = now_seconds() - started;
+        tune_done(&ws, &tuner, tuner.knobs[depthKnob].value, tuner.knobs[batchKnob].value,
+                  secs > 0 ? (stats.bytes_on_wire - wireBytes) / secs : 0);
+    }
+    if (ws.status == 0)
+    {
+        double secs = now_seconds() - started;
+        uint32_t cwnd = secs > 0 ? bdp_fragments((stats.bytes_on_wire - wireBytes) / secs, map->frag_size) : 2;
+        pathCwnd = cwnd < ws.window ? cwnd : ws.window;
+    }
+    if (stats.rwnd_limited)
+    {
+        printf("Server's window held sending back %" PRIu64 " times, down to %u fragments\n", stats.rwnd_limited,
+               ws.rwndLow);
+    }
+    if (tfd >= 0)
+    {
+        close(tfd);
+    }
+    if (epfd >= 0)
+    {
+        close(epfd);
+    }
+    if (ws.zc)
+    {
+        zc_finish(ws.zc);
+    }
+    free(ws.packets);
+    free(ws.slots);
+    return ws.status;
+}
+
+int frag_map_init(struct frag_map *map, const struct region_list *regions, uint32_t frag_size)
+{
+    map->regions = regions;
+    map->num_frags = 0;
+    map->frag_size = frag_size;
+    map->first_frag = malloc((regions->count + 1) * sizeof(uint64_t));
+    if (!map->first_frag)
+    {
+        return -1;
+    }
+    for (size_t r = 0; r < regions->count; r++)
+    {
+        map->first_frag[r] = map->num_frags + 1;
+        map->num_frags += regions->items[r].hole ? 1 : (regions->items[r].length + frag_size - 1) / frag_size;
+    }
+    if (map->num_frags == 0)
+    {
+        map->num_frags = 1; // nothing to send, still send one fragment with size = 0
+    }
+    return 0;
+}
+
+void frag_lookup(const struct frag_map *map, uint64_t frag_no, uint64_t *offset, uint64_t *length, bool *hole)
+{
+    const struct region_list *regions = map->regions;
+    *hole = false;
+    if (regions->count == 0)
+    {
+        *offset = 0;
+        *length = 0;
+        return;
+    }
+
+    // Last region whose first fragment is <= frag_no
+    size_t lo = 0, hi = regions->count - 1;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        if (map->first_frag[mid] <= frag_no)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    const struct region *r = &regions->items[lo];
+    if (r->hole)
+    {
+        *offset = r->offset;
+        *length = r->length;
+        *hole = true;
+        return;
+    }
+    uint64_t within = (frag_no - map->first_frag[lo]) * map->frag_size;
+    *offset = r->offset + within;
+    *length = r->length - within > map->frag_size ? map->frag_size : r->length - within;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fragments the server asked for again, oldest request first
+struct retransmit_queue
+{
+    struct nack_range *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+};
+
+static void retransmit_push(struct retransmit_queue *q, uint64_t start, uint64_t length)
+{
+    if (q->head > 0 && q->head == q->count)
+    {
+        q->head = q->count = 0;
+    }
+    if (q->count == q->capacity)
+    {
+        q->capacity = q->capacity ? q->capacity * 2 : 64;
+        q->items = realloc(q->items, q->capacity * sizeof(struct nack_range));
+        if (!q->items)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    q->items[q->count].start = start;
+    q->items[q->count].length = length;
+    q->count++;
+}
+
+// Remembers recently repaired fragments so NACKs for the same loss coming
+// from several receivers (or a repeated NACK that crossed the repair) don't
+// each trigger a retransmission. Direct mapped, so it costs a fixed 64 KiB.
+#define REPAIR_CACHE_SLOTS 4096
+#define REPAIR_HOLDOFF 0.005
+
+struct repair_cache
+{
+    uint64_t frag[REPAIR_CACHE_SLOTS];
+    double sent[REPAIR_CACHE_SLOTS];
+};
+
+static bool repair_recent(struct repair_cache *cache, uint64_t frag_no, double now)
+{
+    size_t slot = frag_no % REPAIR_CACHE_SLOTS;
+    if (cache->frag[slot] == frag_no && now - cache->sent[slot] < REPAIR_HOLDOFF)
+    {
+        return true;
+    }
+    cache->frag[slot] = frag_no;
+    cache->sent[slot] = now;
+    return false;
+}
+
+// Fragments holding any byte of blocks [first, first + count) of fileTree
+static void repair_push(struct retransmit_queue *q, const struct frag_map *map, uint64_t first, uint64_t count)
+{
+    const struct region_list *regions = map->regions;
+    uint64_t start = first * fileTree.block;
+    uint64_t end = (first + count) * fileTree.block;
+    end = end < fileTree.size ? end : fileTree.size;
+    if (regions->count == 0)
+    {
+        retransmit_push(q, 1, 1); // the single empty fragment
+        return;
+    }
+    for (size_t r = 0; r < regions->count; r++)
+    {
+        const struct region *reg = &regions->items[r];
+        uint64_t from = start > reg->offset ? start : reg->offset;
+        uint64_t to = end < reg->offset + reg->length ? end : reg->offset + reg->length;
+        if (from >= to)
+        {
+            continue;
+        }
+        uint64_t f = map->first_frag[r], l = map->first_frag[r];
+        if (!reg->hole)
+        {
+            f += (from - reg->offset) / map->frag_size;
+            l += (to - 1 - reg->offset) / map->frag_size;
+        }
+        struct nack_range *last = q->count > q->head ? &q->items[q->count - 1] : NULL;
+        if (last && last->start + last->length == f)
+        {
+            last->length += l - f + 1;
+        }
+        else
+        {
+            retransmit_push(q, f, l - f + 1);
         }
     }
-    else
-    {
-        fprintf(stderr, "Unexpected ACK response: \"%s\"\n", ack_buffer);
-        return -1;
-    }
+}
 
+// FEAT_MERKLE: the server hashes every block as it completes and, if the
+// root comes out different, walks down our tree to the blocks that differ
+// and asks for those again. Answers a TREE_REQ from fileTree and queues the
+// fragments of a REPAIR (queue may be NULL while the data is still going
+// out, the server asks again). Returns 1 if the reply was one of those.
+static int verify_answer(int sockfd, const uint8_t *reply, size_t len, const struct frag_map *map,
+                         struct retransmit_queue *queue, struct sockaddr_in *serverAddr)
+{
+    struct tree_node nodes[TREE_MAX_NODES];
+    struct nack_range ranges[REPAIR_MAX_RANGES];
+    uint32_t count;
+    if (decode_tree(reply, len, PKT_TREE_REQ, nodes, &count) > 0)
+    {
+        uint32_t valid = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (nodes[i].level < fileTree.levels && nodes[i].index < fileTree.width[nodes[i].level])
+            {
+                nodes[valid] = nodes[i];
+                memcpy(nodes[valid].hash, merkle_node(&fileTree, nodes[i].level, nodes[i].index), TREE_HASH_LEN);
+                valid++;
+            }
+        }
+        uint8_t packet[PACKET_BUFFER_SIZE];
+        int packetLen = encode_tree(PKT_TREE, nodes, valid, packet, sizeof(packet));
+        if (packetLen > 0)
+        {
+            sendto(sockfd, packet, packetLen, 0, (struct sockaddr *)serverAddr, sizeof(*serverAddr));
+        }
+        return 1;
+    }
+    if (decode_repair(reply, len, ranges, &count) > 0)
+    {
+        uint64_t blocks = merkle_blocks(&fileTree), asked = 0;
+        for (uint32_t i = 0; queue && i < count; i++)
+        {
+            if (ranges[i].start < blocks)
+            {
+                uint64_t length = ranges[i].length < blocks - ranges[i].start ? ranges[i].length
+                                                                              : blocks - ranges[i].start;
+                repair_push(queue, map, ranges[i].start, length);
+                asked += length;
+            }
+        }
+        if (asked)
+        {
+            printf("Server found %" PRIu64 " damaged block(s), resending them\n", asked);
+        }
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// NACK mode: send every fragment once at the paced rate and only resend what
+// the server reports missing. The retransmission timeout is just a backstop
+// for losing the tail of the transfer (or the NACKs themselves): when it
+// fires, the last fragment is sent again so the server notices what is left.
+//
+// serverAddr may be a multicast group. Then every receiver NACKs on its
+// own, the NACKs are merged here, repairs go to the whole group and the
+// transfer ends once `receivers` distinct receivers have reported DONE.
+int stream_fragments(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                     double rateMbps, int receivers,
+                     struct sockaddr_in *serverAddr)
+{
+    static struct repair_cache repairs;
+    uint64_t *done = calloc(receivers, sizeof(uint64_t)); // ids of the receivers that finished
+    int doneCount = 0;
+    uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    struct retransmit_queue queue = {0};
+    uint64_t num_frags = map->num_frags;
+    uint64_t next_new = 1; // next fragment that has never been sent
+    double next_send = now_seconds();
+    double last_heard = next_send;
+    int status = -1;
+    // -z: packets cycle through the pool; a repair is built again from the file, not resent from it
+    struct zc_pool zc;
+    bool useZc = zeroCopy && zc_start(&zc, sockfd, STREAM_ZC_BUFFERS);
+    uint32_t zcNext = 0;
+
+    while (1)
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            stats_dump_json(&stats, "sender", statsPath);
+        }
+
+        double now = now_seconds();
+        // Before the server has answered an early SETUP only its first window may go out
+        bool canSendNew = next_new <= num_frags && (!early.pending || next_new <= early.params.early);
+        bool pending = queue.head < queue.count || canSendNew;
+
+        if (pending && now >= next_send)
+        {
+            uint64_t frag_no;
+            bool retransmit = queue.head < queue.count;
+            if (retransmit)
+            {
+                struct nack_range *r = &queue.items[queue.head];
+                frag_no = r->start++;
+                if (--r->length == 0)
+                {
+                    queue.head++;
+                }
+                if (repair_recent(&repairs, frag_no, now))
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                frag_no = next_new++;
+            }
+
+            uint32_t slot = zcNext++ % STREAM_ZC_BUFFERS;
+            if (useZc && zc_wait(&zc, slot) != 0)
+            {
+                break;
+            }
+            uint8_t *packet = useZc ? zc_buffer(&zc, slot) : packet_buffer;
+            int packetSize = build_fragment(src, map, frag_no, flags, packet);
+            if (packetSize < 0)
+            {
+                break;
+            }
+            if ((useZc ? zc_send(&zc, slot, packetSize, (struct sockaddr *)serverAddr, sizeof(*serverAddr))
+                       : sendto(sockfd, packet, packetSize, 0, (struct sockaddr *)serverAddr,
+                                sizeof(*serverAddr))) < 0)
+            {
+                perror("sendto");
+                break;
+            }
+            stats_on_send(&stats, packetSize, retransmit);
+            TRACE(retransmit ? TR_RETRANSMIT : TR_SEND, frag_no, packetSize);
+            PROBE_SEND(retransmit, frag_no, packetSize);
+
+            // Pace: the next packet may leave once this one has drained at the target rate.
+            // Don't bank credit while idle, that would turn into a burst.
+            // A fragment through the shared memory ring counts with its payload.
+            double gap = (packetSize + 28 + ((flags & FRAG_FLAG_SHM) ? map->frag_size : 0)) * 8 / (rateMbps * 1e6);
+            next_send = (next_send + gap < now) ? now : next_send + gap;
+            continue;
+        }
+
+        // Wait for a NACK/DONE until the next send slot, or the backstop timeout
+        double wait = pending ? next_send - now : last_heard + timeoutInterval - now;
+        int timeout_ms = wait > 0 ? (int)(wait * 1000) : 0;
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (ready == 0)
+        {
+            if (!pending && now_seconds() >= last_heard + timeoutInterval)
+            {
+                // Tail loss backstop: poke the server with the last fragment
+                TRACE(TR_TIMEOUT, num_frags, (uint64_t)(timeoutInterval * 1e6));
+                PROBE2(frag_timeout, num_frags, (uint64_t)(timeoutInterval * 1e6));
+                stats_on_timeout(&stats);
+                timeoutInterval *= 2;
+                PROBE_RTO();
+                stats_on_window(&stats, 1, estimatedRTT, timeoutInterval);
+                if (early.pending)
+                {
+                    resend_early_setup(sockfd, serverAddr); // the SETUP itself may be what got lost
+                }
+                else
+                {
+                    retransmit_push(&queue, num_frags, 1);
+                }
+                last_heard = now_seconds();
+            }
+            continue;
+        }
+
+        if (useZc && (pfd.revents & POLLERR) && zc_reap(&zc, false) != 0)
+        {
+            break;
+        }
+
+        // Replies come from the receivers' own addresses, never the group
+        struct sockaddr_in from;
+        socklen_t addrLen = sizeof(from);
+        ssize_t n = recvfrom(sockfd, reply, sizeof(reply), MSG_DONTWAIT,
+                             (struct sockaddr *)&from, &addrLen);
+        if (n <= 0)
+        {
+            continue;
+        }
+        last_heard = now_seconds();
+
+        int answer = early_answer(reply, n);
+        if (answer < 0)
+        {
+            break;
+        }
+        if (answer > 0)
+        {
+            continue;
+        }
+
+        if (merkle && verify_answer(sockfd, reply, n, map, &queue, serverAddr))
+        {
+            continue;
+        }
+
+        uint64_t total;
+        struct nack_range ranges[NACK_MAX_RANGES];
+        uint32_t count;
+        uint64_t receiverId;
+        if (decode_done(reply, n, &total, &receiverId) > 0 && total == num_frags)
+        {
+            // Receivers on one host share the group's address and port, so
+            // count them by the id they put in DONE
+            bool seen = false;
+            for (int i = 0; i < doneCount; i++)
+            {
+                seen |= done[i] == receiverId;
+            }
+            if (!seen && doneCount < receivers)
+            {
+                done[doneCount++] = receiverId;
+                TRACE(TR_DONE, total, doneCount);
+                stats.acks_received++;
+                if (receivers > 1)
+                {
+                    printf("Receiver %d/%d done\n", doneCount, receivers);
+                }
+            }
+            if (doneCount == receivers)
+            {
+                status = 0;
+                break;
+            }
+            continue;
+        }
+        if (decode_nack(reply, n, ranges, &count) > 0)
+        {
+            stats.nacks_received++;
+            TRACE(TR_NACK_RECV, count ? ranges[0].start : 0, count);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                // Only fragments that were actually sent can be missing
+                uint64_t start = ranges[i].start ? ranges[i].start : 1;
+                uint64_t end = ranges[i].start + ranges[i].length;
+                if (end > next_new)
+                {
+                    end = next_new;
+                }
+                if (start < end)
+                {
+                    retransmit_push(&queue, start, end - start);
+                }
+            }
+        }
+    }
+
+    if (status == 0)
+    {
+        // What was in flight at the paced rate
+        pathCwnd = bdp_fragments(rateMbps * 1e6 / 8, map->frag_size);
+        stats.payload_bytes_acked = 0;
+        for (size_t r = 0; r < map->regions->count; r++)
+        {
+            stats.payload_bytes_acked += map->regions->items[r].hole ? 0 : map->regions->items[r].length;
+        }
+    }
+    if (useZc)
+    {
+        zc_finish(&zc);
+    }
+    free(queue.items);
+    free(done);
+    return status;
+}
+
+#define VERDICT_PROBES 10 // quiet timeouts in a row before giving up on the server
+
+// ACK mode with FEAT_MERKLE: every fragment is acknowledged, but the file
+// isn't done until the server sends DONE, which it only does once its root
+// matches ours. Until then answer its TREE_REQs and resend what each REPAIR
+// names. If it goes quiet, poke it with the last fragment as in NACK mode.
+int await_verdict(int sockfd, struct xfer_source *src, const struct frag_map *map, uint8_t flags,
+                  struct sockaddr_in *serverAddr)
+{
+    uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    struct retransmit_queue queue = {0};
+    int probes = 0;
+    int status = -1;
+    bool failed = false;
+
+    while (!failed && probes <= VERDICT_PROBES)
+    {
+        // Repairs go out back to back, the server asks again for anything that gets lost
+        while (queue.head < queue.count)
+        {
+            struct nack_range *r = &queue.items[queue.head];
+            uint64_t frag_no = r->start++;
+            if (--r->length == 0)
+            {
+                queue.head++;
+            }
+            int packetSize = build_fragment(src, map, frag_no, flags, packet_buffer);
+            if (packetSize < 0 || sendto(sockfd, packet_buffer, packetSize, 0, (struct sockaddr *)serverAddr,
+                                         sizeof(*serverAddr)) < 0)
+            {
+                perror("sendto");
+                failed = true;
+                break;
+            }
+            stats_on_send(&stats, packetSize, true);
+            TRACE(TR_RETRANSMIT, frag_no, packetSize);
+            PROBE2(frag_retransmit, frag_no, packetSize);
+        }
+        if (failed)
+        {
+            break;
+        }
+
+        // Back off like an RTO, the server may be busy hashing
+        double wait = (timeoutInterval + maxAckDelay) * (1 << probes);
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int)((wait < RTO_MAX ? wait : RTO_MAX) * 1000) + 1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (ready == 0)
+        {
+            probes++;
+            TRACE(TR_TIMEOUT, map->num_frags, (uint64_t)(timeoutInterval * 1e6));
+            PROBE2(frag_timeout, map->num_frags, (uint64_t)(timeoutInterval * 1e6));
+            stats_on_timeout(&stats);
+            retransmit_push(&queue, map->num_frags, 1);
+            continue;
+        }
+
+        ssize_t n = recvfrom(sockfd, reply, sizeof(reply), MSG_DONTWAIT, NULL, NULL);
+        if (n <= 0)
+        {
+            continue;
+        }
+        uint64_t total, receiverId;
+        if (decode_done(reply, n, &total, &receiverId) > 0 && total == map->num_frags)
+        {
+            TRACE(TR_DONE, total, 1);
+            status = 0;
+            break;
+        }
+        if (verify_answer(sockfd, reply, n, map, &queue, serverAddr))
+        {
+            probes = 0;
+        }
+    }
+    if (probes > VERDICT_PROBES)
+    {
+        fprintf(stderr, "Server never confirmed the file.\n");
+    }
+    free(queue.items);
+    return status;
+}
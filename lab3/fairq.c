@@ -0,0 +1,124 @@
+#include <stddef.h>
+#include "fairq.h"
+
+void fq_init(struct fq_sched *s, uint32_t quantum)
+{
+    s->head = s->tail = NULL;
+    s->quantum = quantum;
+}
+
+void fq_flow_init(struct fq_flow *f, uint32_t weight)
+{
+    f->head = f->tail = NULL;
+    f->queued = 0;
+    f->weight = weight ? weight : 1;
+    f->deficit = 0;
+    f->active = false;
+    f->credited = false;
+    f->next_active = NULL;
+}
+
+static void round_append(struct fq_sched *s, struct fq_flow *f)
+{
+    f->next_active = NULL;
+    if (s->tail)
+    {
+        s->tail->next_active = f;
+    }
+    else
+    {
+        s->head = f;
+    }
+    s->tail = f;
+}
+
+void fq_enqueue(struct fq_sched *s, struct fq_flow *f, struct fq_item *item)
+{
+    item->next = NULL;
+    if (f->tail)
+    {
+        f->tail->next = item;
+    }
+    else
+    {
+        f->head = item;
+    }
+    f->tail = item;
+    f->queued++;
+    if (!f->active)
+    {
+        f->active = true;
+        f->credited = false;
+        round_append(s, f);
+    }
+}
+
+struct fq_item *fq_dequeue(struct fq_sched *s, struct fq_flow **flow)
+{
+    while (s->head)
+    {
+        struct fq_flow *f = s->head;
+        if (!f->credited)
+        {
+            f->deficit += (uint64_t)s->quantum * f->weight;
+            f->credited = true;
+        }
+        if (f->head->cost > f->deficit)
+        {
+            // Turn over, the credit carries to the next one
+            f->credited = false;
+            s->head = f->next_active;
+            if (!s->head)
+            {
+                s->tail = NULL;
+            }
+            round_append(s, f);
+            continue;
+        }
+
+        struct fq_item *item = f->head;
+        f->head = item->next;
+        if (!f->head)
+        {
+            f->tail = NULL;
+        }
+        f->queued--;
+        f->deficit -= item->cost;
+        if (!f->head)
+        {
+            // Nothing left to spend the credit on
+            f->active = false;
+            f->deficit = 0;
+            s->head = f->next_active;
+            if (!s->head)
+            {
+                s->tail = NULL;
+            }
+        }
+        *flow = f;
+        return item;
+    }
+    return NULL;
+}
+
+struct fq_item *fq_flush(struct fq_sched *s, struct fq_flow *f)
+{
+    if (f->active)
+    {
+        struct fq_flow **p = &s->head;
+        struct fq_flow *prev = NULL;
+        while (*p != f)
+        {
+            prev = *p;
+            p = &(*p)->next_active;
+        }
+        *p = f->next_active;
+        if (s->tail == f)
+        {
+            s->tail = prev;
+        }
+    }
+    struct fq_item *items = f->head;
+    fq_flow_init(f, f->weight);
+    return items;
+}
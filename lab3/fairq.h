@@ -0,0 +1,50 @@
+#ifndef FAIRQ_H
+#define FAIRQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Deficit round robin (Shreedhar & Varghese) over per-flow FIFOs.
+//
+// Flows with work queued take turns. On its turn a flow is credited
+// quantum * weight, serves items from its head while their cost fits in the
+// credit and keeps what is left for its next turn; a flow that empties
+// forfeits the rest. Over any busy period each flow gets a share of the
+// total cost in proportion to its weight, whatever the sizes of its items,
+// and picking the next item is O(1).
+//
+// Items and flows are intrusive: embed them in whatever is being queued
+// and whatever owns the queue, the scheduler never allocates.
+
+struct fq_item
+{
+    struct fq_item *next;
+    uint32_t cost;
+};
+
+struct fq_flow
+{
+    struct fq_item *head, *tail;
+    uint32_t queued; // items
+    uint32_t weight; // at least 1
+    uint64_t deficit;
+    bool active;   // in the round
+    bool credited; // had this turn's quantum
+    struct fq_flow *next_active;
+};
+
+struct fq_sched
+{
+    struct fq_flow *head, *tail; // flows with work, head's turn
+    uint32_t quantum;             // credit per turn and unit of weight, at least the largest cost
+};
+
+void fq_init(struct fq_sched *s, uint32_t quantum);
+void fq_flow_init(struct fq_flow *f, uint32_t weight);
+void fq_enqueue(struct fq_sched *s, struct fq_flow *f, struct fq_item *item);
+// The next item in DRR order, NULL when nothing is queued; *flow is set to its flow
+struct fq_item *fq_dequeue(struct fq_sched *s, struct fq_flow **flow);
+// Takes f out of the round; returns its items as a list for the caller to free
+struct fq_item *fq_flush(struct fq_sched *s, struct fq_flow *f);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "merkle.h"
+
+#define BLOCKS_PER_CLAIM 16 // blocks a worker takes at a time; consecutive ones keep readahead useful
+#define MAX_THREADS 64
+
+int merkle_init(struct merkle_tree *t, uint64_t size, uint32_t block)
+{
+    memset(t, 0, sizeof(*t));
+    t->size = size;
+    t->block = block;
+
+    uint64_t width = size ? (size + block - 1) / block : 1; // an empty file still has a root
+    t->levels = 1;
+    for (uint64_t w = width; w > 1; w = (w + 1) / 2)
+    {
+        t->levels++;
+    }
+    t->width = calloc(t->levels, sizeof(uint64_t));
+    t->nodes = calloc(t->levels, sizeof(uint8_t *));
+    if (!t->width || !t->nodes)
+    {
+        merkle_free(t);
+        return -1;
+    }
+    for (uint32_t l = 0; l < t->levels; l++)
+    {
+        t->width[l] = width;
+        t->nodes[l] = calloc(width, TREE_HASH_LEN);
+        if (!t->nodes[l])
+        {
+            merkle_free(t);
+            return -1;
+        }
+        width = (width + 1) / 2;
+    }
+    return 0;
+}
+
+void merkle_free(struct merkle_tree *t)
+{
+    for (uint32_t l = 0; t->nodes && l < t->levels; l++)
+    {
+        free(t->nodes[l]);
+    }
+    free(t->nodes);
+    free(t->width);
+    memset(t, 0, sizeof(*t));
+}
+
+static uint64_t block_length(const struct merkle_tree *t, uint64_t block)
+{
+    uint64_t start = block * t->block;
+    return t->size - start < t->block ? t->size - start : t->block;
+}
+
+int merkle_hash_block(struct merkle_tree *t, uint64_t block, merkle_read_fn read, void *ctx, uint8_t *buf)
+{
+    size_t len = t->size ? (size_t)block_length(t, block) : 0;
+    if (len > 0 && read(ctx, block * t->block, buf, len) != 0)
+    {
+        return -1;
+    }
+    EVP_Digest(buf, len, t->nodes[0] + block * TREE_HASH_LEN, NULL, EVP_sha256(), NULL);
+    return 0;
+}
+
+void merkle_zero_block(struct merkle_tree *t, uint64_t block)
+{
+    // Every whole block of zeros hashes the same, so that one is worked out once
+    uint64_t len = block_length(t, block);
+    uint8_t *leaf = t->nodes[0] + block * TREE_HASH_LEN;
+    if (len == t->block && t->zero_known)
+    {
+        memcpy(leaf, t->zero_hash, TREE_HASH_LEN);
+        return;
+    }
+
+    uint8_t *zeros = calloc(1, len ? len : 1);
+    if (!zeros)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    EVP_Digest(zeros, len, leaf, NULL, EVP_sha256(), NULL);
+    free(zeros);
+    if (len == t->block)
+    {
+        memcpy(t->zero_hash, leaf, TREE_HASH_LEN);
+        t->zero_known = true;
+    }
+}
+
+void merkle_update(struct merkle_tree *t)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    for (uint32_t l = 1; l < t->levels; l++)
+    {
+        const uint8_t *below = t->nodes[l - 1];
+        for (uint64_t i = 0; i < t->width[l]; i++)
+        {
+            uint8_t *node = t->nodes[l] + i * TREE_HASH_LEN;
+            if (2 * i + 1 == t->width[l - 1])
+            {
+                memcpy(node, below + 2 * i * TREE_HASH_LEN, TREE_HASH_LEN); // no partner
+                continue;
+            }
+            EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+            EVP_DigestUpdate(ctx, below + 2 * i * TREE_HASH_LEN, 2 * TREE_HASH_LEN);
+            EVP_DigestFinal_ex(ctx, node, NULL);
+        }
+    }
+    EVP_MD_CTX_free(ctx);
+}
+
+struct build_job
+{
+    struct merkle_tree *tree;
+    merkle_read_fn read;
+    void *ctx;
+    atomic_uint_fast64_t next; // first block nobody has claimed
+    atomic_int failed;
+};
+
+static void *build_worker(void *arg)
+{
+    struct build_job *job = arg;
+    struct merkle_tree *t = job->tree;
+    uint64_t blocks = merkle_blocks(t);
+    uint8_t *buf = malloc(t->block);
+    if (!buf)
+    {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+
+    while (!atomic_load_explicit(&job->failed, memory_order_relaxed))
+    {
+        uint64_t first = atomic_fetch_add(&job->next, BLOCKS_PER_CLAIM);
+        if (first >= blocks)
+        {
+            break;
+        }
+        uint64_t last = first + BLOCKS_PER_CLAIM < blocks ? first + BLOCKS_PER_CLAIM : blocks;
+        for (uint64_t b = first; b < last; b++)
+        {
+            if (merkle_hash_block(t, b, job->read, job->ctx, buf) != 0)
+            {
+                atomic_store(&job->failed, 1);
+                break;
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int merkle_build(struct merkle_tree *t, merkle_read_fn read, void *ctx, unsigned threads)
+{
+    if (threads == 0)
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores > 0 ? (unsigned)cores : 1;
+    }
+    if (threads > MAX_THREADS)
+    {
+        threads = MAX_THREADS;
+    }
+    uint64_t claims = (merkle_blocks(t) + BLOCKS_PER_CLAIM - 1) / BLOCKS_PER_CLAIM;
+    if (threads > claims)
+    {
+        threads = claims ? (unsigned)claims : 1;
+    }
+
+    struct build_job job = {.tree = t, .read = read, .ctx = ctx};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+
+    // This thread is one of the workers
+    pthread_t workers[MAX_THREADS];
+    unsigned started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, build_worker, &job) == 0)
+    {
+        started++;
+    }
+    build_worker(&job);
+    for (unsigned i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    if (atomic_load(&job.failed))
+    {
+        return -1;
+    }
+    merkle_update(t);
+    return 0;
+}
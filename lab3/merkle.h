@@ -0,0 +1,62 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+
+// Merkle tree over fixed-size blocks of a file.
+//
+// Level 0 holds SHA-256 of each block (the last one may be short), every
+// level above holds SHA-256(left || right) of pairs from the level below,
+// and a node without a partner moves up unchanged. The top level is the
+// root. Any block can then be checked on its own, and two trees that differ
+// can be compared top down, following only the subtrees that differ.
+
+#define MERKLE_BLOCK_DEFAULT (64 * 1024)
+
+struct merkle_tree
+{
+    uint64_t size;   // bytes covered
+    uint32_t block;  // bytes per leaf
+    uint32_t levels; // levels - 1 is the root
+    uint64_t *width; // nodes on each level
+    uint8_t **nodes; // nodes[level] holds width[level] hashes
+    bool zero_known; // zero_hash is worked out
+    uint8_t zero_hash[TREE_HASH_LEN]; // of a whole block of zeros
+};
+
+// Reads len bytes at offset into buf; returns 0, or -1 if it couldn't
+typedef int (*merkle_read_fn)(void *ctx, uint64_t offset, void *buf, size_t len);
+
+// An all-zero tree; returns -1 if out of memory
+int merkle_init(struct merkle_tree *t, uint64_t size, uint32_t block);
+void merkle_free(struct merkle_tree *t);
+
+// Hashes every block, spread over threads threads (0 = one per core), then
+// the levels above. read must be safe to call from several threads at once.
+int merkle_build(struct merkle_tree *t, merkle_read_fn read, void *ctx, unsigned threads);
+// Hashes one block into level 0, buf must hold t->block bytes
+int merkle_hash_block(struct merkle_tree *t, uint64_t block, merkle_read_fn read, void *ctx, uint8_t *buf);
+// Level 0 entry for a block that is known to be all zeros, without reading it
+void merkle_zero_block(struct merkle_tree *t, uint64_t block);
+// Recomputes every level above the leaves
+void merkle_update(struct merkle_tree *t);
+
+static inline uint64_t merkle_blocks(const struct merkle_tree *t)
+{
+    return t->width[0];
+}
+
+static inline const uint8_t *merkle_node(const struct merkle_tree *t, uint32_t level, uint64_t index)
+{
+    return t->nodes[level] + index * TREE_HASH_LEN;
+}
+
+static inline const uint8_t *merkle_root(const struct merkle_tree *t)
+{
+    return merkle_node(t, t->levels - 1, 0);
+}
+
+#endif
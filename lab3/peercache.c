@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include "peercache.h"
+
+const char *peercache_default_path(void)
+{
+    static char path[4096];
+    const char *home = getenv("HOME");
+    if (!home || !home[0])
+    {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/.deliver_peers", home);
+    return path;
+}
+
+static int parse_entry(const char *line, struct peer_entry *e)
+{
+    char ip[INET_ADDRSTRLEN];
+    unsigned port;
+    long long last_seen;
+    struct xfer_params *p = &e->params;
+
+    memset(e, 0, sizeof(*e));
+    int n = sscanf(line, "%15[^:]:%u %lld %u %x %u %u %u %u %u %u %u %u %u %d", ip, &port, &last_seen,
+                   &p->version, &p->features, &p->max_frag, &p->window, &p->sock_buf, &e->srtt_us, &e->rttvar_us,
+                   &e->cwnd, &e->mtu, &e->frag_best, &e->frag_goodput, &e->frag_step);
+    if ((n != 8 && n != 12 && n != 15) || port > 65535 || inet_pton(AF_INET, ip, &e->addr.sin_addr) <= 0)
+    {
+        return -1;
+    }
+    e->addr.sin_family = AF_INET;
+    e->addr.sin_port = htons((uint16_t)port);
+    e->last_seen = (time_t)last_seen;
+    return 0;
+}
+
+static void write_entry(FILE *fp, const struct peer_entry *e)
+{
+    char ip[INET_ADDRSTRLEN];
+    const struct xfer_params *p = &e->params;
+    inet_ntop(AF_INET, &e->addr.sin_addr, ip, sizeof(ip));
+    fprintf(fp, "%s:%u %lld %u 0x%x %u %u %u %u %u %u %u %u %u %d\n", ip, ntohs(e->addr.sin_port),
+            (long long)e->last_seen, p->version, p->features, p->max_frag, p->window, p->sock_buf, e->srtt_us,
+            e->rttvar_us, e->cwnd, e->mtu, e->frag_best, e->frag_goodput, e->frag_step);
+}
+
+static bool same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+int peercache_lookup(const char *path, const struct sockaddr_in *addr, struct peer_entry *entry)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        return 0;
+    }
+
+    char line[256];
+    int found = 0;
+    time_t now = time(NULL);
+    while (!found && fgets(line, sizeof(line), fp))
+    {
+        struct peer_entry e;
+        if (parse_entry(line, &e) == 0 && same_peer(&e.addr, addr) && now - e.last_seen <= PEERCACHE_MAX_AGE)
+        {
+            *entry = e;
+            found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+int peercache_store(const char *path, const struct peer_entry *entry)
+{
+    // Keep the newest entries: this one first, then the rest in file order
+    static struct peer_entry entries[PEERCACHE_MAX_PEERS];
+    size_t count = 0;
+    entries[count++] = *entry;
+
+    FILE *fp = fopen(path, "r");
+    if (fp)
+    {
+        char line[256];
+        time_t now = time(NULL);
+        while (count < PEERCACHE_MAX_PEERS && fgets(line, sizeof(line), fp))
+        {
+            struct peer_entry e;
+            if (parse_entry(line, &e) == 0 && !same_peer(&e.addr, &entry->addr) &&
+                now - e.last_seen <= PEERCACHE_MAX_AGE)
+            {
+                entries[count++] = e;
+            }
+        }
+        fclose(fp);
+    }
+
+    char tmp[4096 + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fp = fopen(tmp, "w");
+    if (!fp)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        write_entry(fp, &entries[i]);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0)
+    {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
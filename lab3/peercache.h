@@ -0,0 +1,50 @@
+#ifndef PEERCACHE_H
+#define PEERCACHE_H
+
+#include <netinet/in.h>
+#include <time.h>
+#include "protocol.h"
+
+// What deliver remembers about servers it has talked to, so the next
+// transfer to the same address can skip the setup round trip and put data
+// in its first flight, and doesn't have to rediscover the path either.
+//
+// The cache is a small text file, one peer per line:
+//   <ip>:<port> <last seen, unix time> <version> <features> <max_frag> <window> <sock_buf>
+//       <srtt us> <rttvar us> <cwnd> <mtu> <frag_best> <frag_goodput> <frag_step>
+// Updates rewrite it through a temporary file and rename(), so a crash never
+// leaves a half written cache behind. Entries not refreshed for
+// PEERCACHE_MAX_AGE are ignored and eventually dropped. The path metrics go
+// stale much sooner (PEERCACHE_METRICS_MAX_AGE, an hour like the kernel's TCP
+// metrics cache); lines without them are still read.
+
+#define PEERCACHE_MAX_PEERS 256
+#define PEERCACHE_MAX_AGE (7 * 24 * 3600)
+#define PEERCACHE_METRICS_MAX_AGE 3600
+
+struct peer_entry
+{
+    struct sockaddr_in addr;
+    time_t last_seen;
+    struct xfer_params params; // what the server agreed to, max_frag is its own limit if it said
+
+    // Path metrics from the last transfer, 0 = unknown
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t cwnd; // fragments in flight that the path carried
+    uint32_t mtu;  // route MTU the kernel reported
+    // Fragment size climb, one step per transfer: the best size so far, its
+    // goodput in kB/s and what the next transfer adds to it (0 = settled)
+    uint32_t frag_best;
+    uint32_t frag_goodput;
+    int32_t frag_step;
+};
+
+// Default location, $HOME/.deliver_peers; NULL if there is no $HOME
+const char *peercache_default_path(void);
+// Returns 1 and fills in entry if the peer is cached (and fresh), 0 if not
+int peercache_lookup(const char *path, const struct sockaddr_in *addr, struct peer_entry *entry);
+// Adds or replaces the entry for entry->addr; returns 0 on success
+int peercache_store(const char *path, const struct peer_entry *entry);
+
+#endif
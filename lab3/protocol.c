@@ -0,0 +1,930 @@
+#include <string.h>
+#include "protocol.h"
+
+size_t varint_encode(uint64_t value, uint8_t *out)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+size_t varint_decode(const uint8_t *in, size_t len, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < len && i < VARINT_MAX_LEN; i++)
+    {
+        uint64_t group = in[i] & 0x7f;
+        if (i == VARINT_MAX_LEN - 1 && group > 1)
+        {
+            return 0; // would overflow 64 bits
+        }
+        result |= group << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// Helpers that advance a cursor through a buffer and fail on overflow
+static int put_varint(uint8_t *buf, size_t buf_size, size_t *pos, uint64_t value)
+{
+    uint8_t tmp[VARINT_MAX_LEN];
+    size_t n = varint_encode(value, tmp);
+    if (buf_size - *pos < n)
+    {
+        return -1;
+    }
+    memcpy(buf + *pos, tmp, n);
+    *pos += n;
+    return 0;
+}
+
+static int get_varint(const uint8_t *buf, size_t len, size_t *pos, uint64_t *value)
+{
+    size_t n = varint_decode(buf + *pos, len - *pos, value);
+    if (n == 0)
+    {
+        return -1;
+    }
+    *pos += n;
+    return 0;
+}
+
+void params_default(struct xfer_params *p)
+{
+    p->version = PROTO_VERSION_MIN;
+    p->features = 0;
+    p->max_frag = FRAG_SIZE_DEFAULT;
+    p->window = 1; // stop-and-wait
+    p->sock_buf = 0;
+    p->early = 0;
+    p->frag_limit = 0;
+    p->ack_every = 1;
+    p->ack_delay_us = 0;
+    p->tree_block = 0;
+    p->tree_size = 0;
+    memset(p->tree_root, 0, sizeof(p->tree_root));
+    p->aead = 0;
+    memset(p->aead_salt, 0, sizeof(p->aead_salt));
+    p->weight = 1;
+    memset(p->host_id, 0, sizeof(p->host_id));
+    p->shm_ring = 0;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+int params_negotiate(const struct xfer_params *a, const struct xfer_params *b, struct xfer_params *out)
+{
+    out->version = min_u32(a->version, b->version);
+    if (out->version < PROTO_VERSION_MIN)
+    {
+        return -1;
+    }
+    out->features = a->features & b->features;
+    out->max_frag = min_u32(min_u32(a->max_frag, b->max_frag), FRAG_SIZE_MAX);
+    out->window = min_u32(a->window, b->window);
+    // 0 means "don't care", so only a side that asks for a size limits the other
+    out->sock_buf = !a->sock_buf ? b->sock_buf : !b->sock_buf ? a->sock_buf : min_u32(a->sock_buf, b->sock_buf);
+    out->early = 0;
+    out->frag_limit = 0;
+    // Holding back ACKs for more than half the window would stall the sender
+    out->ack_every = min_u32(min_u32(a->ack_every, b->ack_every), out->window > 1 ? out->window / 2 : 1);
+    out->ack_delay_us = min_u32(a->ack_delay_us, b->ack_delay_us);
+    if (!(out->features & FEAT_SACK) || out->ack_every == 0 || out->ack_delay_us == 0)
+    {
+        out->ack_every = 1;
+        out->ack_delay_us = 0;
+    }
+    // The window rides on SACKs
+    if (!(out->features & FEAT_SACK))
+    {
+        out->features &= ~FEAT_RWND;
+    }
+    // The tree describes the sender's file, whichever side that is
+    const struct xfer_params *tree = a->tree_block ? a : b;
+    out->tree_block = tree->tree_block;
+    out->tree_size = tree->tree_size;
+    memcpy(out->tree_root, tree->tree_root, sizeof(out->tree_root));
+    if (!(out->features & FEAT_MERKLE) || out->tree_block == 0)
+    {
+        out->features &= ~FEAT_MERKLE;
+        out->tree_block = 0;
+        out->tree_size = 0;
+        memset(out->tree_root, 0, sizeof(out->tree_root));
+    }
+    // So are the cipher and salt, the receiver only has to support the cipher
+    const struct xfer_params *aead = a->aead ? a : b;
+    out->aead = aead->aead;
+    memcpy(out->aead_salt, aead->aead_salt, sizeof(out->aead_salt));
+    if (!(out->features & FEAT_AEAD) || out->aead == 0)
+    {
+        out->features &= ~FEAT_AEAD;
+        out->aead = 0;
+        memset(out->aead_salt, 0, sizeof(out->aead_salt));
+    }
+    out->weight = !a->weight ? b->weight : !b->weight ? a->weight : min_u32(a->weight, b->weight);
+    // The ring is the sender's too, and no use to a receiver on another machine
+    const struct xfer_params *shm = a->shm_ring ? a : b;
+    out->shm_ring = shm->shm_ring;
+    memcpy(out->host_id, shm->host_id, sizeof(out->host_id));
+    if (!(out->features & FEAT_SHM) || out->shm_ring == 0 || memcmp(a->host_id, b->host_id, HOST_ID_LEN) != 0)
+    {
+        out->features &= ~FEAT_SHM;
+        out->shm_ring = 0;
+        memset(out->host_id, 0, sizeof(out->host_id));
+    }
+    if (out->max_frag == 0 || out->window == 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Reflected Castagnoli polynomial, table built on first use
+static uint32_t crc32c_table[256];
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    if (!crc32c_table[1])
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+            }
+            crc32c_table[i] = c;
+        }
+    }
+
+    const uint8_t *p = data;
+    crc = ~crc;
+    while (len--)
+    {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static int put_params(uint8_t *buf, size_t buf_size, size_t *pos, const struct xfer_params *p)
+{
+    const uint64_t params[][2] = {
+        {PARAM_MAX_FRAG, p->max_frag},
+        {PARAM_WINDOW, p->window},
+        {PARAM_SOCK_BUF, p->sock_buf},
+        {PARAM_EARLY, p->early},
+        {PARAM_FRAG_LIMIT, p->frag_limit},
+        {PARAM_ACK_EVERY, p->ack_every},
+        {PARAM_ACK_DELAY, p->ack_delay_us},
+    };
+    size_t count = sizeof(params) / sizeof(params[0]);
+    size_t tree_count = p->tree_block ? 2 + TREE_HASH_LEN / 8 : 0;
+    size_t aead_count = p->aead ? 1 + AEAD_SALT_LEN / 8 : 0;
+    size_t weight_count = p->weight > 1 ? 1 : 0;
+    size_t shm_count = p->shm_ring ? 1 + HOST_ID_LEN / 8 : 0;
+
+    if (put_varint(buf, buf_size, pos, p->version) < 0 ||
+        put_varint(buf, buf_size, pos, p->features) < 0 ||
+        put_varint(buf, buf_size, pos, count + tree_count + aead_count + weight_count + shm_count) < 0)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (put_varint(buf, buf_size, pos, params[i][0]) < 0 ||
+            put_varint(buf, buf_size, pos, params[i][1]) < 0)
+        {
+            return -1;
+        }
+    }
+    if (tree_count)
+    {
+        if (put_varint(buf, buf_size, pos, PARAM_TREE_BLOCK) < 0 ||
+            put_varint(buf, buf_size, pos, p->tree_block) < 0 ||
+            put_varint(buf, buf_size, pos, PARAM_TREE_SIZE) < 0 ||
+            put_varint(buf, buf_size, pos, p->tree_size) < 0)
+        {
+            return -1;
+        }
+        for (int w = 0; w < TREE_HASH_LEN / 8; w++)
+        {
+            uint64_t word = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                word |= (uint64_t)p->tree_root[8 * w + i] << (8 * i);
+            }
+            if (put_varint(buf, buf_size, pos, PARAM_TREE_ROOT + w) < 0 ||
+                put_varint(buf, buf_size, pos, word) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    if (aead_count)
+    {
+        if (put_varint(buf, buf_size, pos, PARAM_AEAD) < 0 || put_varint(buf, buf_size, pos, p->aead) < 0)
+        {
+            return -1;
+        }
+        for (int w = 0; w < AEAD_SALT_LEN / 8; w++)
+        {
+            uint64_t word = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                word |= (uint64_t)p->aead_salt[8 * w + i] << (8 * i);
+            }
+            if (put_varint(buf, buf_size, pos, PARAM_AEAD_SALT + w) < 0 ||
+                put_varint(buf, buf_size, pos, word) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    if (weight_count && (put_varint(buf, buf_size, pos, PARAM_WEIGHT) < 0 ||
+                         put_varint(buf, buf_size, pos, p->weight) < 0))
+    {
+        return -1;
+    }
+    if (shm_count)
+    {
+        if (put_varint(buf, buf_size, pos, PARAM_SHM_RING) < 0 || put_varint(buf, buf_size, pos, p->shm_ring) < 0)
+        {
+            return -1;
+        }
+        for (int w = 0; w < HOST_ID_LEN / 8; w++)
+        {
+            uint64_t word = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                word |= (uint64_t)p->host_id[8 * w + i] << (8 * i);
+            }
+            if (put_varint(buf, buf_size, pos, PARAM_HOST_ID + w) < 0 ||
+                put_varint(buf, buf_size, pos, word) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Parameters that aren't in the packet keep their params_default() value
+static int get_params(const uint8_t *buf, size_t len, size_t *pos, struct xfer_params *p)
+{
+    uint64_t version, features, count;
+
+    params_default(p);
+    if (get_varint(buf, len, pos, &version) < 0 ||
+        get_varint(buf, len, pos, &features) < 0 ||
+        get_varint(buf, len, pos, &count) < 0 ||
+        version > UINT32_MAX)
+    {
+        return -1;
+    }
+    p->version = (uint32_t)version;
+    p->features = (uint32_t)features;
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t id, value;
+        if (get_varint(buf, len, pos, &id) < 0 || get_varint(buf, len, pos, &value) < 0)
+        {
+            return -1;
+        }
+        if (id >= PARAM_TREE_ROOT && id < PARAM_TREE_ROOT + TREE_HASH_LEN / 8)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                p->tree_root[8 * (id - PARAM_TREE_ROOT) + i] = (uint8_t)(value >> (8 * i));
+            }
+            continue;
+        }
+        if (id >= PARAM_AEAD_SALT && id < PARAM_AEAD_SALT + AEAD_SALT_LEN / 8)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                p->aead_salt[8 * (id - PARAM_AEAD_SALT) + i] = (uint8_t)(value >> (8 * i));
+            }
+            continue;
+        }
+        if (id >= PARAM_HOST_ID && id < PARAM_HOST_ID + HOST_ID_LEN / 8)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                p->host_id[8 * (id - PARAM_HOST_ID) + i] = (uint8_t)(value >> (8 * i));
+            }
+            continue;
+        }
+        if (id == PARAM_TREE_SIZE)
+        {
+            p->tree_size = value;
+            continue;
+        }
+        if (id == PARAM_SHM_RING)
+        {
+            p->shm_ring = value;
+            continue;
+        }
+        if (value > UINT32_MAX)
+        {
+            value = UINT32_MAX;
+        }
+        switch (id)
+        {
+        case PARAM_MAX_FRAG:
+            p->max_frag = (uint32_t)value;
+            break;
+        case PARAM_WINDOW:
+            p->window = (uint32_t)value;
+            break;
+        case PARAM_SOCK_BUF:
+            p->sock_buf = (uint32_t)value;
+            break;
+        case PARAM_EARLY:
+            p->early = (uint32_t)value;
+            break;
+        case PARAM_FRAG_LIMIT:
+            p->frag_limit = (uint32_t)value;
+            break;
+        case PARAM_ACK_EVERY:
+            p->ack_every = (uint32_t)value;
+            break;
+        case PARAM_ACK_DELAY:
+            p->ack_delay_us = (uint32_t)value;
+            break;
+        case PARAM_TREE_BLOCK:
+            p->tree_block = (uint32_t)value;
+            break;
+        case PARAM_AEAD:
+            p->aead = (uint32_t)value;
+            break;
+        case PARAM_WEIGHT:
+            p->weight = (uint32_t)value;
+            break;
+        default:
+            break; // from a newer peer
+        }
+    }
+    return 0;
+}
+
+static int encode_setup_common(const char *magic, const struct xfer_params *p, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = strlen(magic);
+    if (buf_size < pos)
+    {
+        return -1;
+    }
+    memcpy(buf, magic, pos);
+    if (put_params(buf, buf_size, &pos, p) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int encode_setup(const struct xfer_params *p, uint8_t *buf, size_t buf_size)
+{
+    return encode_setup_common("ftp", p, buf, buf_size);
+}
+
+int decode_setup(const uint8_t *buf, size_t len, struct xfer_params *p)
+{
+    size_t pos = 3;
+    if (len < pos || memcmp(buf, "ftp", pos) != 0 || get_params(buf, len, &pos, p) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int encode_setup_accept(const struct xfer_params *p, uint8_t *buf, size_t buf_size)
+{
+    return encode_setup_common("yes", p, buf, buf_size);
+}
+
+int encode_setup_reject(const char *reason, uint8_t *buf, size_t buf_size)
+{
+    size_t reason_len = strnlen(reason, SETUP_REASON_MAX - 1);
+    if (buf_size < 2 + reason_len)
+    {
+        return -1;
+    }
+    memcpy(buf, "no", 2);
+    memcpy(buf + 2, reason, reason_len);
+    return (int)(2 + reason_len);
+}
+
+int decode_setup_reply(const uint8_t *buf, size_t len, struct xfer_params *p, char *reason, size_t reason_size)
+{
+    size_t pos = 3;
+    if (len >= pos && memcmp(buf, "yes", pos) == 0)
+    {
+        return get_params(buf, len, &pos, p) < 0 ? -1 : 1;
+    }
+    if (len >= 2 && memcmp(buf, "no", 2) == 0)
+    {
+        size_t n = len - 2 < reason_size - 1 ? len - 2 : reason_size - 1;
+        memcpy(reason, buf + 2, n);
+        reason[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+int frag_template_init(struct frag_template *t, uint64_t total_frag, const char *filename)
+{
+    size_t name_len = strnlen(filename, MAX_FILENAME - 1);
+    size_t pos = 0;
+
+    t->prefix[pos++] = PKT_DATA;
+    t->prefix[pos++] = 0; // flags, set per fragment
+    if (put_varint(t->prefix, sizeof(t->prefix), &pos, total_frag) < 0 ||
+        put_varint(t->prefix, sizeof(t->prefix), &pos, name_len) < 0 ||
+        sizeof(t->prefix) - pos < name_len)
+    {
+        return -1;
+    }
+    memcpy(t->prefix + pos, filename, name_len);
+    t->len = pos + name_len;
+    return 0;
+}
+
+int frag_template_fill(const struct frag_template *t, uint8_t flags, uint64_t frag_no, uint64_t offset,
+                       uint64_t size, uint32_t crc, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = t->len;
+    if (buf_size < pos)
+    {
+        return -1;
+    }
+    memcpy(buf, t->prefix, pos);
+    buf[1] = flags;
+
+    if (put_varint(buf, buf_size, &pos, frag_no) < 0 ||
+        put_varint(buf, buf_size, &pos, offset) < 0 ||
+        put_varint(buf, buf_size, &pos, size) < 0)
+    {
+        return -1;
+    }
+    if (flags & FRAG_FLAG_CRC)
+    {
+        if (buf_size - pos < 4)
+        {
+            return -1;
+        }
+        pos += 4;
+        frag_patch_crc(buf, pos, crc);
+    }
+    return (int)pos;
+}
+
+void frag_patch_crc(uint8_t *buf, size_t header_len, uint32_t crc)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buf[header_len - 4 + i] = (uint8_t)(crc >> (8 * i));
+    }
+}
+
+int encode_frag_header(const struct frag_header *hdr, uint8_t *buf, size_t buf_size)
+{
+    struct frag_template t;
+    if (frag_template_init(&t, hdr->total_frag, hdr->filename) != 0)
+    {
+        return -1;
+    }
+    return frag_template_fill(&t, hdr->flags, hdr->frag_no, hdr->offset, hdr->size, hdr->crc, buf, buf_size);
+}
+
+int decode_frag_header(const uint8_t *buf, size_t len, struct frag_header *hdr)
+{
+    size_t pos = 0;
+    uint64_t name_len, size;
+
+    if (len < 2 || buf[0] != PKT_DATA)
+    {
+        return -1;
+    }
+    hdr->flags = buf[1];
+    pos = 2;
+
+    if (get_varint(buf, len, &pos, &hdr->total_frag) < 0 ||
+        get_varint(buf, len, &pos, &name_len) < 0 ||
+        name_len >= MAX_FILENAME || len - pos < name_len)
+    {
+        return -1;
+    }
+    memcpy(hdr->filename, buf + pos, name_len);
+    hdr->filename[name_len] = '\0';
+    pos += name_len;
+
+    if (get_varint(buf, len, &pos, &hdr->frag_no) < 0 ||
+        get_varint(buf, len, &pos, &hdr->offset) < 0 ||
+        get_varint(buf, len, &pos, &size) < 0)
+    {
+        return -1;
+    }
+    hdr->crc = 0;
+    if (hdr->flags & FRAG_FLAG_CRC)
+    {
+        if (len - pos < 4)
+        {
+            return -1;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            hdr->crc |= (uint32_t)buf[pos++] << (8 * i);
+        }
+    }
+    // The tag already covers the payload
+    size_t tag = hdr->flags & FRAG_FLAG_AEAD ? AEAD_TAG_LEN : 0;
+    if (tag && (hdr->flags & FRAG_FLAG_CRC))
+    {
+        return -1;
+    }
+    if (hdr->flags & FRAG_FLAG_SHM)
+    {
+        // Payload and tag are in the ring, a zero run has neither
+        if (hdr->flags & FRAG_FLAG_ZERO)
+        {
+            return -1;
+        }
+    }
+    else if (tag > len - pos)
+    {
+        return -1;
+    }
+    else if (hdr->flags & FRAG_FLAG_ZERO)
+    {
+        // Nothing to check a CRC against
+        if (hdr->flags & FRAG_FLAG_CRC)
+        {
+            return -1;
+        }
+    }
+    else if (size > len - pos - tag)
+    {
+        return -1;
+    }
+    hdr->size = size;
+    return (int)pos;
+}
+
+int encode_ack(uint64_t frag_no, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_ACK;
+    if (put_varint(buf, buf_size, &pos, frag_no) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int decode_ack(const uint8_t *buf, size_t len, uint64_t *frag_no)
+{
+    size_t pos = 1;
+    if (len < 2 || buf[0] != PKT_ACK)
+    {
+        return -1;
+    }
+    if (get_varint(buf, len, &pos, frag_no) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int encode_offer(const struct chunk_offer *offer, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 2 || offer->count > OFFER_MAX_CHUNKS)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_OFFER;
+    buf[pos++] = offer->flags;
+    if (put_varint(buf, buf_size, &pos, offer->seq) < 0 ||
+        put_varint(buf, buf_size, &pos, offer->count) < 0)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < offer->count; i++)
+    {
+        if (put_varint(buf, buf_size, &pos, offer->length[i]) < 0 ||
+            buf_size - pos < OFFER_HASH_LEN)
+        {
+            return -1;
+        }
+        memcpy(buf + pos, offer->hash[i], OFFER_HASH_LEN);
+        pos += OFFER_HASH_LEN;
+    }
+    return (int)pos;
+}
+
+int decode_offer(const uint8_t *buf, size_t len, struct chunk_offer *offer)
+{
+    size_t pos = 2;
+    uint64_t count, length;
+    if (len < 2 || buf[0] != PKT_OFFER)
+    {
+        return -1;
+    }
+    offer->flags = buf[1];
+    if (get_varint(buf, len, &pos, &offer->seq) < 0 ||
+        get_varint(buf, len, &pos, &count) < 0 ||
+        count > OFFER_MAX_CHUNKS)
+    {
+        return -1;
+    }
+    offer->count = (uint32_t)count;
+    for (uint32_t i = 0; i < offer->count; i++)
+    {
+        if (get_varint(buf, len, &pos, &length) < 0 || length > UINT32_MAX ||
+            len - pos < OFFER_HASH_LEN)
+        {
+            return -1;
+        }
+        offer->length[i] = (uint32_t)length;
+        memcpy(offer->hash[i], buf + pos, OFFER_HASH_LEN);
+        pos += OFFER_HASH_LEN;
+    }
+    return (int)pos;
+}
+
+int encode_want(uint64_t seq, const uint8_t *bitmap, uint32_t count, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    size_t bitmap_len = (count + 7) / 8;
+    if (buf_size < 1)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_WANT;
+    if (put_varint(buf, buf_size, &pos, seq) < 0 || buf_size - pos < bitmap_len)
+    {
+        return -1;
+    }
+    memcpy(buf + pos, bitmap, bitmap_len);
+    pos += bitmap_len;
+    return (int)pos;
+}
+
+int decode_want(const uint8_t *buf, size_t len, uint64_t *seq, uint8_t *bitmap, uint32_t count)
+{
+    size_t pos = 1;
+    size_t bitmap_len = (count + 7) / 8;
+    if (len < 2 || buf[0] != PKT_WANT || get_varint(buf, len, &pos, seq) < 0 ||
+        len - pos < bitmap_len)
+    {
+        return -1;
+    }
+    memcpy(bitmap, buf + pos, bitmap_len);
+    return (int)(pos + bitmap_len);
+}
+
+// Ranges are sorted, so deltas from the previous range stay small
+static int put_ranges(uint8_t *buf, size_t buf_size, size_t *pos, const struct nack_range *ranges, uint32_t count)
+{
+    uint64_t prev_end = 0;
+    if (put_varint(buf, buf_size, pos, count) < 0)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (ranges[i].start < prev_end ||
+            put_varint(buf, buf_size, pos, ranges[i].start - prev_end) < 0 ||
+            put_varint(buf, buf_size, pos, ranges[i].length) < 0)
+        {
+            return -1;
+        }
+        prev_end = ranges[i].start + ranges[i].length;
+    }
+    return 0;
+}
+
+static int get_ranges(const uint8_t *buf, size_t len, size_t *pos, struct nack_range *ranges, uint32_t *count,
+                      uint32_t max)
+{
+    uint64_t n, gap, length, prev_end = 0;
+    if (get_varint(buf, len, pos, &n) < 0 || n > max)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < n; i++)
+    {
+        if (get_varint(buf, len, pos, &gap) < 0 || get_varint(buf, len, pos, &length) < 0)
+        {
+            return -1;
+        }
+        ranges[i].start = prev_end + gap;
+        ranges[i].length = length;
+        prev_end = ranges[i].start + length;
+    }
+    *count = (uint32_t)n;
+    return 0;
+}
+
+int encode_nack(const struct nack_range *ranges, uint32_t count, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1 || count > NACK_MAX_RANGES)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_NACK;
+    if (put_ranges(buf, buf_size, &pos, ranges, count) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int decode_nack(const uint8_t *buf, size_t len, struct nack_range *ranges, uint32_t *count)
+{
+    size_t pos = 1;
+    if (len < 2 || buf[0] != PKT_NACK || get_ranges(buf, len, &pos, ranges, count, NACK_MAX_RANGES) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int encode_sack(uint64_t cumulative, const struct nack_range *ranges, uint32_t count, uint32_t window,
+                uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1 || count > SACK_MAX_RANGES)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_SACK;
+    // The first range is relative to the cumulative point, like the rest
+    struct nack_range shifted[SACK_MAX_RANGES];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (ranges[i].start <= cumulative)
+        {
+            return -1;
+        }
+        shifted[i].start = ranges[i].start - cumulative;
+        shifted[i].length = ranges[i].length;
+    }
+    if (put_varint(buf, buf_size, &pos, cumulative) < 0 || put_ranges(buf, buf_size, &pos, shifted, count) < 0 ||
+        (window && put_varint(buf, buf_size, &pos, window) < 0))
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int decode_sack(const uint8_t *buf, size_t len, uint64_t *cumulative, struct nack_range *ranges,
+                uint32_t *count, uint32_t *window)
+{
+    size_t pos = 1;
+    uint64_t value = 0;
+    if (len < 2 || buf[0] != PKT_SACK || get_varint(buf, len, &pos, cumulative) < 0 ||
+        get_ranges(buf, len, &pos, ranges, count, SACK_MAX_RANGES) < 0 ||
+        (pos < len && get_varint(buf, len, &pos, &value) < 0))
+    {
+        return -1;
+    }
+    *window = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+    for (uint32_t i = 0; i < *count; i++)
+    {
+        ranges[i].start += *cumulative;
+    }
+    return (int)pos;
+}
+
+int encode_done(uint64_t total_frag, uint64_t receiver_id, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_DONE;
+    if (put_varint(buf, buf_size, &pos, total_frag) < 0 || put_varint(buf, buf_size, &pos, receiver_id) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int decode_done(const uint8_t *buf, size_t len, uint64_t *total_frag, uint64_t *receiver_id)
+{
+    size_t pos = 1;
+    if (len < 3 || buf[0] != PKT_DONE || get_varint(buf, len, &pos, total_frag) < 0 ||
+        get_varint(buf, len, &pos, receiver_id) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int encode_tree(uint8_t type, const struct tree_node *nodes, uint32_t count, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1 || count > TREE_MAX_NODES)
+    {
+        return -1;
+    }
+    buf[pos++] = type;
+    if (put_varint(buf, buf_size, &pos, count) < 0)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (put_varint(buf, buf_size, &pos, nodes[i].level) < 0 ||
+            put_varint(buf, buf_size, &pos, nodes[i].index) < 0)
+        {
+            return -1;
+        }
+        if (type == PKT_TREE)
+        {
+            if (buf_size - pos < TREE_HASH_LEN)
+            {
+                return -1;
+            }
+            memcpy(buf + pos, nodes[i].hash, TREE_HASH_LEN);
+            pos += TREE_HASH_LEN;
+        }
+    }
+    return (int)pos;
+}
+
+int decode_tree(const uint8_t *buf, size_t len, uint8_t type, struct tree_node *nodes, uint32_t *count)
+{
+    size_t pos = 1;
+    uint64_t n;
+    if (len < 2 || buf[0] != type || get_varint(buf, len, &pos, &n) < 0 || n > TREE_MAX_NODES)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < n; i++)
+    {
+        uint64_t level;
+        if (get_varint(buf, len, &pos, &level) < 0 || level > 64 ||
+            get_varint(buf, len, &pos, &nodes[i].index) < 0)
+        {
+            return -1;
+        }
+        nodes[i].level = (uint32_t)level;
+        if (type == PKT_TREE)
+        {
+            if (len - pos < TREE_HASH_LEN)
+            {
+                return -1;
+            }
+            memcpy(nodes[i].hash, buf + pos, TREE_HASH_LEN);
+            pos += TREE_HASH_LEN;
+        }
+    }
+    *count = (uint32_t)n;
+    return (int)pos;
+}
+
+int encode_repair(const struct nack_range *ranges, uint32_t count, uint8_t *buf, size_t buf_size)
+{
+    size_t pos = 0;
+    if (buf_size < 1 || count > REPAIR_MAX_RANGES)
+    {
+        return -1;
+    }
+    buf[pos++] = PKT_REPAIR;
+    if (put_ranges(buf, buf_size, &pos, ranges, count) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
+
+int decode_repair(const uint8_t *buf, size_t len, struct nack_range *ranges, uint32_t *count)
+{
+    size_t pos = 1;
+    if (len < 2 || buf[0] != PKT_REPAIR || get_ranges(buf, len, &pos, ranges, count, REPAIR_MAX_RANGES) < 0)
+    {
+        return -1;
+    }
+    return (int)pos;
+}
@@ -0,0 +1,266 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format shared by deliver and server.
+//
+// Every datagram starts with a one byte packet type. Integer fields are
+// LEB128 varints (7 bits per byte, high bit = "more bytes follow"), so a
+// small transfer pays 1-2 bytes per field while offsets and fragment numbers
+// can still go all the way to 2^64.
+//
+// SETUP: "ftp" | version | features | count | count x (param id | value)
+// YES:   "yes" | version | features | count | count x (param id | value)
+// NO:    "no" | reason text
+// DATA:  type | flags | total_frag | name_len | name | frag_no | offset | size | payload
+// ACK:   type | frag_no
+// OFFER: type | flags | seq | count | count x (length | sha256)
+// WANT:  type | seq | bitmap, bit i set = chunk i of that offer is missing
+// NACK:  type | count | count x (gap since previous range end | length)
+// DONE:  type | total_frag | receiver_id
+// SACK:  type | cumulative | count | count x (gap since previous range end | length) [| window]
+// TREE_REQ: type | count | count x (level | index)
+// TREE:  type | count | count x (level | index | sha256)
+// REPAIR: type | count | count x (gap since previous range end | length), in blocks
+//
+// The fields that never change during a transfer come first. When the DATA
+// flags include FRAG_FLAG_CRC, a little-endian CRC32C of the payload sits
+// between the header and the payload. With FRAG_FLAG_ZERO no payload
+// follows at all: size is the length of a run of zero bytes at offset.
+// With FRAG_FLAG_AEAD the payload is encrypted, with the header as
+// associated data, and its AEAD_TAG_LEN byte tag follows it (a ZERO
+// fragment carries just the tag). With FRAG_FLAG_SHM the payload, and the
+// tag if any, are in the shared memory ring (see shmring.h) instead.
+//
+// With FEAT_RWND a SACK ends in the receiver's window: how many fragments,
+// from the oldest one not yet acknowledged, the sender may have in flight.
+// Until the first SACK that is RWND_INITIAL. Older decoders stop before it.
+//
+// SETUP/YES/NO keep lab1's "ftp" -> "yes"/"no" strings; their first bytes
+// can't be mistaken for a packet type.
+
+#define PKT_DATA 1
+#define PKT_ACK 2
+#define PKT_OFFER 3
+#define PKT_WANT 4
+#define PKT_NACK 5
+#define PKT_DONE 6
+#define PKT_SACK 7
+#define PKT_TREE_REQ 8
+#define PKT_TREE 9
+#define PKT_REPAIR 10
+
+// DATA flags
+#define FRAG_FLAG_DEDUP 0x01 // only missing chunks are sent, the rest comes from the receiver's store
+#define FRAG_FLAG_NACK 0x02  // sender streams, receiver reports gaps with NACK and finishes with DONE
+#define FRAG_FLAG_CRC 0x04   // a CRC32C of the payload comes right before it
+#define FRAG_FLAG_ZERO 0x08  // size zero bytes at offset, nothing follows (never with FRAG_FLAG_CRC)
+#define FRAG_FLAG_AEAD 0x10  // payload is encrypted and a tag follows it (never with FRAG_FLAG_CRC)
+#define FRAG_FLAG_SHM 0x20   // payload is in the ring slot of frag_no, not in the packet
+
+// OFFER flags
+#define OFFER_FLAG_LAST 0x01 // no more offers follow, the data phase starts next
+
+#define MAX_FILENAME 128
+#define VARINT_MAX_LEN 10 // ceil(64 / 7)
+
+struct frag_header
+{
+    uint8_t flags;
+    uint64_t total_frag;
+    uint64_t frag_no;  // 1-based
+    uint64_t offset;   // byte offset of the payload in the file
+    uint64_t size;     // payload bytes following the header, zero bytes with FRAG_FLAG_ZERO
+    uint32_t crc;      // CRC32C of the payload, only with FRAG_FLAG_CRC
+    char filename[MAX_FILENAME];
+};
+
+// Everything in a DATA header that is the same for every fragment of a
+// transfer, worked out once: the type, total_frag and the file name. The
+// flags byte is in there too but set per fragment.
+struct frag_template
+{
+    uint8_t prefix[2 + VARINT_MAX_LEN + 1 + MAX_FILENAME];
+    size_t len;
+};
+
+#define OFFER_MAX_CHUNKS 32 // 32 * (3 + 32) bytes fits a 1500 byte packet
+#define OFFER_HASH_LEN 32
+
+// Chunk hashes offered to a deduplicating receiver, in file order
+struct chunk_offer
+{
+    uint8_t flags;
+    uint64_t seq; // 1-based
+    uint32_t count;
+    uint32_t length[OFFER_MAX_CHUNKS];
+    uint8_t hash[OFFER_MAX_CHUNKS][OFFER_HASH_LEN];
+};
+
+#define NACK_MAX_RANGES 64
+#define SACK_MAX_RANGES 32
+#define REPAIR_MAX_RANGES 64
+#define TREE_MAX_NODES 32 // 32 * (2 + 3 + 32) bytes fits a 1500 byte packet
+#define TREE_HASH_LEN 32
+
+// A node of the sender's Merkle tree; level 0 are the blocks
+struct tree_node
+{
+    uint32_t level;
+    uint64_t index;
+    uint8_t hash[TREE_HASH_LEN]; // only in TREE
+};
+
+// Setup exchange. Each side lists what it supports and both settle on the
+// same configuration: the lower version, the features they have in common
+// and the smaller of each limit. Parameter ids and feature bits a side
+// doesn't know are ignored, so new ones can be added without breaking
+// older peers.
+#define PROTO_VERSION 1
+#define PROTO_VERSION_MIN 1
+
+#define FEAT_DEDUP 0x01 // receiver has a chunk store
+#define FEAT_NACK 0x02  // NACK mode transfers
+#define FEAT_CRC 0x04   // CRC32C over every payload
+#define FEAT_SACK 0x08  // receiver answers with cumulative SACKs and may hold them back
+#define FEAT_SPARSE 0x10 // receiver takes FRAG_FLAG_ZERO fragments and leaves holes for them
+#define FEAT_MERKLE 0x20 // sender has a Merkle tree of the file, receiver checks blocks against it
+#define FEAT_AEAD 0x40   // both hold the same key, payloads are encrypted and authenticated
+#define FEAT_SHM 0x80    // same host, payloads go through the sender's shared memory ring
+#define FEAT_RWND 0x100  // receiver's SACKs carry the window it can take (only with FEAT_SACK)
+
+#define PARAM_MAX_FRAG 1 // payload bytes per DATA packet
+#define PARAM_WINDOW 2   // fragments the receiver accepts in flight
+#define PARAM_SOCK_BUF 3 // SO_SNDBUF/SO_RCVBUF, 0 = leave the OS default
+#define PARAM_EARLY 4    // zero round trip start: data already follows this SETUP
+#define PARAM_FRAG_LIMIT 5 // largest fragment the receiver takes
+#define PARAM_ACK_EVERY 6  // in-order fragments one SACK may cover
+#define PARAM_ACK_DELAY 7  // microseconds the receiver may hold a SACK back
+#define PARAM_TREE_BLOCK 8 // bytes per Merkle tree leaf
+#define PARAM_TREE_SIZE 9  // bytes the tree covers, the whole file
+#define PARAM_TREE_ROOT 10 // 10..13: the root hash as four little-endian 64 bit words
+#define PARAM_AEAD 14      // cipher the sender picked
+#define PARAM_AEAD_SALT 15 // 15..16: makes the transfer's key, two little-endian 64 bit words
+#define PARAM_WEIGHT 17    // the transfer's share of the receiver next to other transfers
+#define PARAM_HOST_ID 18   // 18..19: the sender's boot id, two little-endian 64 bit words
+#define PARAM_SHM_RING 20  // names the sender's ring
+
+#define AEAD_AES_256_GCM 1
+#define AEAD_CHACHA20_POLY1305 2
+#define AEAD_SALT_LEN 16
+#define AEAD_TAG_LEN 16
+#define HOST_ID_LEN 16
+#define RWND_INITIAL 16 // FEAT_RWND window before the receiver has said anything
+
+#define FRAG_SIZE_DEFAULT 1000 // what a peer that skipped the setup gets
+#define FRAG_SIZE_MAX 8192     // fits a jumbo frame
+#define FRAG_HEADER_MAX 256    // worst case DATA header incl. CRC or AEAD tag, with room to spare
+#define SETUP_REASON_MAX 128
+
+struct xfer_params
+{
+    uint32_t version;
+    uint32_t features;
+    uint32_t max_frag;
+    uint32_t window;
+    uint32_t sock_buf;
+    // In SETUP only: fragments sent before the answer. The receiver must
+    // take these parameters as they are (YES) or refuse them (NO), it can't
+    // lower them any more.
+    uint32_t early;
+    // In YES only: the receiver's own max_frag, 0 = not known. Lets the
+    // sender know how far it could go next time.
+    uint32_t frag_limit;
+    // ACK coalescing, only with FEAT_SACK. The sender needs ack_delay_us to
+    // keep its retransmission timeouts clear of ACKs that are merely late.
+    uint32_t ack_every;
+    uint32_t ack_delay_us;
+    // Only with FEAT_MERKLE: the sender's tree, which the receiver echoes.
+    // tree_block = 0 means there is none.
+    uint32_t tree_block;
+    uint64_t tree_size;
+    uint8_t tree_root[TREE_HASH_LEN];
+    // Only with FEAT_AEAD, chosen by the sender: 0 = none
+    uint32_t aead;
+    uint8_t aead_salt[AEAD_SALT_LEN];
+    // What the sender asks for, capped at what the receiver grants anyone.
+    // 0 = not said (an old peer, a cache entry), 1 otherwise.
+    uint32_t weight;
+    // Only with FEAT_SHM, from the sender: shm_ring = 0 means there is no
+    // ring. Both sides need the same host_id to agree to the feature.
+    uint8_t host_id[HOST_ID_LEN];
+    uint64_t shm_ring;
+};
+
+// Fragments [start, start + length), ranges sorted and disjoint. Missing
+// ones in a NACK, received ones beyond the cumulative ACK in a SACK.
+struct nack_range
+{
+    uint64_t start;
+    uint64_t length;
+};
+
+// Returns the number of bytes written to out (at most VARINT_MAX_LEN)
+size_t varint_encode(uint64_t value, uint8_t *out);
+
+// Returns the number of bytes consumed, or 0 if the input is truncated or overlong
+size_t varint_decode(const uint8_t *in, size_t len, uint64_t *value);
+
+// What a peer that doesn't send SETUP is assumed to support
+void params_default(struct xfer_params *p);
+// Returns -1 if there is no version both sides speak
+int params_negotiate(const struct xfer_params *a, const struct xfer_params *b, struct xfer_params *out);
+
+// CRC32C (Castagnoli), start with crc = 0
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Return the header length, or -1 if the buffer is too small / the packet is malformed
+int encode_frag_header(const struct frag_header *hdr, uint8_t *buf, size_t buf_size);
+// The same header from a template, which only leaves the varints for frag_no, offset and size to encode
+int frag_template_init(struct frag_template *t, uint64_t total_frag, const char *filename);
+int frag_template_fill(const struct frag_template *t, uint8_t flags, uint64_t frag_no, uint64_t offset,
+                       uint64_t size, uint32_t crc, uint8_t *buf, size_t buf_size);
+// The CRC is the header's last field, so it can go in once the payload is in place after it
+void frag_patch_crc(uint8_t *buf, size_t header_len, uint32_t crc);
+int decode_frag_header(const uint8_t *buf, size_t len, struct frag_header *hdr);
+
+// Return the packet length, or -1 on error
+int encode_setup(const struct xfer_params *p, uint8_t *buf, size_t buf_size);
+int decode_setup(const uint8_t *buf, size_t len, struct xfer_params *p);
+int encode_setup_accept(const struct xfer_params *p, uint8_t *buf, size_t buf_size);
+int encode_setup_reject(const char *reason, uint8_t *buf, size_t buf_size);
+// Returns 1 for YES (p is filled in), 0 for NO (reason is filled in), -1 if malformed
+int decode_setup_reply(const uint8_t *buf, size_t len, struct xfer_params *p, char *reason, size_t reason_size);
+int encode_ack(uint64_t frag_no, uint8_t *buf, size_t buf_size);
+int decode_ack(const uint8_t *buf, size_t len, uint64_t *frag_no);
+int encode_offer(const struct chunk_offer *offer, uint8_t *buf, size_t buf_size);
+int decode_offer(const uint8_t *buf, size_t len, struct chunk_offer *offer);
+int encode_want(uint64_t seq, const uint8_t *bitmap, uint32_t count, uint8_t *buf, size_t buf_size);
+// bitmap must hold OFFER_MAX_CHUNKS bits; returns the packet length or -1
+int decode_want(const uint8_t *buf, size_t len, uint64_t *seq, uint8_t *bitmap, uint32_t count);
+int encode_nack(const struct nack_range *ranges, uint32_t count, uint8_t *buf, size_t buf_size);
+// ranges must hold NACK_MAX_RANGES entries; *count is set to the number decoded
+int decode_nack(const uint8_t *buf, size_t len, struct nack_range *ranges, uint32_t *count);
+// Every fragment up to and including cumulative arrived, and so did the
+// ranges. window = 0 leaves the window out.
+int encode_sack(uint64_t cumulative, const struct nack_range *ranges, uint32_t count, uint32_t window,
+                uint8_t *buf, size_t buf_size);
+// ranges must hold SACK_MAX_RANGES entries; *count is set to the number
+// decoded and *window to 0 if the SACK doesn't say
+int decode_sack(const uint8_t *buf, size_t len, uint64_t *cumulative, struct nack_range *ranges,
+                uint32_t *count, uint32_t *window);
+// receiver_id tells apart multicast receivers that share an address and port
+int encode_done(uint64_t total_frag, uint64_t receiver_id, uint8_t *buf, size_t buf_size);
+int decode_done(const uint8_t *buf, size_t len, uint64_t *total_frag, uint64_t *receiver_id);
+// Hashes of the nodes are left out of a TREE_REQ
+int encode_tree(uint8_t type, const struct tree_node *nodes, uint32_t count, uint8_t *buf, size_t buf_size);
+// nodes must hold TREE_MAX_NODES entries; type is PKT_TREE_REQ or PKT_TREE
+int decode_tree(const uint8_t *buf, size_t len, uint8_t type, struct tree_node *nodes, uint32_t *count);
+// Blocks whose data has to come again
+int encode_repair(const struct nack_range *ranges, uint32_t count, uint8_t *buf, size_t buf_size);
+// ranges must hold REPAIR_MAX_RANGES entries
+int decode_repair(const uint8_t *buf, size_t len, struct nack_range *ranges, uint32_t *count);
+
+#endif
@@ -8,28 +8,386 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include "protocol.h"
+#include "chunkstore.h"
+#include "stats.h"
+#include "trace.h"
+#include "tcpxfer.h"
+#include "xferio.h"
+#include "merkle.h"
+#include "aead.h"
+#include "fairq.h"
+#include "shmring.h"
+#include <errno.h>
 
-#define PACKET_BUFFER_SIZE 1500
+#define PACKET_BUFFER_SIZE (FRAG_SIZE_MAX + FRAG_HEADER_MAX)
+#define RECV_WINDOW 1024        // fragments we are willing to have in flight
+#define SOCK_BUF_SIZE (4 << 20) // largest SO_RCVBUF/SO_SNDBUF we ask for
+#define NACK_TICK 0.01     // how often outstanding gaps are looked at again
+#define NACK_MIN_INTERVAL 0.005
+#define ACK_EVERY 2        // default -a: in-order fragments per SACK
+#define ACK_DELAY_US 1000  // default -A: longest a SACK is held back
+#define VERIFY_RETRY 0.05  // seconds without an answer before a TREE_REQ or REPAIR goes out again
+#define VERIFY_ROUNDS 8    // repairs that may fail to fix the root before giving up
+#define MAX_TRANSFERS 16   // at once
+#define WEIGHT_MAX 16      // largest share a sender may ask for, see -w
+#define RX_POOL 2048       // received fragments waiting for their turn, all transfers together
+#define RX_QUEUE_MAX 512   // of which one transfer may hold
+#define RX_BATCH 64        // datagrams read, or fragments served, before looking at anything else
+#define LINGER 1.0         // quiet seconds before a finished transfer is forgotten
+#define DONE_REPEAT 0.05   // seconds between DONEs to a sender that keeps sending
+#define POLL_SLACK 0.001   // held back ACKs go out this early rather than a wakeup late
+#define INGEST_BURST 0.01  // seconds of -R the ingest cap may save up
+#define RWND_HORIZON 0.05  // seconds of writing a transfer's window may queue up here
+#define RWND_MIN 4         // never advertise less, or the SACKs themselves dry up
+#define RWND_GROWTH 2      // fragments the window grows by per fragment written, until the rate is known
+#define WRITE_SAMPLE 0.01  // seconds spent writing per write rate sample
+
+// A chunk the sender has to send us, to be added to the store once it lands
+struct wanted_chunk
+{
+    uint64_t offset;
+    uint32_t length;
+    uint8_t hash[CHUNK_HASH_LEN];
+};
+
+// Receiver side of a deduplicated transfer
+struct dedup_state
+{
+    struct chunkstore *store; // NULL when running without a chunk store
+    uint64_t next_seq;        // next offer we expect
+    uint64_t file_offset;     // where the next offered chunk goes in the output
+    FILE *wanted;             // wanted_chunk records, on disk so RAM stays bounded
+    uint8_t last_reply[PACKET_BUFFER_SIZE];
+    int last_reply_len;
+    uint64_t chunks, reused, reused_bytes;
+};
+
+int handle_setup(int sockfd, const uint8_t *buffer, size_t len, struct sockaddr *addr, socklen_t addr_len,
+                 const struct xfer_params *local, struct xfer_params *agreed, struct shm_ring *ring);
+int handle_offer(int sockfd, const uint8_t *buffer, size_t len, struct sockaddr *addr, socklen_t addr_len,
+                 struct dedup_state *dd, struct xfer_sink **output, const char *sinkSpec);
+int dedup_ingest(struct dedup_state *dd, struct xfer_sink *output);
+
+// Fragments [start, end) not received yet
+struct gap
+{
+    uint64_t start;
+    uint64_t end;
+    double last_nack; // 0 = never reported
+    int nacks;
+};
+
+// Receiver side of a NACK mode transfer: the sender streams and we report
+// holes in the fragment sequence instead of acknowledging every fragment.
+// In ACK mode only the gap list is used, to tell when every fragment is in.
+struct nack_state
+{
+    bool active;
+    uint64_t total;
+    uint64_t highest; // highest fragment number seen
+    struct gap *gaps; // sorted, disjoint
+    size_t count;
+    size_t capacity;
+    double last_arrival;
+    double tail_nacked;
+    double srtt; // NACK -> repair turnaround, paces repeated NACKs
+};
+
+bool nack_on_fragment(struct nack_state *ns, uint64_t frag_no, double now);
+bool nack_complete(const struct nack_state *ns);
+int nack_send(struct nack_state *ns, int sockfd, struct sockaddr *addr, socklen_t addr_len,
+              double now, struct xfer_stats *stats);
+
+// Delayed ACKs. With FEAT_SACK every ACK is cumulative and lists what arrived
+// beyond the first hole, so one ACK can stand in for several fragments.
+// In-order fragments are acknowledged every `every` fragments or `delay`
+// after the first unacknowledged one, whichever comes first. A fragment that
+// opens or fills a hole, a duplicate or the last one is acknowledged right
+// away, so the sender hears about holes without delay.
+struct ack_state
+{
+    uint32_t every;
+    double delay;
+    uint32_t pending; // fragments received since the last ACK
+    double due;       // by when the pending ones have to be acknowledged
+};
+
+// FEAT_MERKLE: every block is hashed as soon as all of its bytes are in, so
+// at the end only the levels above the blocks are left to work out. If the
+// root doesn't match the sender's, its tree is walked top down, asking only
+// for the children of nodes that differ, down to the damaged blocks, and
+// just those are asked for again with REPAIR.
+// A block whose hash came out wrong. Repairs may arrive more than once, so
+// which bytes are in is tracked exactly, a bit per byte.
+struct bad_block
+{
+    struct tree_node theirs;
+    uint8_t *have;
+};
+
+enum verify_phase
+{
+    VERIFY_DATA,    // hashing blocks as they fill
+    VERIFY_DESCEND, // asking for the sender's nodes
+    VERIFY_REPAIR,  // waiting for the damaged blocks to come again
+    VERIFY_DONE,
+};
+
+struct verify_state
+{
+    bool active;
+    bool ticking; // requests are outstanding and may need repeating
+    enum verify_phase phase;
+    struct merkle_tree tree;
+    uint8_t root[TREE_HASH_LEN]; // the sender's
+    uint64_t *filled;            // bytes of each block in since it was last hashed
+    uint64_t remaining;          // blocks not hashed yet
+    uint8_t *block;              // one block read back for hashing
+    struct tree_node *ask;       // nodes to compare with the sender's
+    size_t ask_count, ask_capacity;
+    struct bad_block *bad;
+    size_t bad_count, bad_capacity;
+    double last_request;
+    unsigned rounds;
+};
+
+int verify_configure(struct verify_state *vs, const struct xfer_params *agreed);
+void verify_reset(struct verify_state *vs);
+int verify_on_data(struct verify_state *vs, struct xfer_sink *sink, uint64_t offset, uint64_t size,
+                   const uint8_t *data, bool zero, bool fresh, double now);
+int verify_on_tree(struct verify_state *vs, const uint8_t *buffer, size_t len, int sockfd, struct sockaddr *addr,
+                   socklen_t addr_len, double now);
+int verify_finish(struct verify_state *vs, struct xfer_sink *sink, int sockfd, struct sockaddr *addr,
+                  socklen_t addr_len, double now);
+int verify_retry(struct verify_state *vs, int sockfd, struct sockaddr *addr, socklen_t addr_len, double now);
+
+void ack_configure(struct ack_state *as, const struct xfer_params *agreed);
+int sack_send(struct ack_state *as, const struct nack_state *ns, uint32_t window, int sockfd, struct sockaddr *addr,
+              socklen_t addr_len, struct xfer_stats *stats);
+
+// One sender's transfer. Its DATA waits in `queue` until the fair scheduler
+// gives it a turn; everything else is answered as it arrives.
+struct transfer
+{
+    bool in_use;
+    unsigned number; // 1 for the first transfer taken, and so on
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    struct xfer_params agreed;
+    struct aead_ctx cipher;
+    struct shm_ring ring; // the sender's, when payloads come through shared memory
+    bool start_over; // the last SETUP was refused
+    struct xfer_sink *output;
+    char file_name[128];
+    char sink_spec[PATH_MAX + 16];
+    struct nack_state nack;
+    struct ack_state acks;
+    struct verify_state verify;
+    struct dedup_state dedup;
+    struct fq_flow queue;
+    struct xfer_stats stats;
+    // How fast the output takes fragments, counting only the time spent
+    // writing them; what FEAT_RWND windows are sized by
+    double write_rate; // fragments per second, 0 = not measured yet
+    uint32_t write_frags;
+    double write_busy;
+    double next_tick; // when gaps or tree requests are looked at again, a tick after the last packet
+    // once every fragment is in
+    bool finished;
+    bool send_done; // the sender waits for DONE rather than for its last ACKs
+    uint64_t receiver_id;
+    double last_heard;
+    double done_sent;
+};
+
+// A received DATA packet waiting for its transfer's turn
+struct rx_packet
+{
+    struct fq_item item;
+    size_t len;
+    uint8_t data[PACKET_BUFFER_SIZE];
+};
+
+struct receiver
+{
+    int sockfd;
+    const char *sink_spec;
+    const char *stats_path;
+    uint8_t psk[AEAD_KEY_FILE_MAX];
+    int psk_len;
+    double corrupt_rate;
+    struct xfer_params local;
+    struct chunkstore *store;
+    struct xfer_stats stats; // what can't be put down to a transfer, like the simulated loss
+    struct transfer *on_page; // the transfer the stat page shows, NULL = none
+    struct transfer transfers[MAX_TRANSFERS];
+    unsigned accepted, finished;
+    unsigned limit; // transfers to take, 0 = no limit
+    struct fq_sched sched;
+    struct rx_packet pool[RX_POOL];
+    struct rx_packet *free;
+    uint32_t free_count;
+    double rate; // ingest cap, bytes per second, 0 = none
+    double tokens;
+    double refilled;
+};
+
+void reset_transfer(struct receiver *r, struct transfer *t);
+void transfer_release(struct receiver *r, struct transfer *t);
+static bool transfers_in_use(const struct receiver *r);
+static struct transfer *transfer_find(struct receiver *r, const struct sockaddr_storage *addr);
+static struct transfer *transfer_new(struct receiver *r, const struct sockaddr_storage *addr, socklen_t addr_len);
+static void flush_queue(struct receiver *r, struct transfer *t);
+static void transfer_abort(struct receiver *r, struct transfer *t);
+static void transfer_complete(struct receiver *r, struct transfer *t, uint8_t flags, bool done, double now);
+static void transfer_timers(struct receiver *r, struct transfer *t, double now);
+static void page_handover(struct receiver *r);
+static void transfer_dump(const struct receiver *r, const struct transfer *t);
+static void linger_answer(struct receiver *r, struct transfer *t, const uint8_t *buffer, size_t len, double now);
+static struct rx_packet *packet_take(struct receiver *r);
+static void packet_release(struct receiver *r, struct rx_packet *p);
+static int wait_ms(const struct receiver *r, double now);
+static int receive_batch(struct receiver *r);
+static void serve_batch(struct receiver *r);
+static void refuse_busy(struct receiver *r, const uint8_t *buffer, struct sockaddr_storage *addr,
+                        socklen_t addr_len);
+static int on_setup(struct receiver *r, struct transfer *t, const uint8_t *buffer, size_t len);
+static int on_fragment(struct receiver *r, struct transfer *t, uint8_t *buffer, size_t bytes_received);
+int serve_tcp(int listen_fd, const char *sinkSpec, const char *statsPath);
+static int write_fragment(struct xfer_sink *sink, uint64_t offset, uint64_t size, const uint8_t *data, bool zero);
+static double now_seconds(void);
 
 int main(int argc, char *argv[])
 {
-    srand((time(NULL)));
+    srand(time(NULL) ^ getpid()); // several receivers started together must not drop the same packets
+
+    const char *storeDir = NULL;
+    const char *group = NULL;
+    const char *mcastIf = NULL;
+    uint32_t ackEvery = ACK_EVERY;
+    uint32_t ackDelayUs = ACK_DELAY_US;
+    bool tcpMode = false;
+    double ingestMbps = 0;
+    static struct receiver r; // the packet pool and every transfer's state, too big for the stack
+    r.sink_spec = "file";
+    r.limit = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:m:i:a:A:To:x:K:n:R:j:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            storeDir = optarg; // chunk store for deduplicated transfers
+            break;
+        case 'm':
+            group = optarg; // receive from this multicast group
+            break;
+        case 'i':
+            mcastIf = optarg; // address of the interface to join the group on
+            break;
+        case 'a':
+            ackEvery = (uint32_t)atoi(optarg); // ACK every this many in-order fragments
+            if (ackEvery < 1)
+            {
+                fprintf(stderr, "Invalid ACK count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            ackDelayUs = (uint32_t)atoi(optarg); // or after this many microseconds, 0 = ACK everything at once
+            break;
+        case 'T':
+            tcpMode = true; // take one plain TCP transfer (deliver -T) instead
+            break;
+        case 'o':
+            r.sink_spec = optarg; // file[:<path>], mem, verify or null, see xferio.h
+            if (sink_kind(r.sink_spec) < 0)
+            {
+                fprintf(stderr, "Unknown output: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            r.corrupt_rate = atof(optarg); // flip a byte in this share of fragments after the CRC check
+            if (r.corrupt_rate < 0 || r.corrupt_rate > 1)
+            {
+                fprintf(stderr, "Invalid corruption rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'K':
+            r.psk_len = aead_load_key(optarg, r.psk, sizeof(r.psk)); // decrypt transfers from senders with the same -K
+            if (r.psk_len < 0)
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            r.limit = (unsigned)atoi(optarg); // transfers to take before exiting, 0 = keep going
+            break;
+        case 'R':
+            ingestMbps = atof(optarg); // cap on what all transfers together may hand to the output, Mbit/s
+            if (ingestMbps <= 0)
+            {
+                fprintf(stderr, "Invalid ingest rate: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'j':
+            r.stats_path = optarg; // write transfer stats as JSON here at completion, transfer n > 1 to <path>.<n>
+            break;
+        case 't':
+            if (trace_init(optarg) != 0) // binary per-packet trace, decode with tracedump
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s <chunk store dir>] [-m <group> [-i <if addr>]] [-a <frags per ACK>] [-A <ACK delay us>] [-T] [-o <output>] [-x <corrupt rate>] [-K <key file>] [-n <transfers>] [-R <Mbit/s>] [-j <stats.json>] [-t <trace file>] <UDP listen port>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
     // check arguments
-    if (argc != 2)
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "Usage: %s [-s <chunk store dir>] [-m <group> [-i <if addr>]] [-a <frags per ACK>] [-A <ACK delay us>] [-T] [-o <output>] [-x <corrupt rate>] [-K <key file>] [-n <transfers>] [-R <Mbit/s>] [-j <stats.json>] [-t <trace file>] <UDP listen port>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (tcpMode && (group || storeDir))
     {
-        fprintf(stderr, "Usage: %s <UDP listen port>\n", argv[0]);
+        fprintf(stderr, "TCP mode takes a single plain transfer, -m and -s don't apply.\n");
         return EXIT_FAILURE;
     }
 
     // Read the UDP port from input
-    char *port = argv[1];
+    char *port = argv[optind];
+
+    struct chunkstore store;
+    if (storeDir)
+    {
+        if (chunkstore_open(&store, storeDir) != 0)
+        {
+            perror("chunkstore_open");
+            return EXIT_FAILURE;
+        }
+        r.store = &store;
+    }
 
     // Code from Beej's guide page 83 and 84
     struct addrinfo hints, *res;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET; // use IPv4 or IPv6, whichever
-    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_socktype = tcpMode ? SOCK_STREAM : SOCK_DGRAM;
     hints.ai_flags = AI_PASSIVE;
 
     int status = getaddrinfo(NULL, port, &hints, &res);
@@ -43,98 +401,1616 @@ int main(int argc, char *argv[])
     // create a UDP socket
     int server_socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
 
+    // several receivers on one host can share the port for the same group,
+    // and a TCP listener shouldn't wait for the last run's TIME_WAIT
+    if (group || tcpMode)
+    {
+        int yes = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    }
+
     // bind the socket to given address
     bind(server_socket, res->ai_addr, res->ai_addrlen);
 
-    // recv from the address
-    struct sockaddr_storage sender_addr;
-    socklen_t sender_addr_len = sizeof(sender_addr);
-    char buffer[PACKET_BUFFER_SIZE];
+    if (tcpMode)
+    {
+        status = serve_tcp(server_socket, r.sink_spec, r.stats_path);
+        close(server_socket);
+        return status == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    if (group)
+    {
+        struct ip_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (inet_pton(AF_INET, group, &mreq.imr_multiaddr) <= 0 ||
+            (mcastIf && inet_pton(AF_INET, mcastIf, &mreq.imr_interface) <= 0) ||
+            setsockopt(server_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        {
+            perror("IP_ADD_MEMBERSHIP");
+            return EXIT_FAILURE;
+        }
+        printf("Joined multicast group %s\n", group);
+    }
+
+    r.sockfd = server_socket;
+    stats_init(&r.stats);
+    stats_install_sigusr1();
+    stats_publish(&r.stats, "receiver");
+    fq_init(&r.sched, PACKET_BUFFER_SIZE);
+    for (int i = RX_POOL - 1; i >= 0; i--)
+    {
+        r.pool[i].item.next = r.free ? &r.free->item : NULL;
+        r.free = &r.pool[i];
+    }
+    r.free_count = RX_POOL;
+    r.rate = ingestMbps * 1e6 / 8;
+    r.refilled = now_seconds();
+
+    // What we can do; a sender that skips SETUP gets params_default()
+    struct xfer_params *local = &r.local;
+    local->version = PROTO_VERSION;
+    // Reused chunks are copied file to file, so deduplication needs a file to write
+    bool canDedup = r.store && sink_kind(r.sink_spec) == SINK_FILE;
+    // Blocks are checked by reading them back
+    bool canVerify = sink_kind(r.sink_spec) == SINK_FILE || sink_kind(r.sink_spec) == SINK_MEMORY;
+    local->features = FEAT_NACK | FEAT_CRC | FEAT_SACK | FEAT_SPARSE | (canDedup ? FEAT_DEDUP : 0) |
+                      (canVerify ? FEAT_MERKLE : 0) | (r.psk_len > 0 ? FEAT_AEAD : 0) | FEAT_RWND;
+    local->max_frag = FRAG_SIZE_MAX;
+    local->window = RECV_WINDOW;
+    local->sock_buf = SOCK_BUF_SIZE;
+    local->ack_every = ackEvery;
+    local->ack_delay_us = ackDelayUs;
+    local->tree_block = 0; // the tree comes from the sender
+    local->tree_size = 0;
+    memset(local->tree_root, 0, sizeof(local->tree_root));
+    local->aead = 0; // so are the cipher and salt
+    memset(local->aead_salt, 0, sizeof(local->aead_salt));
+    local->weight = WEIGHT_MAX;
+    // Senders on this machine may hand over payloads in shared memory
+    if (shm_host_id(local->host_id) == 0)
+    {
+        local->features |= FEAT_SHM;
+    }
+    local->shm_ring = 0;
+
+    // Main loop: take in what has arrived, then hand queued fragments to
+    // their transfers in fair order for as long as the ingest cap allows,
+    // then whatever timers are due. Runs until the transfers asked for have
+    // finished and stopped lingering.
+    while (r.limit == 0 || r.finished < r.limit || transfers_in_use(&r))
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            for (int i = 0; i < MAX_TRANSFERS; i++)
+            {
+                if (r.transfers[i].in_use)
+                {
+                    transfer_dump(&r, &r.transfers[i]);
+                }
+            }
+        }
+
+        struct pollfd pfd = {server_socket, POLLIN, 0};
+        int ready = poll(&pfd, 1, wait_ms(&r, now_seconds()));
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (ready > 0 && receive_batch(&r) != 0)
+        {
+            break;
+        }
+        serve_batch(&r);
+
+        double now = now_seconds();
+        for (int i = 0; i < MAX_TRANSFERS; i++)
+        {
+            if (r.transfers[i].in_use)
+            {
+                transfer_timers(&r, &r.transfers[i], now);
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        if (r.transfers[i].in_use)
+        {
+            transfer_release(&r, &r.transfers[i]);
+        }
+    }
+    if (r.stats.frags_dropped)
+    {
+        printf("Dropped %" PRIu64 " datagrams on purpose\n", r.stats.frags_dropped);
+    }
+    if (r.store)
+    {
+        chunkstore_close(r.store);
+    }
+    close(server_socket);
+    return 0;
+}
+
+static bool transfers_in_use(const struct receiver *r)
+{
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        if (r->transfers[i].in_use)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *x = (const struct sockaddr_in *)a, *y = (const struct sockaddr_in *)b;
+    return x->sin_family == y->sin_family && x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+}
+
+static struct transfer *transfer_find(struct receiver *r, const struct sockaddr_storage *addr)
+{
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        if (r->transfers[i].in_use && same_address(&r->transfers[i].addr, addr))
+        {
+            return &r->transfers[i];
+        }
+    }
+    return NULL;
+}
+
+// A new sender: NULL if we are taking no more transfers, or no more at once
+static struct transfer *transfer_new(struct receiver *r, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    if (r->limit && r->accepted >= r->limit)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        struct transfer *t = &r->transfers[i];
+        if (!t->in_use)
+        {
+            memset(t, 0, sizeof(*t));
+            t->in_use = true;
+            t->ring.fd = -1;
+            t->number = ++r->accepted;
+            t->addr = *addr;
+            t->addr_len = addr_len;
+            params_default(&t->agreed);
+            t->dedup.store = r->store;
+            t->dedup.next_seq = 1;
+            fq_flow_init(&t->queue, 1);
+            stats_init(&t->stats);
+            page_handover(r);
+            sink_spec_nth(r->sink_spec, t->number, t->sink_spec, sizeof(t->sink_spec));
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void flush_queue(struct receiver *r, struct transfer *t)
+{
+    struct fq_item *item = fq_flush(&r->sched, &t->queue);
+    while (item)
+    {
+        struct fq_item *next = item->next;
+        packet_release(r, (struct rx_packet *)item);
+        item = next;
+    }
+}
+
+void transfer_release(struct receiver *r, struct transfer *t)
+{
+    flush_queue(r, t);
+    if (t->output)
+    {
+        sink_close(t->output);
+    }
+    free(t->nack.gaps);
+    verify_reset(&t->verify);
+    aead_free(&t->cipher);
+    shm_ring_close(&t->ring);
+    if (t->dedup.wanted)
+    {
+        fclose(t->dedup.wanted);
+    }
+    memset(t, 0, sizeof(*t));
+    if (r->on_page == t)
+    {
+        r->on_page = NULL;
+        page_handover(r);
+    }
+}
+
+// Something went wrong with one transfer: the others go on without it
+static void transfer_abort(struct receiver *r, struct transfer *t)
+{
+    fprintf(stderr, "Giving up on transfer %u%s%s\n", t->number, t->file_name[0] ? ", " : "", t->file_name);
+    transfer_release(r, t);
+    r->finished++;
+}
+
+// Every fragment is in (and checked): close the output and stay around
+// for a while to answer a sender that hasn't heard yet
+static void transfer_complete(struct receiver *r, struct transfer *t, uint8_t flags, bool done, double now)
+{
+    printf("File transfer completed. Saved as: %s\n", t->file_name);
+    if ((flags & FRAG_FLAG_DEDUP) && dedup_ingest(&t->dedup, t->output) != 0)
+    {
+        fprintf(stderr, "Error adding received chunks to the store.\n");
+    }
+    sink_close(t->output);
+    t->output = NULL;
+    flush_queue(r, t);
+    r->finished++;
+    stats_finish(&t->stats);
+    if (r->stats_path)
+    {
+        transfer_dump(r, t);
+    }
+    TRACE(TR_DONE, t->nack.total, 0);
+
+    t->finished = true;
+    page_handover(r); // it stays on show as done if nothing else is running
+    t->send_done = done;
+    t->last_heard = now;
+    t->receiver_id = ((uint64_t)getpid() << 32) | (uint32_t)rand();
+    if (done)
+    {
+        linger_answer(r, t, NULL, 0, now);
+    }
+}
+
+// The process has one stat page, so it shows one transfer at a time: the
+// oldest one still running. The last one to have it keeps it while there
+// is none.
+static void page_handover(struct receiver *r)
+{
+    struct transfer *next = NULL;
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        struct transfer *t = &r->transfers[i];
+        if (t->in_use && !t->finished && (!next || t->number < next->number))
+        {
+            next = t;
+        }
+    }
+    if (!next || next == r->on_page)
+    {
+        return;
+    }
+    if (r->on_page)
+    {
+        r->on_page->stats.page = NULL;
+    }
+    r->stats.page = NULL;
+    r->on_page = next;
+    stats_publish(&next->stats, "receiver");
+    if (next->file_name[0])
+    {
+        stats_on_start(&next->stats, next->file_name, 0, next->nack.total);
+    }
+}
+
+// -j: transfer n > 1 gets <path>.<n>, so concurrent transfers don't overwrite each other
+static void transfer_dump(const struct receiver *r, const struct transfer *t)
+{
+    char path[PATH_MAX + 16];
+    if (t->number < 2 || !r->stats_path || strcmp(r->stats_path, "-") == 0)
+    {
+        stats_dump_json(&t->stats, "receiver", r->stats_path);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s.%u", r->stats_path, t->number);
+    stats_dump_json(&t->stats, "receiver", path);
+}
+
+// A finished transfer's sender may not know yet. Tell it we are done, or
+// answer the retransmissions whose ACKs got lost (or dropped by us), until
+// it has been quiet for LINGER. With multicast the sender may still be
+// repairing other receivers, so DONE goes out at most every DONE_REPEAT
+// rather than once per packet.
+static void linger_answer(struct receiver *r, struct transfer *t, const uint8_t *buffer, size_t len, double now)
+{
+    struct sockaddr *addr = (struct sockaddr *)&t->addr;
+    uint8_t reply[2 * VARINT_MAX_LEN + 1];
+    int reply_len = -1;
+    t->last_heard = now;
+    if (t->send_done)
+    {
+        if (now - t->done_sent >= DONE_REPEAT)
+        {
+            reply_len = encode_done(t->nack.total, t->receiver_id, reply, sizeof(reply));
+            t->done_sent = now;
+        }
+    }
+    else
+    {
+        struct frag_header hdr;
+        if (buffer && decode_frag_header(buffer, len, &hdr) >= 0)
+        {
+            reply_len = (t->agreed.features & FEAT_SACK) ? encode_sack(t->nack.total, NULL, 0, 0, reply, sizeof(reply))
+                                                         : encode_ack(hdr.frag_no, reply, sizeof(reply));
+        }
+    }
+    if (reply_len > 0)
+    {
+        sendto(r->sockfd, reply, reply_len, 0, addr, t->addr_len);
+    }
+}
+
+static struct rx_packet *packet_take(struct receiver *r)
+{
+    struct rx_packet *p = r->free;
+    if (p)
+    {
+        r->free = (struct rx_packet *)p->item.next;
+        r->free_count--;
+    }
+    return p;
+}
+
+static void packet_release(struct receiver *r, struct rx_packet *p)
+{
+    p->item.next = r->free ? &r->free->item : NULL;
+    r->free = p;
+    r->free_count++;
+}
+
+// FEAT_RWND: how many fragments the sender may have in flight. The ones
+// waiting in our queue are in flight for it too, so its whole share of the
+// queue counts, as far as the pool can still back it. An output slower than
+// that cuts the window to RWND_HORIZON of writing: a slow disk then shows up
+// at the sender as a smaller window rather than as fragments shed here or
+// as a queue that outlasts its retransmission timeouts. That queue is in
+// every RTT sample, hence the short horizon; a path with a longer round trip
+// than that can't keep the disk quite busy. Until the first rate sample the
+// window grows from RWND_INITIAL, like a slow start.
+static uint32_t receive_window(const struct receiver *r, const struct transfer *t)
+{
+    if (!(t->agreed.features & FEAT_RWND))
+    {
+        return 0;
+    }
+    uint32_t window = t->queue.queued + r->free_count;
+    window = window < RX_QUEUE_MAX ? window : RX_QUEUE_MAX;
+    double allowed = t->write_rate > 0 ? t->write_rate * RWND_HORIZON
+                                       : RWND_INITIAL + (double)RWND_GROWTH * t->write_frags;
+    if (allowed < window)
+    {
+        window = (uint32_t)allowed;
+    }
+    return window > RWND_MIN ? window : RWND_MIN;
+}
+
+// Another fragment written in `seconds`; every WRITE_SAMPLE of writing makes a sample
+static void write_measure(struct transfer *t, double seconds)
+{
+    t->write_frags++;
+    t->write_busy += seconds;
+    if (t->write_busy >= WRITE_SAMPLE)
+    {
+        double sample = t->write_frags / t->write_busy;
+        t->write_rate = t->write_rate > 0 ? 0.75 * t->write_rate + 0.25 * sample : sample;
+        t->write_frags = 0;
+        t->write_busy = 0;
+    }
+}
 
-    FILE *outputFile = NULL;
-    char receivedFileName[128] = {0};
+// How long poll() may sleep: not at all while there is queued work the
+// ingest cap allows, else until the cap allows it or a transfer's next timer
+static int wait_ms(const struct receiver *r, double now)
+{
+    double wait = INFINITY;
+    if (r->sched.head)
+    {
+        if (r->rate == 0 || r->tokens > 0)
+        {
+            return 0;
+        }
+        wait = -r->tokens / r->rate - (now - r->refilled);
+    }
+    for (int i = 0; i < MAX_TRANSFERS; i++)
+    {
+        const struct transfer *t = &r->transfers[i];
+        if (!t->in_use)
+        {
+            continue;
+        }
+        double due = t->finished ? t->last_heard + LINGER : INFINITY;
+        if (!t->finished && t->acks.pending && t->acks.due - POLL_SLACK < due)
+        {
+            due = t->acks.due - POLL_SLACK;
+        }
+        if (!t->finished && (t->nack.active || t->verify.ticking) && t->next_tick < due)
+        {
+            due = t->next_tick;
+        }
+        if (due - now < wait)
+        {
+            wait = due - now;
+        }
+    }
+    if (wait == INFINITY)
+    {
+        return -1;
+    }
+    return wait > 0 ? (int)ceil(wait * 1000) : 0;
+}
 
-    // main loop to receive file
-    while (1)
+// Reads what has arrived, up to RX_BATCH datagrams. Control packets are
+// handled right away, DATA goes to the back of its transfer's queue.
+static int receive_batch(struct receiver *r)
+{
+    uint8_t scratch[PACKET_BUFFER_SIZE];
+    for (int i = 0; i < RX_BATCH; i++)
     {
-        // receive packet
-        ssize_t bytes_received = recvfrom(server_socket, buffer, PACKET_BUFFER_SIZE, 0, (struct sockaddr *)&sender_addr, &sender_addr_len);
+        // Straight into a queue slot when there is one left, DATA then needs no copy
+        struct rx_packet *slot = r->free;
+        uint8_t *buffer = slot ? slot->data : scratch;
+        struct sockaddr_storage sender_addr;
+        socklen_t sender_addr_len = sizeof(sender_addr);
+        ssize_t bytes_received = recvfrom(r->sockfd, buffer, PACKET_BUFFER_SIZE, MSG_DONTWAIT,
+                                          (struct sockaddr *)&sender_addr, &sender_addr_len);
         if (bytes_received < 0)
         {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return 0;
+            }
             perror("recvfrom");
-            break;
+            return -1;
         }
 
         // LOGIC TO DROP PACKETS SOMETIMES
         double number = (double)rand() / RAND_MAX; // number between zero and one
         if (number < 0.1)                          // 10% change of dropping a packet
         {
-            printf("Packet dropped\n");
+            TRACE(TR_DROP, bytes_received, 0);
+            r->stats.frags_dropped++;
             continue; // don't send ACK
         }
 
-        // format header from the packet
-        int total_frag, frag_no, size;
-        char filename[128];
-        int header_length = 0;
-
-        int items = sscanf(buffer, "%u:%u:%u:%127[^:]:%n",
-                           &total_frag, &frag_no, &size, filename, &header_length);
-        if (items != 4)
+        double now = now_seconds();
+        struct transfer *t = transfer_find(r, &sender_addr);
+        if (t && t->finished)
         {
-            fprintf(stderr,
-                    "Error parsing packet header. Packet contents:\n%.*s\n",
-                    (int)bytes_received, buffer);
+            linger_answer(r, t, buffer, (size_t)bytes_received, now);
             continue;
         }
+        if (!t && (buffer[0] == 'f' || buffer[0] == PKT_DATA))
+        {
+            t = transfer_new(r, &sender_addr, sender_addr_len);
+            if (!t)
+            {
+                refuse_busy(r, buffer, &sender_addr, sender_addr_len);
+                continue;
+            }
+        }
+        if (!t)
+        {
+            continue;
+        }
+        t->next_tick = now + NACK_TICK; // only quiet ticks count, as with a receive timeout
 
-        printf("Received packet %u/%u (header %d bytes, data size %u bytes)\n", frag_no, total_frag, header_length, size);
+        if (buffer[0] == 'f')
+        {
+            if (on_setup(r, t, buffer, (size_t)bytes_received) != 0)
+            {
+                transfer_abort(r, t);
+            }
+            continue;
+        }
 
-        if (frag_no == 1)
+        if (buffer[0] == PKT_TREE)
         {
-            strncpy(receivedFileName, filename, sizeof(receivedFileName) - 1);
-            outputFile = fopen("finishedFile.jpeg", "wb"); // open create since it's first fragment
-            if (!outputFile)
+            if (verify_on_tree(&t->verify, buffer, bytes_received, r->sockfd, (struct sockaddr *)&t->addr,
+                               t->addr_len, now) != 0)
             {
-                perror("fopen");
-                break;
+                transfer_abort(r, t);
             }
-            printf("Opened file '%s' for writing.\n", receivedFileName);
+            continue;
         }
 
-        // write the file data
-        if (size > 0)
+        if (buffer[0] == PKT_OFFER)
         {
-            size_t written = fwrite(buffer + header_length, 1, size, outputFile);
-            if (written != size)
+            stats_on_state(&t->stats, XS_OFFER);
+            if (handle_offer(r->sockfd, buffer, bytes_received, (struct sockaddr *)&t->addr, t->addr_len,
+                             &t->dedup, &t->output, t->sink_spec) != 0)
             {
-                fprintf(stderr, "Error writing file data.\n");
-                fclose(outputFile);
-                break;
+                transfer_abort(r, t);
             }
+            continue;
         }
 
-        // send ACK
-        const char ack[] = "received";
-        ssize_t ack_sent = sendto(server_socket, ack, strlen(ack), 0,
-                                  (struct sockaddr *)&sender_addr, sender_addr_len);
-        if (ack_sent < 0)
+        // A transfer that sends faster than it gets served only fills its own queue
+        if (!slot || t->queue.queued >= RX_QUEUE_MAX)
         {
-            perror("sendto");
-            fclose(outputFile);
-            break;
+            TRACE(TR_DROP, bytes_received, 2);
+            t->stats.frags_shed++;
+            continue;
         }
-        printf("Sent ACK for packet %d\n", frag_no);
+        packet_take(r);
+        slot->len = (size_t)bytes_received;
+        slot->item.cost = (uint32_t)bytes_received;
+        fq_enqueue(&r->sched, &t->queue, &slot->item);
+    }
+    return 0;
+}
 
-        if (frag_no == total_frag)
+// Hands queued fragments to their transfers, in DRR order by the transfers'
+// weights, while the ingest cap has bytes to spare
+static void serve_batch(struct receiver *r)
+{
+    if (r->rate > 0)
+    {
+        double now = now_seconds();
+        double burst = r->rate * INGEST_BURST > PACKET_BUFFER_SIZE ? r->rate * INGEST_BURST : PACKET_BUFFER_SIZE;
+        r->tokens += (now - r->refilled) * r->rate;
+        r->tokens = r->tokens < burst ? r->tokens : burst;
+        r->refilled = now;
+    }
+    for (int i = 0; i < RX_BATCH && (r->rate == 0 || r->tokens > 0); i++)
+    {
+        struct fq_flow *flow;
+        struct fq_item *item = fq_dequeue(&r->sched, &flow);
+        if (!item)
         {
-            printf("File transfer completed. Saved as: %s\n", receivedFileName);
-            fclose(outputFile);
-            outputFile = NULL;
             break;
         }
+        struct rx_packet *p = (struct rx_packet *)item;
+        struct transfer *t = (struct transfer *)((char *)flow - offsetof(struct transfer, queue));
+        r->tokens -= r->rate > 0 ? (double)p->len : 0;
+        if (on_fragment(r, t, p->data, p->len) != 0)
+        {
+            transfer_abort(r, t);
+        }
+        packet_release(r, p);
     }
+}
 
-    close(server_socket);
+// SETUP from a sender we are taking no more transfers from
+static void refuse_busy(struct receiver *r, const uint8_t *buffer, struct sockaddr_storage *addr,
+                        socklen_t addr_len)
+{
+    if (buffer[0] != 'f')
+    {
+        return; // DATA without a SETUP, from a sender that can't be told
+    }
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    int reply_len = encode_setup_reject("receiver busy", reply, sizeof(reply));
+    if (reply_len > 0)
+    {
+        sendto(r->sockfd, reply, reply_len, 0, (struct sockaddr *)addr, addr_len);
+    }
+}
+
+static int on_setup(struct receiver *r, struct transfer *t, const uint8_t *buffer, size_t len)
+{
+    stats_on_state(&t->stats, XS_SETUP);
+    int rc = handle_setup(r->sockfd, buffer, len, (struct sockaddr *)&t->addr, t->addr_len, &r->local, &t->agreed,
+                          &t->ring);
+    if (rc < 0)
+    {
+        return -1;
+    }
+    // Data that came with a refused early SETUP is void, and so is
+    // whatever it still had in flight when the sender tries again
+    if (rc > 0 || t->start_over)
+    {
+        reset_transfer(r, t);
+    }
+    t->start_over = rc > 0;
+    ack_configure(&t->acks, &t->agreed);
+    if (verify_configure(&t->verify, &t->agreed) != 0)
+    {
+        perror("malloc");
+        return -1;
+    }
+    aead_free(&t->cipher);
+    if ((t->agreed.features & FEAT_AEAD) &&
+        aead_init(&t->cipher, t->agreed.aead, r->psk, (size_t)r->psk_len, t->agreed.aead_salt) != 0)
+    {
+        // Every fragment will fail to open, the sender gives up on its own
+        fprintf(stderr, "Can't set up cipher %u, this transfer can't be decrypted\n", t->agreed.aead);
+    }
+    t->queue.weight = t->agreed.weight ? t->agreed.weight : 1;
+    return 0;
+}
+
+// One DATA packet, on its turn: check it, write it, acknowledge it.
+// Returns -1 if the transfer can't go on.
+static int on_fragment(struct receiver *r, struct transfer *t, uint8_t *buffer, size_t bytes_received)
+{
+    struct sockaddr *addr = (struct sockaddr *)&t->addr;
+
+    // decode header from the packet
+    struct frag_header hdr;
+    int header_length = decode_frag_header(buffer, bytes_received, &hdr);
+    if (header_length < 0)
+    {
+        fprintf(stderr, "Error parsing packet header (%zu bytes)\n", bytes_received);
+        return 0;
+    }
+
+    bool zero = hdr.flags & FRAG_FLAG_ZERO;
+    bool sealed = hdr.flags & FRAG_FLAG_AEAD;
+
+    // The payload is behind the header, or in the sender's ring. A slot that
+    // holds a later fragment by now means this one is lost.
+    uint8_t *payload = buffer + header_length;
+    if ((hdr.flags & FRAG_FLAG_SHM) &&
+        (!t->ring.base || !(payload = shm_slot_read(&t->ring, hdr.frag_no, hdr.size + (sealed ? AEAD_TAG_LEN : 0)))))
+    {
+        TRACE(TR_DROP, bytes_received, 3);
+        t->stats.frags_stale++;
+        return 0;
+    }
+
+    // A corrupted fragment is as good as lost: no ACK, and NACK mode reports the gap.
+    // Once a key is agreed, anything that isn't sealed with it counts as corrupted.
+    if (sealed != ((t->agreed.features & FEAT_AEAD) != 0) ||
+        (sealed && (!t->cipher.cipher || aead_open(&t->cipher, hdr.frag_no, buffer, (size_t)header_length,
+                                                   payload, zero ? 0 : hdr.size) != 0)) ||
+        ((hdr.flags & FRAG_FLAG_CRC) && crc32c(0, payload, hdr.size) != hdr.crc))
+    {
+        TRACE(TR_DROP, bytes_received, 1);
+        t->stats.frags_corrupt++;
+        return 0;
+    }
+
+    if (r->corrupt_rate > 0 && !zero && hdr.size > 0 && (double)rand() / RAND_MAX < r->corrupt_rate)
+    {
+        payload[rand() % hdr.size] ^= 0x5a; // damage the CRC can't catch, for -V to find
+    }
+    stats_on_receive(&t->stats, zero ? 0 : hdr.size);
+    TRACE(TR_RECV, hdr.frag_no, hdr.size);
+
+    if (!t->file_name[0])
+    {
+        snprintf(t->file_name, sizeof(t->file_name), "%s", hdr.filename);
+        stats_on_start(&t->stats, t->file_name, 0, hdr.total_frag);
+    }
+    if (!t->output)
+    {
+        t->output = sink_open(t->sink_spec); // open create since it's the first fragment we see
+        if (!t->output)
+        {
+            return -1;
+        }
+        printf("Opened file '%s' for writing.\n", t->file_name);
+    }
+
+    // Fragments may arrive in any order (the sender keeps a window in
+    // flight), so completion is tracked the same way in both modes
+    double now = now_seconds();
+    struct nack_state *nack = &t->nack;
+    if (nack->total == 0)
+    {
+        nack->total = hdr.total_frag;
+    }
+    bool inOrder = hdr.frag_no == nack->highest + 1; // neither opens nor fills a hole
+    bool fresh = nack_on_fragment(nack, hdr.frag_no, now);
+
+    // write the file data at its own offset. A retransmitted fragment whose
+    // ACK got lost is already there, and writing it again would only take
+    // the disk's time from new ones. A run of zeros stays a hole in the
+    // output, as it was in the sender's file. Blocks that are being checked
+    // only take what they still need.
+    if (t->verify.active ? verify_on_data(&t->verify, t->output, hdr.offset, hdr.size, payload,
+                                          zero, fresh, now) != 0
+                         : fresh && write_fragment(t->output, hdr.offset, hdr.size, payload, zero) != 0)
+    {
+        fprintf(stderr, "Error writing file data.\n");
+        return -1;
+    }
+    if (fresh && (t->agreed.features & FEAT_RWND))
+    {
+        write_measure(t, now_seconds() - now);
+    }
+    int verdict = nack_complete(nack) ? verify_finish(&t->verify, t->output, r->sockfd, addr, t->addr_len, now)
+                                      : 0;
+    if (verdict < 0)
+    {
+        return -1;
+    }
+
+    if (hdr.flags & FRAG_FLAG_NACK)
+    {
+        if (!nack->active)
+        {
+            // From now on look at the gaps every tick even if nothing arrives
+            nack->active = true;
+        }
+
+        if (verdict > 0)
+        {
+            transfer_complete(r, t, hdr.flags, true, now);
+            return 0;
+        }
+        return nack_send(nack, r->sockfd, addr, t->addr_len, now, &t->stats);
+    }
+
+    if (t->agreed.features & FEAT_SACK)
+    {
+        struct ack_state *acks = &t->acks;
+        acks->pending++;
+        uint32_t window = receive_window(r, t);
+        if (!fresh || !inOrder || acks->pending >= acks->every || (window && acks->pending * 2 >= window) ||
+            nack_complete(nack))
+        {
+            if (sack_send(acks, nack, window, r->sockfd, addr, t->addr_len, &t->stats) != 0)
+            {
+                return -1;
+            }
+        }
+        else if (acks->pending == 1)
+        {
+            acks->due = now + acks->delay;
+        }
+    }
+    else
+    {
+        // A sender that skipped SETUP gets an ACK for every fragment
+        uint8_t ack[VARINT_MAX_LEN + 1];
+        int ack_len = encode_ack(hdr.frag_no, ack, sizeof(ack));
+        if (sendto(r->sockfd, ack, ack_len, 0, addr, t->addr_len) < 0)
+        {
+            perror("sendto");
+            return -1;
+        }
+        t->stats.acks_sent++;
+        TRACE(TR_SEND_ACK, hdr.frag_no, 0);
+    }
+
+    if (verdict > 0)
+    {
+        // With a tree the sender waits for a verdict, not for its last ACKs
+        transfer_complete(r, t, hdr.flags, t->verify.active, now);
+    }
+    return 0;
+}
+
+// Held back ACKs that are due, gaps to report again, tree requests and
+// repairs to repeat, and finished transfers that have gone quiet
+static void transfer_timers(struct receiver *r, struct transfer *t, double now)
+{
+    struct sockaddr *addr = (struct sockaddr *)&t->addr;
+    if (t->finished)
+    {
+        if (now - t->last_heard >= LINGER)
+        {
+            transfer_release(r, t);
+        }
+        return;
+    }
+    if (t->acks.pending && now >= t->acks.due - POLL_SLACK &&
+        sack_send(&t->acks, &t->nack, receive_window(r, t), r->sockfd, addr, t->addr_len, &t->stats) != 0)
+    {
+        transfer_abort(r, t);
+        return;
+    }
+    if ((t->nack.active || t->verify.ticking) && now >= t->next_tick)
+    {
+        t->next_tick = now + NACK_TICK;
+        // Every fragment is in once the check is under way, only it is left
+        int rc = t->verify.ticking ? verify_retry(&t->verify, r->sockfd, addr, t->addr_len, now)
+                                   : nack_send(&t->nack, r->sockfd, addr, t->addr_len, now, &t->stats);
+        if (rc != 0)
+        {
+            transfer_abort(r, t);
+        }
+    }
+}
+
+// Baseline mode: one TCP connection carries the whole file, spliced
+// straight from the socket into the output file
+int serve_tcp(int listen_fd, const char *sinkSpec, const char *statsPath)
+{
+    if (listen(listen_fd, 1) < 0)
+    {
+        perror("listen");
+        return -1;
+    }
+    struct xfer_sink *output = sink_open(sinkSpec);
+    if (!output)
+    {
+        return -1;
+    }
+
+    struct xfer_stats stats;
+    stats_init(&stats);
+    stats_install_sigusr1();
+    stats_publish(&stats, "receiver");
+    char receivedFileName[MAX_FILENAME];
+    int status = tcp_receive_file(listen_fd, output, receivedFileName, sizeof(receivedFileName), &stats,
+                                  statsPath);
+    if (sink_close(output) != 0)
+    {
+        status = -1;
+    }
+    if (status != 0)
+    {
+        return -1;
+    }
+
+    printf("File transfer completed. Saved as: %s\n", receivedFileName);
+    stats_finish(&stats);
+    if (statsPath)
+    {
+        stats_dump_json(&stats, "receiver", statsPath);
+    }
+    return 0;
+}
+
+// Answer SETUP with the configuration we'll use, or NO if there is none.
+// A retransmitted SETUP (our answer got lost) gets the same answer again.
+//
+// An early SETUP (zero round trip start) is already followed by data, which
+// we take optimistically, so its parameters can only be accepted exactly as
+// they are. Returns 1 when the SETUP was refused.
+int handle_setup(int sockfd, const uint8_t *buffer, size_t len, struct sockaddr *addr, socklen_t addr_len,
+                 const struct xfer_params *local, struct xfer_params *agreed, struct shm_ring *ring)
+{
+    uint8_t reply[PACKET_BUFFER_SIZE];
+    struct xfer_params offered;
+    int reply_len;
+
+    if (decode_setup(buffer, len, &offered) < 0)
+    {
+        params_default(&offered);
+        reply_len = encode_setup_reject("malformed setup", reply, sizeof(reply));
+    }
+    else if (params_negotiate(local, &offered, agreed) != 0)
+    {
+        reply_len = encode_setup_reject("no common protocol version", reply, sizeof(reply));
+    }
+    else if (offered.early && (agreed->version != offered.version || agreed->features != offered.features ||
+                               agreed->max_frag != offered.max_frag))
+    {
+        char reason[SETUP_REASON_MAX];
+        snprintf(reason, sizeof(reason), "cached parameters not supported, features 0x%x, fragment %u bytes",
+                 agreed->features, agreed->max_frag);
+        reply_len = encode_setup_reject(reason, reply, sizeof(reply));
+    }
+    else
+    {
+        // The same boot id is the same kernel, but not necessarily the same
+        // /dev/shm: only a ring we could open makes FEAT_SHM. A repeated
+        // SETUP finds it open already, the sender may have unlinked it since.
+        if ((agreed->features & FEAT_SHM) && !(ring->base && ring->id == agreed->shm_ring))
+        {
+            shm_ring_close(ring);
+            if (shm_ring_attach(ring, agreed->shm_ring) != 0)
+            {
+                agreed->features &= ~FEAT_SHM;
+                agreed->shm_ring = 0;
+                memset(agreed->host_id, 0, sizeof(agreed->host_id));
+            }
+        }
+        agreed->frag_limit = local->max_frag;
+        reply_len = encode_setup_accept(agreed, reply, sizeof(reply));
+    }
+    TRACE(TR_SETUP, offered.version, offered.features);
+
+    if (reply_len < 0 || sendto(sockfd, reply, reply_len, 0, addr, addr_len) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    if (reply[0] == 'n')
+    {
+        fprintf(stderr, "Refused setup: %.*s\n", reply_len - 2, (const char *)reply + 2);
+        params_default(agreed);
+        return 1;
+    }
+
+    if (agreed->sock_buf)
+    {
+        int size = (int)agreed->sock_buf;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+    printf("Setup: version %u, features 0x%x, fragment %u bytes, window %u, socket buffers %u bytes, weight %u\n",
+           agreed->version, agreed->features, agreed->max_frag, agreed->window, agreed->sock_buf, agreed->weight);
+    return 0;
+}
+
+// Forget a transfer started by a refused early SETUP
+void reset_transfer(struct receiver *r, struct transfer *t)
+{
+    if (t->output)
+    {
+        sink_close(t->output); // the next fragment truncates it
+        t->output = NULL;
+    }
+    flush_queue(r, t);
+
+    free(t->nack.gaps);
+    memset(&t->nack, 0, sizeof(t->nack));
+    memset(&t->acks, 0, sizeof(t->acks));
+    verify_reset(&t->verify);
+    shm_ring_close(&t->ring);
+
+    struct dedup_state *dd = &t->dedup;
+    if (dd->wanted)
+    {
+        fclose(dd->wanted);
+        dd->wanted = NULL;
+    }
+    dd->next_seq = 1;
+    dd->file_offset = 0;
+    dd->last_reply_len = 0;
+    dd->chunks = dd->reused = dd->reused_bytes = 0;
+}
+
+static int write_fragment(struct xfer_sink *sink, uint64_t offset, uint64_t size, const uint8_t *data, bool zero)
+{
+    if (zero)
+    {
+        return sink_zero(sink, offset, size);
+    }
+    return size > 0 ? sink_write(sink, offset, data, size) : 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void gap_insert(struct nack_state *ns, size_t at, uint64_t start, uint64_t end)
+{
+    if (ns->count == ns->capacity)
+    {
+        ns->capacity = ns->capacity ? ns->capacity * 2 : 64;
+        ns->gaps = realloc(ns->gaps, ns->capacity * sizeof(struct gap));
+        if (!ns->gaps)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memmove(&ns->gaps[at + 1], &ns->gaps[at], (ns->count - at) * sizeof(struct gap));
+    ns->gaps[at].start = start;
+    ns->gaps[at].end = end;
+    ns->gaps[at].last_nack = 0;
+    ns->gaps[at].nacks = 0;
+    ns->count++;
+}
+
+// Record an arriving fragment. Returns false for duplicates.
+bool nack_on_fragment(struct nack_state *ns, uint64_t frag_no, double now)
+{
+    ns->last_arrival = now;
+    if (frag_no == 0 || frag_no > ns->total)
+    {
+        return false;
+    }
+
+    if (frag_no > ns->highest)
+    {
+        // Anything skipped over is a new gap, reported on the next nack_send
+        if (frag_no > ns->highest + 1)
+        {
+            gap_insert(ns, ns->count, ns->highest + 1, frag_no);
+        }
+        ns->highest = frag_no;
+        return true;
+    }
+
+    // A repair: find the gap holding frag_no (last gap starting at or before it)
+    size_t lo = 0, hi = ns->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (ns->gaps[mid].start <= frag_no)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    if (lo == 0 || ns->gaps[lo - 1].end <= frag_no)
+    {
+        return false;
+    }
+    struct gap *g = &ns->gaps[lo - 1];
+
+    // First repair after a single NACK measures the loop's round trip
+    if (g->nacks == 1)
+    {
+        double sample = now - g->last_nack;
+        ns->srtt = ns->srtt > 0 ? 0.875 * ns->srtt + 0.125 * sample : sample;
+    }
+
+    if (g->end - g->start == 1)
+    {
+        memmove(g, g + 1, (ns->count - lo) * sizeof(struct gap));
+        ns->count--;
+    }
+    else if (frag_no == g->start)
+    {
+        g->start++;
+    }
+    else if (frag_no == g->end - 1)
+    {
+        g->end--;
+    }
+    else
+    {
+        uint64_t end = g->end;
+        g->end = frag_no;
+        gap_insert(ns, lo, frag_no + 1, end);
+        ns->gaps[lo].last_nack = ns->gaps[lo - 1].last_nack;
+        ns->gaps[lo].nacks = ns->gaps[lo - 1].nacks;
+    }
+    return true;
+}
+
+bool nack_complete(const struct nack_state *ns)
+{
+    return ns->highest == ns->total && ns->count == 0;
+}
+
+// Report every gap that is new or whose last NACK should have been repaired
+// by now, plus the tail if the stream stopped short of the last fragment
+int nack_send(struct nack_state *ns, int sockfd, struct sockaddr *addr, socklen_t addr_len,
+              double now, struct xfer_stats *stats)
+{
+    double interval = 2 * ns->srtt > NACK_MIN_INTERVAL ? 2 * ns->srtt : NACK_MIN_INTERVAL;
+    struct nack_range ranges[NACK_MAX_RANGES];
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < ns->count && count < NACK_MAX_RANGES; i++)
+    {
+        struct gap *g = &ns->gaps[i];
+        if (g->last_nack == 0 || now - g->last_nack >= interval)
+        {
+            ranges[count].start = g->start;
+            ranges[count].length = g->end - g->start;
+            count++;
+            g->last_nack = now;
+            g->nacks++;
+        }
+    }
+    if (count < NACK_MAX_RANGES && ns->highest < ns->total &&
+        now - ns->last_arrival >= interval && now - ns->tail_nacked >= interval)
+    {
+        ranges[count].start = ns->highest + 1;
+        ranges[count].length = ns->total - ns->highest;
+        count++;
+        ns->tail_nacked = now;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint8_t packet[PACKET_BUFFER_SIZE];
+    int len = encode_nack(ranges, count, packet, sizeof(packet));
+    if (len < 0 || sendto(sockfd, packet, len, 0, addr, addr_len) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    stats->nacks_sent++;
+    TRACE(TR_NACK, ranges[0].start, count);
+    return 0;
+}
+
+void ack_configure(struct ack_state *as, const struct xfer_params *agreed)
+{
+    as->every = agreed->ack_every;
+    as->delay = agreed->ack_delay_us / 1e6;
+}
+
+// Everything up to the first hole, then what arrived beyond it
+int sack_send(struct ack_state *as, const struct nack_state *ns, uint32_t window, int sockfd, struct sockaddr *addr,
+              socklen_t addr_len, struct xfer_stats *stats)
+{
+    struct nack_range ranges[SACK_MAX_RANGES];
+    uint32_t count = 0;
+    uint64_t cumulative = ns->count ? ns->gaps[0].start - 1 : ns->highest;
+    for (size_t i = 0; i < ns->count && count < SACK_MAX_RANGES; i++)
+    {
+        uint64_t end = i + 1 < ns->count ? ns->gaps[i + 1].start : ns->highest + 1;
+        ranges[count].start = ns->gaps[i].end;
+        ranges[count].length = end - ns->gaps[i].end;
+        count++;
+    }
+
+    uint8_t packet[PACKET_BUFFER_SIZE];
+    int len = encode_sack(cumulative, ranges, count, window, packet, sizeof(packet));
+    if (len < 0 || sendto(sockfd, packet, len, 0, addr, addr_len) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    as->pending = 0;
+    stats->acks_sent++;
+    TRACE(TR_SEND_ACK, cumulative, count);
+    return 0;
+}
+
+// Look every offered chunk up in the store. Chunks we already have are copied
+// straight into the output; the rest are reported back as wanted and the
+// sender transmits only those byte ranges.
+int handle_offer(int sockfd, const uint8_t *buffer, size_t len, struct sockaddr *addr, socklen_t addr_len,
+                 struct dedup_state *dd, struct xfer_sink **output, const char *sinkSpec)
+{
+    struct chunk_offer offer;
+    if (decode_offer(buffer, len, &offer) < 0)
+    {
+        fprintf(stderr, "Error parsing offer (%zu bytes)\n", len);
+        return 0;
+    }
+
+    if (offer.seq + 1 == dd->next_seq && dd->last_reply_len > 0)
+    {
+        // Our reply got lost, answer the retransmitted offer the same way again
+        sendto(sockfd, dd->last_reply, dd->last_reply_len, 0, addr, addr_len);
+        return 0;
+    }
+    if (offer.seq != dd->next_seq)
+    {
+        return 0;
+    }
+
+    if (!*output)
+    {
+        *output = sink_open(sinkSpec);
+        if (!*output)
+        {
+            return -1;
+        }
+    }
+    if (dd->store && !dd->wanted && !(dd->wanted = tmpfile()))
+    {
+        perror("tmpfile");
+        return -1;
+    }
+
+    uint8_t bitmap[(OFFER_MAX_CHUNKS + 7) / 8] = {0};
+    for (uint32_t i = 0; i < offer.count; i++)
+    {
+        if (dd->store && chunkstore_copy_to(dd->store, offer.hash[i], sink_fd(*output), dd->file_offset) >= 0)
+        {
+            dd->reused++;
+            dd->reused_bytes += offer.length[i];
+        }
+        else
+        {
+            bitmap[i / 8] |= 1u << (i % 8);
+            if (dd->store)
+            {
+                struct wanted_chunk w;
+                w.offset = dd->file_offset;
+                w.length = offer.length[i];
+                memcpy(w.hash, offer.hash[i], CHUNK_HASH_LEN);
+                fwrite(&w, sizeof(w), 1, dd->wanted);
+            }
+        }
+        dd->file_offset += offer.length[i];
+        dd->chunks++;
+    }
+
+    dd->last_reply_len = encode_want(offer.seq, bitmap, offer.count, dd->last_reply, sizeof(dd->last_reply));
+    if (sendto(sockfd, dd->last_reply, dd->last_reply_len, 0, addr, addr_len) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    TRACE(TR_WANT, offer.seq, offer.count);
+    dd->next_seq++;
+
+    if (offer.flags & OFFER_FLAG_LAST)
+    {
+        printf("Dedup: %" PRIu64 " chunks offered, %" PRIu64 " (%" PRIu64 " bytes) reused from the store\n",
+               dd->chunks, dd->reused, dd->reused_bytes);
+    }
+    return 0;
+}
+
+// Once the transfer is complete, read the chunks that came over the wire back
+// from the output file and add them to the store for future transfers
+int dedup_ingest(struct dedup_state *dd, struct xfer_sink *output)
+{
+    if (!dd->store || !dd->wanted)
+    {
+        return 0;
+    }
+    rewind(dd->wanted);
+
+    static uint8_t data[CHUNK_MAX_SIZE];
+    struct wanted_chunk w;
+    uint64_t stored = 0;
+    int rc = 0;
+    while (fread(&w, sizeof(w), 1, dd->wanted) == 1)
+    {
+        if (w.length > sizeof(data) ||
+            pread(sink_fd(output), data, w.length, (off_t)w.offset) != (ssize_t)w.length ||
+            chunkstore_put(dd->store, w.hash, data, w.length) != 0)
+        {
+            fprintf(stderr, "Chunk at offset %" PRIu64 " could not be stored\n", w.offset);
+            rc = -1;
+            continue;
+        }
+        stored++;
+    }
+    printf("Dedup: stored %" PRIu64 " new chunks\n", stored);
+    return rc;
+}
+int verify_configure(struct verify_state *vs, const struct xfer_params *agreed)
+{
+    if (vs->active && vs->tree.size == agreed->tree_size && vs->tree.block == agreed->tree_block &&
+        memcmp(vs->root, agreed->tree_root, TREE_HASH_LEN) == 0)
+    {
+        return 0; // a repeated SETUP for the transfer under way
+    }
+    verify_reset(vs);
+    if (!(agreed->features & FEAT_MERKLE))
+    {
+        return 0;
+    }
+    if (merkle_init(&vs->tree, agreed->tree_size, agreed->tree_block) != 0)
+    {
+        return -1;
+    }
+    vs->filled = calloc(merkle_blocks(&vs->tree), sizeof(uint64_t));
+    vs->block = malloc(agreed->tree_block);
+    if (!vs->filled || !vs->block)
+    {
+        verify_reset(vs);
+        return -1;
+    }
+    memcpy(vs->root, agreed->tree_root, TREE_HASH_LEN);
+    vs->remaining = merkle_blocks(&vs->tree);
+    vs->active = true;
+    return 0;
+}
+
+void verify_reset(struct verify_state *vs)
+{
+    merkle_free(&vs->tree);
+    free(vs->filled);
+    free(vs->block);
+    free(vs->ask);
+    for (size_t i = 0; i < vs->bad_count; i++)
+    {
+        free(vs->bad[i].have);
+    }
+    free(vs->bad);
+    memset(vs, 0, sizeof(*vs));
+}
+
+static void node_push(struct tree_node **list, size_t *count, size_t *capacity, const struct tree_node *node)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *list = realloc(*list, *capacity * sizeof(struct tree_node));
+        if (!*list)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list)[(*count)++] = *node;
+}
+
+static uint64_t block_bytes(const struct verify_state *vs, uint64_t b)
+{
+    uint64_t start = b * vs->tree.block;
+    return vs->tree.size - start < vs->tree.block ? vs->tree.size - start : vs->tree.block;
+}
+
+static int sink_reader(void *ctx, uint64_t offset, void *buf, size_t len)
+{
+    return sink_read(ctx, offset, buf, len);
+}
+
+// The sender's node differs from ours: a block to fetch again, or children to ask about
+static void verify_compare(struct verify_state *vs, const struct tree_node *theirs)
+{
+    if (memcmp(merkle_node(&vs->tree, theirs->level, theirs->index), theirs->hash, TREE_HASH_LEN) == 0)
+    {
+        return;
+    }
+    if (theirs->level == 0)
+    {
+        if (vs->bad_count == vs->bad_capacity)
+        {
+            vs->bad_capacity = vs->bad_capacity ? vs->bad_capacity * 2 : 16;
+            vs->bad = realloc(vs->bad, vs->bad_capacity * sizeof(struct bad_block));
+        }
+        uint8_t *have = calloc(vs->tree.block / 8 + 1, 1);
+        if (!vs->bad || !have)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        vs->bad[vs->bad_count].theirs = *theirs;
+        vs->bad[vs->bad_count].have = have;
+        vs->filled[theirs->index] = 0;
+        vs->bad_count++;
+        return;
+    }
+    struct tree_node child = {.level = theirs->level - 1, .index = 2 * theirs->index};
+    node_push(&vs->ask, &vs->ask_count, &vs->ask_capacity, &child);
+    if (child.index + 1 < vs->tree.width[child.level])
+    {
+        child.index++;
+        node_push(&vs->ask, &vs->ask_count, &vs->ask_capacity, &child);
+    }
+}
+
+static int by_index(const void *a, const void *b)
+{
+    const struct bad_block *x = a, *y = b;
+    return x->theirs.index < y->theirs.index ? -1 : x->theirs.index > y->theirs.index;
+}
+
+// Asks again for the damaged blocks, as many as one REPAIR holds; the rest
+// follow once those are fixed or the next retry comes around. What already
+// arrived of them is kept, so each retry only has to fill in what was lost.
+static int repair_send(struct verify_state *vs, int sockfd, struct sockaddr *addr, socklen_t addr_len, double now)
+{
+    qsort(vs->bad, vs->bad_count, sizeof(struct bad_block), by_index);
+    struct nack_range ranges[REPAIR_MAX_RANGES];
+    uint32_t count = 0;
+    for (size_t i = 0; i < vs->bad_count; i++)
+    {
+        uint64_t b = vs->bad[i].theirs.index;
+        if (count > 0 && ranges[count - 1].start + ranges[count - 1].length == b)
+        {
+            ranges[count - 1].length++;
+        }
+        else if (count < REPAIR_MAX_RANGES)
+        {
+            ranges[count].start = b;
+            ranges[count].length = 1;
+            count++;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    uint8_t packet[PACKET_BUFFER_SIZE];
+    int len = encode_repair(ranges, count, packet, sizeof(packet));
+    if (len < 0 || sendto(sockfd, packet, len, 0, addr, addr_len) < 0)
+    {
+        perror("sendto");
+        return -1;
+    }
+    vs->last_request = now;
+    return 0;
+}
+
+// Next step of the walk down the sender's tree: ask about the next nodes, or
+// once they are all answered, repair the blocks it led to
+static int verify_next(struct verify_state *vs, int sockfd, struct sockaddr *addr, socklen_t addr_len, double now)
+{
+    vs->ticking = true; // requests and answers can get lost, so look again every tick
+
+    if (vs->ask_count > 0)
+    {
+        uint32_t count = vs->ask_count < TREE_MAX_NODES ? (uint32_t)vs->ask_count : TREE_MAX_NODES;
+        uint8_t packet[PACKET_BUFFER_SIZE];
+        int len = encode_tree(PKT_TREE_REQ, vs->ask, count, packet, sizeof(packet));
+        if (len < 0 || sendto(sockfd, packet, len, 0, addr, addr_len) < 0)
+        {
+            perror("sendto");
+            return -1;
+        }
+        vs->last_request = now;
+        return 0;
+    }
+    if (vs->bad_count == 0)
+    {
+        fprintf(stderr, "The sender's tree doesn't add up to its root, can't repair the file.\n");
+        return -1;
+    }
+    printf("%zu damaged block(s), asking for them again\n", vs->bad_count);
+    vs->phase = VERIFY_REPAIR;
+    return repair_send(vs, sockfd, addr, addr_len, now);
+}
+
+// Writes what the blocks still need and hashes every block it completes.
+// While blocks are filling that is each new fragment; later only the parts
+// of damaged blocks, so a late duplicate can't undo a block that checked out.
+int verify_on_data(struct verify_state *vs, struct xfer_sink *sink, uint64_t offset, uint64_t size,
+                   const uint8_t *data, bool zero, bool fresh, double now)
+{
+    if (vs->phase == VERIFY_DATA && fresh && write_fragment(sink, offset, size, data, zero) != 0)
+    {
+        return -1;
+    }
+    if (size == 0 || offset >= vs->tree.size || !(vs->phase == VERIFY_REPAIR || (vs->phase == VERIFY_DATA && fresh)))
+    {
+        return 0;
+    }
+    uint64_t end = offset + size < vs->tree.size ? offset + size : vs->tree.size;
+    for (uint64_t b = offset / vs->tree.block; b <= (end - 1) / vs->tree.block; b++)
+    {
+        size_t bad = vs->bad_count;
+        for (size_t i = 0; vs->phase == VERIFY_REPAIR && i < vs->bad_count; i++)
+        {
+            bad = vs->bad[i].theirs.index == b ? i : bad;
+        }
+        if (vs->phase == VERIFY_REPAIR && bad == vs->bad_count)
+        {
+            continue;
+        }
+
+        uint64_t start = b * vs->tree.block;
+        uint64_t length = block_bytes(vs, b);
+        if (vs->filled[b] >= length)
+        {
+            continue;
+        }
+        uint64_t from = offset > start ? offset : start;
+        uint64_t to = end < start + length ? end : start + length;
+        if (vs->phase == VERIFY_DATA)
+        {
+            vs->filled[b] += to - from;
+        }
+        else if (write_fragment(sink, from, to - from, data + (from - offset), zero) != 0)
+        {
+            return -1;
+        }
+        for (uint64_t i = from - start; vs->phase == VERIFY_REPAIR && i < to - start; i++)
+        {
+            uint8_t *have = vs->bad[bad].have;
+            if (!(have[i / 8] & (1 << (i % 8))))
+            {
+                have[i / 8] |= 1 << (i % 8);
+                vs->filled[b]++;
+                vs->last_request = now; // repairs are arriving, no need to ask again yet
+            }
+        }
+        if (vs->filled[b] < length)
+        {
+            continue;
+        }
+
+        // Complete: one zero run covering all of it needs no reading back
+        if (zero && from == start && to == start + length)
+        {
+            merkle_zero_block(&vs->tree, b);
+        }
+        else if (merkle_hash_block(&vs->tree, b, sink_reader, sink, vs->block) != 0)
+        {
+            return -1;
+        }
+        if (vs->phase == VERIFY_DATA)
+        {
+            vs->remaining--;
+        }
+        else if (memcmp(merkle_node(&vs->tree, 0, b), vs->bad[bad].theirs.hash, TREE_HASH_LEN) == 0)
+        {
+            free(vs->bad[bad].have);
+            vs->bad[bad] = vs->bad[--vs->bad_count];
+        }
+        else
+        {
+            // Still wrong, the next REPAIR asks for all of it again
+            vs->filled[b] = 0;
+            memset(vs->bad[bad].have, 0, vs->tree.block / 8 + 1);
+        }
+    }
+    return 0;
+}
+
+int verify_on_tree(struct verify_state *vs, const uint8_t *buffer, size_t len, int sockfd, struct sockaddr *addr,
+                   socklen_t addr_len, double now)
+{
+    struct tree_node nodes[TREE_MAX_NODES];
+    uint32_t count;
+    if (!vs->active || vs->phase != VERIFY_DESCEND || decode_tree(buffer, len, PKT_TREE, nodes, &count) < 0)
+    {
+        return 0;
+    }
+    bool answered = false;
+    for (uint32_t n = 0; n < count; n++)
+    {
+        // Only what was asked for; a late copy of an earlier answer is already dealt with
+        for (size_t i = 0; i < vs->ask_count; i++)
+        {
+            if (vs->ask[i].level == nodes[n].level && vs->ask[i].index == nodes[n].index)
+            {
+                vs->ask[i] = vs->ask[--vs->ask_count];
+                verify_compare(vs, &nodes[n]);
+                answered = true;
+                break;
+            }
+        }
+    }
+    return answered ? verify_next(vs, sockfd, addr, addr_len, now) : 0;
+}
+
+// Called once every fragment is in: 1 if the file matches the sender's
+// root (or isn't being checked), 0 while it is being repaired, -1 if it
+// can't be
+int verify_finish(struct verify_state *vs, struct xfer_sink *sink, int sockfd, struct sockaddr *addr,
+                  socklen_t addr_len, double now)
+{
+    if (!vs->active || vs->phase == VERIFY_DONE)
+    {
+        return 1;
+    }
+    if (vs->phase == VERIFY_DESCEND || (vs->phase == VERIFY_REPAIR && vs->bad_count > 0))
+    {
+        return 0;
+    }
+    // A block the counts missed (a SETUP repeated mid-transfer, an empty
+    // file) is hashed now
+    for (uint64_t b = 0; vs->phase == VERIFY_DATA && vs->remaining > 0 && b < merkle_blocks(&vs->tree); b++)
+    {
+        if (vs->filled[b] < block_bytes(vs, b) || vs->tree.size == 0)
+        {
+            if (merkle_hash_block(&vs->tree, b, sink_reader, sink, vs->block) != 0)
+            {
+                fprintf(stderr, "Error reading back file data.\n");
+                return -1;
+            }
+            vs->filled[b] = block_bytes(vs, b);
+        }
+    }
+
+    merkle_update(&vs->tree);
+    if (memcmp(merkle_root(&vs->tree), vs->root, TREE_HASH_LEN) == 0)
+    {
+        printf("Verified %" PRIu64 " block(s) against the sender's Merkle root\n", merkle_blocks(&vs->tree));
+        vs->phase = VERIFY_DONE;
+        return 1;
+    }
+    if (++vs->rounds > VERIFY_ROUNDS)
+    {
+        fprintf(stderr, "The file still doesn't match after %u repairs, giving up.\n", VERIFY_ROUNDS);
+        return -1;
+    }
+
+    printf("File doesn't match the sender's Merkle root, looking for the damaged blocks\n");
+    struct tree_node root = {.level = vs->tree.levels - 1, .index = 0};
+    memcpy(root.hash, vs->root, TREE_HASH_LEN);
+    for (size_t i = 0; i < vs->bad_count; i++)
+    {
+        free(vs->bad[i].have);
+    }
+    vs->ask_count = vs->bad_count = 0;
+    vs->phase = VERIFY_DESCEND;
+    verify_compare(vs, &root);
+    return verify_next(vs, sockfd, addr, addr_len, now);
+}
+
+// On every quiet tick after the data: repeat the last request if it has gone unanswered
+int verify_retry(struct verify_state *vs, int sockfd, struct sockaddr *addr, socklen_t addr_len, double now)
+{
+    if (now - vs->last_request < VERIFY_RETRY)
+    {
+        return 0;
+    }
+    if (vs->phase == VERIFY_DESCEND)
+    {
+        return verify_next(vs, sockfd, addr, addr_len, now);
+    }
+    if (vs->phase == VERIFY_REPAIR && vs->bad_count > 0)
+    {
+        return repair_send(vs, sockfd, addr, addr_len, now);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,52 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+// Same-host payload transport over a POSIX shared memory ring.
+//
+// Two processes on one kernel (the same boot id) can keep the bulk of a
+// transfer out of the loopback stack: the sender puts each fragment's
+// payload into a slot of the ring and sends only its DATA header, flagged
+// FRAG_FLAG_SHM, over the socket. Everything else stays on the socket.
+//
+// Fragment frag_no lives in slot frag_no % slots. A slot is stamped with
+// frag_no + 1 once it is written, and with 0 while it is being written (or
+// before it ever was), so a reader that sees the same stamp before and
+// after copying has a consistent fragment. One whose slot has been taken over by a later
+// fragment by the time its header is read counts as lost.
+
+struct shm_ring
+{
+    uint8_t *base; // NULL = not open
+    size_t size;
+    int fd;             // writer only, -1 otherwise
+    uint64_t id;        // names the ring, see shm_ring_unlink()
+    uint32_t slots;
+    uint32_t slot_size; // payload bytes a slot holds
+    uint8_t *scratch;   // reader: the last slot copied out
+};
+
+// This machine's boot id; -1 if it can't be read
+int shm_host_id(uint8_t id[HOST_ID_LEN]);
+// Writer: a new ring under a fresh id; -1 if there is no shared memory to be had
+int shm_ring_create(struct shm_ring *r, uint32_t slots, uint32_t slot_size);
+// Reader: the ring the writer created, read only
+int shm_ring_attach(struct shm_ring *r, uint64_t id);
+// Writer: takes the ring's memory up front, so a full /dev/shm shows up
+// here rather than as SIGBUS in the middle of the transfer
+int shm_ring_reserve(struct shm_ring *r);
+// Removes the name once the reader is attached; both keep their mapping
+void shm_ring_unlink(struct shm_ring *r);
+void shm_ring_close(struct shm_ring *r);
+
+// Writer: the slot for frag_no, to be filled and then handed over with shm_slot_end()
+uint8_t *shm_slot_begin(struct shm_ring *r, uint64_t frag_no);
+void shm_slot_end(struct shm_ring *r, uint64_t frag_no);
+// Reader: a copy of the first len bytes of frag_no's slot, NULL if the slot
+// holds another fragment by now or len doesn't fit it
+uint8_t *shm_slot_read(struct shm_ring *r, uint64_t frag_no, size_t len);
+
+#endif
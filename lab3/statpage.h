@@ -0,0 +1,65 @@
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Live progress of a running deliver or server, for ./xferstat.
+//
+// Every process maps one page of POSIX shared memory, /lab3-stats-<pid>
+// (/dev/shm/lab3-stats-<pid> on Linux), and the stats_on_*() calls it
+// makes anyway copy the interesting counters into it with relaxed atomic
+// stores: a plain store on x86, no fences, no syscalls. Each field is
+// consistent on its own but the page as a whole is not a snapshot. Rates
+// are left to the reader, which samples bytes_done twice; the writer never
+// reads the clock for the page.
+//
+// The page is removed when the process exits normally.
+
+#define STATPAGE_MAGIC "XFSTAT01"
+#define STATPAGE_PREFIX "/lab3-stats-"
+#define STATPAGE_NAME_MAX 128
+
+// X(name, label)
+#define XFER_STATES(X)          \
+    X(XS_IDLE, "idle")          \
+    X(XS_SETUP, "setup")        \
+    X(XS_OFFER, "offer")        \
+    X(XS_DATA, "data")          \
+    X(XS_DONE, "done")
+
+#define XFER_STATE_ENUM(name, label) name,
+enum xfer_state
+{
+    XFER_STATES(XFER_STATE_ENUM)
+        XS_COUNT
+};
+#undef XFER_STATE_ENUM
+
+struct stat_page
+{
+    // Fixed once the page is published
+    char magic[8];
+    uint32_t size; // sizeof(struct stat_page), the reader checks it
+    int32_t pid;
+    char role[16];        // "sender" or "receiver"
+    uint64_t started_ns;  // CLOCK_MONOTONIC, the same clock in every process
+
+    // Set before state first moves to XS_DATA (release), read after it (acquire)
+    char name[STATPAGE_NAME_MAX];
+    _Atomic uint64_t bytes_total; // payload to move, 0 = not known (receiver)
+    _Atomic uint64_t frags_total;
+
+    _Atomic uint32_t state; // enum xfer_state
+    _Atomic uint32_t cwnd;
+    _Atomic uint64_t bytes_done; // acknowledged (sender) or received (receiver) payload
+    _Atomic uint64_t bytes_on_wire;
+    _Atomic uint64_t frags_sent;
+    _Atomic uint64_t frags_retransmitted;
+    _Atomic uint64_t frags_received;
+    _Atomic uint64_t timeouts;
+    _Atomic uint32_t srtt_us;
+    _Atomic uint32_t rto_us;
+};
+
+#endif
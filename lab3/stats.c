@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+// Mirror a counter into the stat page, if there is one
+#define PAGE_SET(st, field, value)                                                       \
+    do                                                                                   \
+    {                                                                                    \
+        if ((st)->page)                                                                  \
+        {                                                                                \
+            atomic_store_explicit(&(st)->page->field, (value), memory_order_relaxed);    \
+        }                                                                                \
+    } while (0)
+
+volatile sig_atomic_t stats_dump_requested = 0;
+
+// One page per process, whatever number of transfers it runs
+static struct stat_page *page_mapped;
+static char page_name[32];
+
+static void on_sigusr1(int sig)
+{
+    (void)sig;
+    stats_dump_requested = 1;
+}
+
+// No SA_RESTART: a blocking recvfrom returns EINTR so the loop notices the request
+void stats_install_sigusr1(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void stats_unpublish(void)
+{
+    shm_unlink(page_name);
+}
+
+int stats_publish(struct xfer_stats *st, const char *role)
+{
+    if (!page_mapped)
+    {
+        snprintf(page_name, sizeof(page_name), STATPAGE_PREFIX "%d", (int)getpid());
+        int fd = shm_open(page_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror("shm_open");
+            return -1;
+        }
+        void *p = MAP_FAILED;
+        if (ftruncate(fd, sizeof(struct stat_page)) == 0)
+        {
+            p = mmap(NULL, sizeof(struct stat_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            perror("stat page");
+            shm_unlink(page_name);
+            return -1;
+        }
+        page_mapped = p;
+        atexit(stats_unpublish);
+    }
+
+    struct stat_page *page = page_mapped;
+    memset(page, 0, sizeof(*page));
+    page->size = sizeof(*page);
+    page->pid = (int32_t)getpid();
+    snprintf(page->role, sizeof(page->role), "%s", role);
+    page->started_ns = (uint64_t)st->start.tv_sec * 1000000000ULL + (uint64_t)st->start.tv_nsec;
+    atomic_thread_fence(memory_order_release);
+    memcpy(page->magic, STATPAGE_MAGIC, sizeof(page->magic));
+    st->page = page;
+    return 0;
+}
+
+static uint64_t elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+void stats_init(struct xfer_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->rtt_us.min = UINT64_MAX;
+    st->series_interval_ms = 10;
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+}
+
+static unsigned hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return (unsigned)value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (unsigned)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+static uint64_t hist_lower_bound(unsigned index)
+{
+    if (index < HIST_SUB_BUCKETS)
+    {
+        return index;
+    }
+    unsigned shift = index / HIST_SUB_BUCKETS - 1;
+    return (uint64_t)(HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << shift;
+}
+
+void hist_record(struct histogram *h, uint64_t value)
+{
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+    {
+        h->min = value;
+    }
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+uint64_t hist_quantile(const struct histogram *h, double q)
+{
+    if (h->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (h->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t v = hist_lower_bound(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void stats_on_start(struct xfer_stats *st, const char *name, uint64_t bytes_total, uint64_t frags_total)
+{
+    if (!st->page)
+    {
+        return;
+    }
+    snprintf(st->page->name, sizeof(st->page->name), "%s", name);
+    PAGE_SET(st, bytes_total, bytes_total);
+    PAGE_SET(st, frags_total, frags_total);
+    stats_on_state(st, XS_DATA);
+}
+
+void stats_on_state(struct xfer_stats *st, enum xfer_state state)
+{
+    if (st->page)
+    {
+        atomic_store_explicit(&st->page->state, (uint32_t)state, memory_order_release);
+    }
+}
+
+void stats_on_send(struct xfer_stats *st, size_t datagram_len, int retransmit)
+{
+    if (retransmit)
+    {
+        st->frags_retransmitted++;
+        PAGE_SET(st, frags_retransmitted, st->frags_retransmitted);
+    }
+    else
+    {
+        st->frags_sent++;
+        PAGE_SET(st, frags_sent, st->frags_sent);
+    }
+    st->bytes_on_wire += datagram_len + 28; // IPv4 + UDP headers
+    PAGE_SET(st, bytes_on_wire, st->bytes_on_wire);
+}
+
+void stats_on_receive(struct xfer_stats *st, uint64_t payload_bytes)
+{
+    st->frags_received++;
+    st->payload_bytes_received += payload_bytes;
+    PAGE_SET(st, frags_received, st->frags_received);
+    PAGE_SET(st, bytes_done, st->payload_bytes_received);
+}
+
+void stats_on_timeout(struct xfer_stats *st)
+{
+    st->timeouts++;
+    PAGE_SET(st, timeouts, st->timeouts);
+}
+
+void stats_on_ack(struct xfer_stats *st, uint64_t rtt_us, int rtt_valid)
+{
+    st->acks_received++;
+    if (rtt_valid)
+    {
+        hist_record(&st->rtt_us, rtt_us);
+    }
+}
+
+void stats_on_frag_done(struct xfer_stats *st, uint64_t payload_bytes, unsigned transmissions)
+{
+    st->payload_bytes_acked += payload_bytes;
+    PAGE_SET(st, bytes_done, st->payload_bytes_acked);
+    st->transmissions[transmissions < XMIT_BUCKETS ? transmissions : XMIT_BUCKETS - 1]++;
+}
+
+void stats_on_window(struct xfer_stats *st, uint32_t cwnd, double srtt, double rto)
+{
+    PAGE_SET(st, cwnd, cwnd);
+    PAGE_SET(st, srtt_us, (uint32_t)(srtt * 1e6));
+    PAGE_SET(st, rto_us, (uint32_t)(rto * 1e6));
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint32_t t_ms = (uint32_t)(elapsed_us(&st->start, &now) / 1000);
+    if (st->series_len > 0 && t_ms < st->series_next_ms)
+    {
+        return;
+    }
+
+    if (st->series_len == SERIES_MAX)
+    {
+        // Keep every other sample and halve the sampling rate
+        for (uint32_t i = 0; i < SERIES_MAX / 2; i++)
+        {
+            st->series[i] = st->series[2 * i];
+        }
+        st->series_len = SERIES_MAX / 2;
+        st->series_interval_ms *= 2;
+    }
+
+    struct series_sample *s = &st->series[st->series_len++];
+    s->t_ms = t_ms;
+    s->cwnd = cwnd;
+    s->srtt_us = (uint32_t)(srtt * 1e6);
+    s->rto_us = (uint32_t)(rto * 1e6);
+    st->series_next_ms = t_ms + st->series_interval_ms;
+}
+
+void stats_finish(struct xfer_stats *st)
+{
+    clock_gettime(CLOCK_MONOTONIC, &st->end);
+    // A streaming sender only works out what was delivered at the end
+    PAGE_SET(st, bytes_done, st->payload_bytes_acked ? st->payload_bytes_acked : st->payload_bytes_received);
+    stats_on_state(st, XS_DONE);
+}
+
+static void write_histogram(const struct histogram *h, FILE *out)
+{
+    fprintf(out, "{\"count\": %llu", (unsigned long long)h->count);
+    if (h->count > 0)
+    {
+        fprintf(out, ", \"min\": %llu, \"max\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu",
+                (unsigned long long)h->min, (unsigned long long)h->max,
+                (unsigned long long)(h->sum / h->count),
+                (unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9),
+                (unsigned long long)hist_quantile(h, 0.99), (unsigned long long)hist_quantile(h, 0.999));
+    }
+    // Only the non-empty buckets, as [lower bound, count] pairs
+    fprintf(out, ", \"buckets\": [");
+    const char *sep = "";
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (h->buckets[i])
+        {
+            fprintf(out, "%s[%llu, %llu]", sep, (unsigned long long)hist_lower_bound(i),
+                    (unsigned long long)h->buckets[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "]}");
+}
+
+void stats_write_json(const struct xfer_stats *st, const char *role, FILE *out)
+{
+    struct timespec now = st->end;
+    int done = now.tv_sec != 0 || now.tv_nsec != 0;
+    if (!done)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    uint64_t us = elapsed_us(&st->start, &now);
+    double secs = us / 1e6;
+    uint64_t payload = st->payload_bytes_acked ? st->payload_bytes_acked : st->payload_bytes_received;
+
+    fprintf(out, "{\n  \"role\": \"%s\",\n  \"complete\": %s,\n  \"elapsed_us\": %llu,\n",
+            role, done ? "true" : "false", (unsigned long long)us);
+    fprintf(out, "  \"goodput_bps\": %.0f,\n", secs > 0 ? payload * 8 / secs : 0.0);
+    fprintf(out, "  \"counters\": {\n"
+                 "    \"frags_sent\": %llu,\n    \"frags_retransmitted\": %llu,\n    \"timeouts\": %llu,\n"
+                 "    \"acks_received\": %llu,\n    \"stale_acks\": %llu,\n    \"rwnd_limited\": %llu,\n"
+                 "    \"payload_bytes_acked\": %llu,\n"
+                 "    \"bytes_on_wire\": %llu,\n    \"frags_received\": %llu,\n    \"frags_dropped\": %llu,\n"
+                 "    \"frags_corrupt\": %llu,\n    \"frags_shed\": %llu,\n    \"frags_stale\": %llu,\n"
+                 "    \"payload_bytes_received\": %llu,\n"
+                 "    \"acks_sent\": %llu,\n    \"nacks_received\": %llu,\n    \"nacks_sent\": %llu\n  },\n",
+            (unsigned long long)st->frags_sent, (unsigned long long)st->frags_retransmitted,
+            (unsigned long long)st->timeouts, (unsigned long long)st->acks_received,
+            (unsigned long long)st->stale_acks, (unsigned long long)st->rwnd_limited,
+            (unsigned long long)st->payload_bytes_acked,
+            (unsigned long long)st->bytes_on_wire, (unsigned long long)st->frags_received,
+            (unsigned long long)st->frags_dropped, (unsigned long long)st->frags_corrupt,
+            (unsigned long long)st->frags_shed, (unsigned long long)st->frags_stale,
+            (unsigned long long)st->payload_bytes_received,
+            (unsigned long long)st->acks_sent, (unsigned long long)st->nacks_received,
+            (unsigned long long)st->nacks_sent);
+
+    if (st->tuned_frag_size || st->tuned_window)
+    {
+        fprintf(out, "  \"tuned\": {\"frag_size\": %u, \"window\": %u, \"batch\": %u, \"sock_buf\": %u},\n",
+                st->tuned_frag_size, st->tuned_window, st->tuned_batch, st->tuned_sock_buf);
+    }
+    fprintf(out, "  \"rtt_us\": ");
+    write_histogram(&st->rtt_us, out);
+
+    fprintf(out, ",\n  \"transmissions_per_fragment\": [");
+    for (int i = 1; i < XMIT_BUCKETS; i++)
+    {
+        fprintf(out, "%s%llu", i > 1 ? ", " : "", (unsigned long long)st->transmissions[i]);
+    }
+
+    fprintf(out, "],\n  \"window_series\": [");
+    for (uint32_t i = 0; i < st->series_len; i++)
+    {
+        const struct series_sample *s = &st->series[i];
+        fprintf(out, "%s\n    {\"t_ms\": %u, \"cwnd\": %u, \"srtt_us\": %u, \"rto_us\": %u}",
+                i ? "," : "", s->t_ms, s->cwnd, s->srtt_us, s->rto_us);
+    }
+    fprintf(out, "%s]\n}\n", st->series_len ? "\n  " : "");
+}
+
+int stats_dump_json(const struct xfer_stats *st, const char *role, const char *path)
+{
+    if (!path || strcmp(path, "-") == 0)
+    {
+        stats_write_json(st, role, stderr);
+        return 0;
+    }
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        perror("fopen");
+        return -1;
+    }
+    stats_write_json(st, role, out);
+    return fclose(out);
+}
@@ -0,0 +1,118 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "statpage.h"
+
+// Per-transfer telemetry. Everything here is updated on the packet path, so
+// recording is a handful of integer ops (plus a vDSO clock read for the
+// window series): no allocation and no I/O. The JSON dump does the expensive
+// work (quantiles, formatting) and only runs at completion or when asked for
+// with SIGUSR1. The live counters are also mirrored into a shared memory
+// page for ./xferstat (see statpage.h).
+
+// Log-linear histogram: values are bucketed by power of two and each power
+// of two is split into HIST_SUB_BUCKETS linear steps, so relative error is
+// bounded (12.5%) over the whole 64-bit range
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Window/RTO samples over time. When the buffer fills up every other sample
+// is dropped and the sampling interval doubles, so a long transfer still
+// covers its whole duration in bounded memory.
+#define SERIES_MAX 512
+
+struct series_sample
+{
+    uint32_t t_ms; // since the start of the transfer
+    uint32_t cwnd; // fragments allowed in flight
+    uint32_t srtt_us;
+    uint32_t rto_us;
+};
+
+// Transmissions per fragment, 1 = never retransmitted; the last bucket
+// collects everything >= XMIT_BUCKETS
+#define XMIT_BUCKETS 16
+
+struct xfer_stats
+{
+    struct timespec start;
+    struct timespec end;
+
+    // sender
+    uint64_t frags_sent; // first transmissions
+    uint64_t frags_retransmitted;
+    uint64_t timeouts;
+    uint64_t acks_received;
+    uint64_t stale_acks;
+    uint64_t nacks_received;
+    uint64_t rwnd_limited; // times the receiver's window kept a fragment back
+    uint64_t payload_bytes_acked;
+    uint64_t bytes_on_wire; // every datagram sent, including IP/UDP headers
+    struct histogram rtt_us;
+    uint64_t transmissions[XMIT_BUCKETS];
+    // What the auto-tuner went with, 0 = it didn't get to it
+    uint32_t tuned_frag_size;
+    uint32_t tuned_window;
+    uint32_t tuned_batch;
+    uint32_t tuned_sock_buf;
+
+    // receiver
+    uint64_t frags_received;
+    uint64_t frags_dropped; // by the simulated loss
+    uint64_t frags_corrupt; // failed the CRC check
+    uint64_t frags_shed;    // its transfer's queue was full
+    uint64_t frags_stale;   // its shared memory slot had been reused
+    uint64_t payload_bytes_received;
+    uint64_t acks_sent;
+    uint64_t nacks_sent;
+
+    struct series_sample series[SERIES_MAX];
+    uint32_t series_len;
+    uint32_t series_interval_ms;
+    uint32_t series_next_ms;
+
+    struct stat_page *page; // NULL = not published
+};
+
+// Set from the SIGUSR1 handler, polled by the transfer loop
+extern volatile sig_atomic_t stats_dump_requested;
+
+void stats_init(struct xfer_stats *st);
+void stats_install_sigusr1(void);
+// Maps this process's stat page and attaches it to st; role is "sender" or
+// "receiver". Returns -1 (and the transfer goes on unpublished) on failure.
+int stats_publish(struct xfer_stats *st, const char *role);
+
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_quantile(const struct histogram *h, double q);
+
+// name, payload bytes and fragments the transfer is about; either total may be 0 = not known
+void stats_on_start(struct xfer_stats *st, const char *name, uint64_t bytes_total, uint64_t frags_total);
+void stats_on_state(struct xfer_stats *st, enum xfer_state state);
+void stats_on_send(struct xfer_stats *st, size_t datagram_len, int retransmit);
+void stats_on_receive(struct xfer_stats *st, uint64_t payload_bytes);
+void stats_on_timeout(struct xfer_stats *st);
+void stats_on_ack(struct xfer_stats *st, uint64_t rtt_us, int rtt_valid);
+void stats_on_frag_done(struct xfer_stats *st, uint64_t payload_bytes, unsigned transmissions);
+void stats_on_window(struct xfer_stats *st, uint32_t cwnd, double srtt, double rto);
+void stats_finish(struct xfer_stats *st);
+
+// Writes the JSON document to path ("-" for stderr); returns 0 on success
+int stats_dump_json(const struct xfer_stats *st, const char *role, const char *path);
+void stats_write_json(const struct xfer_stats *st, const char *role, FILE *out);
+
+#endif
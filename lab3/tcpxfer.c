@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include "tcpxfer.h"
+#include "protocol.h"
+#include "trace.h"
+
+#define TCP_CHUNK (1 << 20)      // bytes per sendfile()/splice() call
+#define TCP_HEADERS 52           // IPv4 + TCP with timestamps
+#define TCP_HEADER_MAX (1 + 2 * VARINT_MAX_LEN + MAX_FILENAME)
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// What the kernel knows about the connection, in the terms the UDP transfer uses
+static void stats_from_tcp_info(int sockfd, uint64_t bytes, struct xfer_stats *st)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    {
+        return;
+    }
+    uint32_t mss = info.tcpi_snd_mss ? info.tcpi_snd_mss : 1448;
+    uint64_t segments = (bytes + mss - 1) / mss;
+    st->frags_sent = segments;
+    st->frags_retransmitted = info.tcpi_total_retrans;
+    st->bytes_on_wire = bytes + (uint64_t)info.tcpi_total_retrans * mss +
+                        (segments + info.tcpi_total_retrans) * TCP_HEADERS;
+    st->payload_bytes_acked = bytes;
+    st->transmissions[1] = segments > info.tcpi_total_retrans ? segments - info.tcpi_total_retrans : 0;
+    st->transmissions[2] = info.tcpi_total_retrans;
+    hist_record(&st->rtt_us, info.tcpi_rtt);
+    stats_on_window(st, info.tcpi_snd_cwnd, info.tcpi_rtt / 1e6, info.tcpi_rto / 1e6);
+}
+
+// One sendfile() call's worth, or read from the source and written out if
+// there is no file behind it
+static ssize_t send_chunk(int sockfd, struct xfer_source *src, off_t *offset, size_t len)
+{
+    int fd = source_fd(src);
+    if (fd >= 0)
+    {
+        return sendfile(sockfd, fd, offset, len);
+    }
+
+    static uint8_t buf[TCP_CHUNK];
+    if (source_read(src, (uint64_t)*offset, buf, len) != 0 || write_full(sockfd, buf, len) != 0)
+    {
+        return -1;
+    }
+    *offset += (off_t)len;
+    return (ssize_t)len;
+}
+
+// Moves up to len bytes from the socket to the sink at offset, through the
+// pipe when the sink is a file; returns the bytes moved, 0 at end of stream
+static ssize_t receive_chunk(int conn, int pipefd[2], struct xfer_sink *sink, uint64_t offset, size_t len)
+{
+    int fd = sink_fd(sink);
+    if (fd < 0)
+    {
+        static uint8_t buf[TCP_CHUNK];
+        ssize_t in = read(conn, buf, len);
+        if (in > 0 && sink_write(sink, offset, buf, (size_t)in) != 0)
+        {
+            return -1;
+        }
+        return in;
+    }
+
+    ssize_t in = splice(conn, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    // Drain the pipe into the file before taking more from the socket
+    loff_t out_off = (loff_t)offset;
+    for (ssize_t left = in; left > 0;)
+    {
+        ssize_t out = splice(pipefd[0], NULL, fd, &out_off, (size_t)left, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (out <= 0)
+        {
+            perror("splice");
+            return -1;
+        }
+        left -= out;
+    }
+    return in;
+}
+
+int tcp_send_file(struct xfer_source *src, const char *name, const struct sockaddr_in *addr,
+                  struct xfer_stats *stats, const char *statsPath)
+{
+    uint64_t size = source_size(src);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (connect(sockfd, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+    {
+        perror("connect");
+        close(sockfd);
+        return -1;
+    }
+
+    uint8_t header[TCP_HEADER_MAX];
+    size_t name_len = strnlen(name, MAX_FILENAME - 1);
+    size_t pos = 1;
+    pos += varint_encode(name_len, header + pos);
+    memcpy(header + pos, name, name_len);
+    pos += name_len;
+    pos += varint_encode(size, header + pos);
+    header[0] = (uint8_t)(pos - 1);
+    if (write_full(sockfd, header, pos) != 0)
+    {
+        perror("write");
+        close(sockfd);
+        return -1;
+    }
+
+    stats_on_start(stats, name, size, 0);
+    off_t offset = 0;
+    uint64_t calls = 0;
+    while ((uint64_t)offset < size)
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            stats_dump_json(stats, "sender", statsPath);
+        }
+        uint64_t left = size - (uint64_t)offset;
+        ssize_t n = send_chunk(sockfd, src, &offset, left < TCP_CHUNK ? left : TCP_CHUNK);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                fprintf(stderr, "File shrank while sending it\n");
+            }
+            else
+            {
+                perror("send");
+            }
+            close(sockfd);
+            return -1;
+        }
+        TRACE(TR_SEND, ++calls, n);
+        // Handed to the kernel, not acknowledged, but close enough for
+        // xferstat; the real numbers come from TCP_INFO at the end
+        stats_on_frag_done(stats, (uint64_t)n, 1);
+    }
+
+    // Nothing more from us; wait for the receiver to say it has everything
+    shutdown(sockfd, SHUT_WR);
+    uint8_t done;
+    if (read_full(sockfd, &done, 1) != 0 || done != PKT_DONE)
+    {
+        fprintf(stderr, "Receiver closed the connection before confirming the file\n");
+        close(sockfd);
+        return -1;
+    }
+    TRACE(TR_DONE, size, 1);
+    stats_from_tcp_info(sockfd, size, stats);
+    close(sockfd);
+    return 0;
+}
+
+int tcp_receive_file(int listen_fd, struct xfer_sink *sink, char *name, size_t name_size,
+                     struct xfer_stats *stats, const char *statsPath)
+{
+    int conn;
+    while ((conn = accept(listen_fd, NULL, NULL)) < 0 && errno == EINTR)
+    {
+    }
+    if (conn < 0)
+    {
+        perror("accept");
+        return -1;
+    }
+
+    uint8_t header[TCP_HEADER_MAX];
+    uint64_t name_len, size;
+    size_t n;
+    if (read_full(conn, header, 1) != 0 || read_full(conn, header + 1, header[0]) != 0)
+    {
+        fprintf(stderr, "Connection closed before the header\n");
+        close(conn);
+        return -1;
+    }
+    size_t len = header[0];
+    const uint8_t *p = header + 1;
+    if ((n = varint_decode(p, len, &name_len)) == 0 || name_len > len - n || name_len >= MAX_FILENAME ||
+        varint_decode(p + n + name_len, len - n - name_len, &size) == 0)
+    {
+        fprintf(stderr, "Malformed header\n");
+        close(conn);
+        return -1;
+    }
+    snprintf(name, name_size, "%.*s", (int)name_len, (const char *)p + n);
+    stats_on_start(stats, name, size, 0);
+
+    // splice() needs a pipe on one side of every call
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+    {
+        perror("pipe");
+        close(conn);
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, TCP_CHUNK);
+
+    int status = 0;
+    uint64_t received = 0;
+    while (status == 0 && received < size)
+    {
+        if (stats_dump_requested)
+        {
+            stats_dump_requested = 0;
+            stats_dump_json(stats, "receiver", statsPath);
+        }
+        uint64_t left = size - received;
+        ssize_t in = receive_chunk(conn, pipefd, sink, received, left < TCP_CHUNK ? left : TCP_CHUNK);
+        if (in < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (in <= 0)
+        {
+            if (in == 0)
+            {
+                fprintf(stderr, "Connection closed after %llu of %llu bytes\n", (unsigned long long)received,
+                        (unsigned long long)size);
+            }
+            else
+            {
+                perror("receive");
+            }
+            status = -1;
+            break;
+        }
+        TRACE(TR_RECV, stats->frags_received + 1, in);
+        stats_on_receive(stats, (uint64_t)in);
+        received += (uint64_t)in;
+    }
+
+    if (status == 0)
+    {
+        uint8_t done = PKT_DONE;
+        if (write_full(conn, &done, 1) != 0)
+        {
+            perror("write");
+            status = -1;
+        }
+        TRACE(TR_DONE, size, 1);
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(conn);
+    return status;
+}
@@ -0,0 +1,36 @@
+#ifndef TCPXFER_H
+#define TCPXFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "stats.h"
+#include "xferio.h"
+
+// Plain TCP transfer, the baseline the UDP protocol is measured against.
+//
+// The kernel does all the work. The sender hands the file to the socket with
+// sendfile() and the receiver moves it from the socket into the output file
+// through a pipe with splice(), so file data never passes through user space
+// on either end. Sources and sinks that aren't files go through a buffer.
+//
+// The stream is a short header followed by the file:
+//   header length (1 byte) | name_len | name | file size      (varints)
+// Once everything is on disk the receiver answers with a single PKT_DONE
+// byte, so the sender's clock stops at the same point as in ACK mode: when
+// the receiver has the whole file.
+//
+// TCP keeps its segment counts to itself, so the sender's stats are filled
+// in from TCP_INFO at the end: segments are estimated from the MSS, the
+// retransmissions and the RTT are the kernel's own.
+
+// Returns 0 once the receiver has confirmed the whole file, -1 on error.
+// statsPath is where a SIGUSR1 dump goes, as for the UDP transfer.
+int tcp_send_file(struct xfer_source *src, const char *name, const struct sockaddr_in *addr,
+                  struct xfer_stats *stats, const char *statsPath);
+// Accepts one connection on listen_fd and writes the file it carries to sink;
+// name receives the sender's file name. Returns 0 on success.
+int tcp_receive_file(int listen_fd, struct xfer_sink *sink, char *name, size_t name_size,
+                     struct xfer_stats *stats, const char *statsPath);
+
+#endif
@@ -0,0 +1,140 @@
+#include "timerwheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+void wheel_init(struct timer_wheel *w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+        {
+            struct wheel_timer *head = &w->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+}
+
+// earliest is the first tick whose slot may still be fired: w->now while
+// cascading (that slot is about to be handled), w->now + 1 otherwise
+static void link_timer(struct timer_wheel *w, struct wheel_timer *timer, uint64_t earliest)
+{
+    uint64_t expires = timer->expires > earliest ? timer->expires : earliest;
+    uint64_t delta = expires - w->now;
+    if (delta >= WHEEL_SPAN)
+    {
+        expires = w->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    struct wheel_timer *head = &w->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(struct wheel_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+void wheel_add(struct timer_wheel *w, struct wheel_timer *timer, uint64_t expires)
+{
+    if (wheel_pending(timer))
+    {
+        unlink_timer(timer);
+        w->count--;
+    }
+    timer->expires = expires;
+    link_timer(w, timer, w->now + 1);
+    w->count++;
+}
+
+void wheel_cancel(struct timer_wheel *w, struct wheel_timer *timer)
+{
+    if (wheel_pending(timer))
+    {
+        unlink_timer(timer);
+        w->count--;
+    }
+}
+
+// Move the timers of the level's current slot down to where they belong now
+static void cascade(struct timer_wheel *w, int level)
+{
+    struct wheel_timer *head = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct wheel_timer *timer = head->next;
+    head->next = head->prev = head;
+    while (timer != head)
+    {
+        struct wheel_timer *next = timer->next;
+        link_timer(w, timer, w->now);
+        timer = next;
+    }
+}
+
+void wheel_advance(struct timer_wheel *w, uint64_t now, wheel_fire_fn fire, void *arg)
+{
+    while (w->now < now)
+    {
+        if (w->count == 0)
+        {
+            w->now = now; // nothing to cascade or fire on the way
+            return;
+        }
+        w->now++;
+
+        // Entering a new slot of a higher level: its timers are due within
+        // the span of the level below, so move them down (highest first)
+        int top = 0;
+        while (top + 1 < WHEEL_LEVELS && (w->now & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0)
+        {
+            top++;
+        }
+        for (int level = top; level > 0; level--)
+        {
+            cascade(w, level);
+        }
+
+        struct wheel_timer *head = &w->slots[0][w->now & WHEEL_MASK];
+        while (head->next != head)
+        {
+            struct wheel_timer *timer = head->next;
+            unlink_timer(timer);
+            w->count--;
+            fire(timer, arg);
+        }
+    }
+}
+
+uint64_t wheel_next_expiry(const struct timer_wheel *w)
+{
+    if (w->count == 0)
+    {
+        return UINT64_MAX;
+    }
+    // The first busy level 0 slot, else the next time a higher level cascades
+    for (uint64_t t = w->now + 1; t <= w->now + WHEEL_SLOTS; t++)
+    {
+        const struct wheel_timer *head = &w->slots[0][t & WHEEL_MASK];
+        if (head->next != head)
+        {
+            return t;
+        }
+        if ((t & WHEEL_MASK) == 0)
+        {
+            return t;
+        }
+    }
+    return w->now + WHEEL_SLOTS;
+}
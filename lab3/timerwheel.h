@@ -0,0 +1,55 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel (Varghese & Lauck) for retransmission deadlines.
+//
+// Time is counted in ticks; what a tick is worth is up to the caller. Level 0
+// has one slot per tick, each level above has slots WHEEL_SLOTS times wider.
+// A timer goes into the lowest level whose span covers its deadline and is
+// moved down a level when the wheel reaches its slot, so adding and
+// cancelling are O(1) and each timer is touched at most WHEEL_LEVELS times
+// before it fires, no matter how many are pending.
+//
+// Timers are intrusive: embed a struct wheel_timer in whatever needs a
+// deadline, the wheel never allocates.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^24 ticks ahead; anything later is clamped to that
+
+struct wheel_timer
+{
+    struct wheel_timer *next; // NULL when not pending
+    struct wheel_timer *prev;
+    uint64_t expires; // tick
+};
+
+struct timer_wheel
+{
+    uint64_t now; // every tick up to and including this one has been handled
+    size_t count; // pending timers
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+};
+
+typedef void (*wheel_fire_fn)(struct wheel_timer *timer, void *arg);
+
+void wheel_init(struct timer_wheel *w, uint64_t now);
+// (Re)arms timer to fire at tick expires; a deadline in the past fires on the next advance
+void wheel_add(struct timer_wheel *w, struct wheel_timer *timer, uint64_t expires);
+void wheel_cancel(struct timer_wheel *w, struct wheel_timer *timer);
+// Fires every timer due up to tick now. fire may add or cancel timers.
+void wheel_advance(struct timer_wheel *w, uint64_t now, wheel_fire_fn fire, void *arg);
+// A tick at or before the earliest deadline (never before w->now + 1), for
+// sleeping until then; UINT64_MAX when nothing is pending
+uint64_t wheel_next_expiry(const struct timer_wheel *w);
+
+static inline bool wheel_pending(const struct wheel_timer *timer)
+{
+    return timer->next != NULL;
+}
+
+#endif
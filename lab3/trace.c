@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define RING_RECORDS (1u << 16) // 2 MiB per thread
+#define DRAIN_INTERVAL_NS 10000000
+
+struct trace_ring
+{
+    _Atomic uint64_t head; // written by the owning thread only
+    _Atomic uint64_t tail; // written by the drainer only
+    _Atomic uint64_t lost;
+    uint32_t tid;
+    struct trace_ring *next; // registry of all rings, push-only
+    struct trace_record records[RING_RECORDS];
+};
+
+bool trace_enabled = false;
+
+static FILE *trace_file;
+static _Atomic(struct trace_ring *) rings;
+static _Thread_local struct trace_ring *my_ring;
+static pthread_t drainer;
+static atomic_bool stop_drainer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; // drainer vs. final flush
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct trace_ring *ring_create(void)
+{
+    struct trace_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring)
+    {
+        return NULL;
+    }
+    ring->tid = (uint32_t)syscall(SYS_gettid);
+    struct trace_ring *head = atomic_load(&rings);
+    do
+    {
+        ring->next = head;
+    } while (!atomic_compare_exchange_weak(&rings, &head, ring));
+    return ring;
+}
+
+void trace_emit(uint32_t event, uint64_t a, uint64_t b)
+{
+    struct trace_ring *ring = my_ring;
+    if (!ring && !(ring = my_ring = ring_create()))
+    {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == RING_RECORDS)
+    {
+        atomic_fetch_add_explicit(&ring->lost, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct trace_record *r = &ring->records[head & (RING_RECORDS - 1)];
+    r->ts_ns = now_ns(CLOCK_MONOTONIC);
+    r->tid = ring->tid;
+    r->event = event;
+    r->a = a;
+    r->b = b;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void drain_ring(struct trace_ring *ring)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head)
+    {
+        // Contiguous run up to the end of the buffer
+        uint64_t idx = tail & (RING_RECORDS - 1);
+        uint64_t n = head - tail;
+        if (n > RING_RECORDS - idx)
+        {
+            n = RING_RECORDS - idx;
+        }
+        fwrite(&ring->records[idx], sizeof(struct trace_record), n, trace_file);
+        tail += n;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    uint64_t lost = atomic_exchange_explicit(&ring->lost, 0, memory_order_relaxed);
+    if (lost)
+    {
+        struct trace_record r = {now_ns(CLOCK_MONOTONIC), ring->tid, TR_LOST, lost, 0};
+        fwrite(&r, sizeof(r), 1, trace_file);
+    }
+}
+
+static void drain_all(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    for (struct trace_ring *ring = atomic_load(&rings); ring; ring = ring->next)
+    {
+        drain_ring(ring);
+    }
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *drainer_main(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, DRAIN_INTERVAL_NS};
+    while (!atomic_load(&stop_drainer))
+    {
+        drain_all();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int trace_init(const char *path)
+{
+    trace_file = fopen(path, "wb");
+    if (!trace_file)
+    {
+        perror("fopen");
+        return -1;
+    }
+
+    struct trace_file_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.realtime_ns = now_ns(CLOCK_REALTIME);
+    hdr.monotonic_ns = now_ns(CLOCK_MONOTONIC);
+    fwrite(&hdr, sizeof(hdr), 1, trace_file);
+
+    if (pthread_create(&drainer, NULL, drainer_main, NULL) != 0)
+    {
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    trace_enabled = true;
+    atexit(trace_shutdown);
+    return 0;
+}
+
+void trace_shutdown(void)
+{
+    if (!trace_file)
+    {
+        return;
+    }
+    trace_enabled = false;
+    atomic_store(&stop_drainer, true);
+    pthread_join(drainer, NULL);
+    drain_all();
+    fclose(trace_file);
+    trace_file = NULL;
+}
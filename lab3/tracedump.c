@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include "trace.h"
+
+// Offline decoder for the binary traces written by deliver/server -t
+
+struct event_info
+{
+    const char *label;
+    const char *a;
+    const char *b;
+};
+
+#define TRACE_INFO(name, label, a, b) [name] = {label, a, b},
+static const struct event_info events[TR_COUNT] = {TRACE_EVENTS(TRACE_INFO)};
+#undef TRACE_INFO
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+
+    struct trace_file_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.record_size != sizeof(struct trace_record))
+    {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    time_t wall = (time_t)(hdr.realtime_ns / 1000000000ULL);
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&wall));
+    printf("# trace started %s, times are seconds since then\n", when);
+
+    struct trace_record r;
+    uint64_t count = 0;
+    while (fread(&r, sizeof(r), 1, fp) == 1)
+    {
+        double t = ((int64_t)(r.ts_ns - hdr.monotonic_ns)) / 1e9;
+        if (r.event == TR_NONE || r.event >= TR_COUNT)
+        {
+            printf("%12.6f %6u unknown(%u) %" PRIu64 " %" PRIu64 "\n", t, r.tid, r.event, r.a, r.b);
+        }
+        else if (strcmp(events[r.event].b, "-") == 0)
+        {
+            printf("%12.6f %6u %-11s %s=%" PRIu64 "\n", t, r.tid, events[r.event].label,
+                   events[r.event].a, r.a);
+        }
+        else
+        {
+            printf("%12.6f %6u %-11s %s=%" PRIu64 " %s=%" PRIu64 "\n", t, r.tid, events[r.event].label,
+                   events[r.event].a, r.a, events[r.event].b, r.b);
+        }
+        count++;
+    }
+    printf("# %" PRIu64 " events\n", count);
+
+    fclose(fp);
+    return 0;
+}
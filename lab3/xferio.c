@@ -0,0 +1,613 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xferio.h"
+#include "trace.h"
+
+#define SINK_DEFAULT_PATH "finishedFile.jpeg"
+#define PATTERN_SEED 0x6c6162335f786665ULL
+
+// splitmix64: cheap, and every output bit depends on every input bit
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Bytes [offset, offset + len) of the synthetic stream. Each 8 byte word is
+// a hash of its index, stored little-endian.
+static void pattern_fill(uint64_t offset, uint8_t *buf, size_t len)
+{
+    while (len > 0)
+    {
+        uint64_t word = mix64((offset / 8) ^ PATTERN_SEED);
+        size_t skip = offset % 8;
+        size_t n = 8 - skip < len ? 8 - skip : len;
+        for (size_t i = 0; i < n; i++)
+        {
+            buf[i] = (uint8_t)(word >> (8 * (skip + i)));
+        }
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+int parse_size(const char *text, uint64_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno || end == text)
+    {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end)
+    {
+    case 'T':
+        shift += 10; // fall through
+    case 'G':
+        shift += 10; // fall through
+    case 'M':
+        shift += 10; // fall through
+    case 'K':
+        shift += 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end || (shift && value > (UINT64_MAX >> shift)))
+    {
+        return -1;
+    }
+    *size = (uint64_t)value << shift;
+    return 0;
+}
+
+// ---- sources ----
+
+struct source_ops
+{
+    int (*read)(struct xfer_source *src, uint64_t offset, void *buf, size_t len);
+    void (*close)(struct xfer_source *src);
+};
+
+struct xfer_source
+{
+    const struct source_ops *ops;
+    uint64_t size;
+    int fd;          // file sources
+    uint8_t *data;   // memory sources
+    FILE *stream;    // for the chunker, opened on first use
+};
+
+static int file_source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(src->fd, (uint8_t *)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                fprintf(stderr, "File shrank while sending it\n");
+            }
+            else
+            {
+                perror("pread");
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static void file_source_close(struct xfer_source *src)
+{
+    close(src->fd);
+}
+
+static int memory_source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len)
+{
+    memcpy(buf, src->data + offset, len);
+    return 0;
+}
+
+static void memory_source_close(struct xfer_source *src)
+{
+    free(src->data);
+}
+
+static int pattern_source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len)
+{
+    (void)src;
+    pattern_fill(offset, buf, len);
+    return 0;
+}
+
+static void pattern_source_close(struct xfer_source *src)
+{
+    (void)src;
+}
+
+static const struct source_ops file_source_ops = {file_source_read, file_source_close};
+static const struct source_ops memory_source_ops = {memory_source_read, memory_source_close};
+static const struct source_ops pattern_source_ops = {pattern_source_read, pattern_source_close};
+
+struct xfer_source *source_open(const char *spec, const char *fileName)
+{
+    struct xfer_source *src = calloc(1, sizeof(*src));
+    if (!src)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    src->fd = -1;
+
+    if (strncmp(spec, "pattern:", 8) == 0)
+    {
+        if (parse_size(spec + 8, &src->size) != 0)
+        {
+            fprintf(stderr, "Invalid pattern size: %s\n", spec + 8);
+            free(src);
+            return NULL;
+        }
+        src->ops = &pattern_source_ops;
+        return src;
+    }
+    if (strcmp(spec, "file") != 0 && strcmp(spec, "mem") != 0)
+    {
+        fprintf(stderr, "Unknown source: %s\n", spec);
+        free(src);
+        return NULL;
+    }
+
+    struct stat st;
+    src->fd = open(fileName, O_RDONLY);
+    if (src->fd < 0 || fstat(src->fd, &st) != 0)
+    {
+        perror(fileName);
+        if (src->fd >= 0)
+        {
+            close(src->fd);
+        }
+        free(src);
+        return NULL;
+    }
+    src->size = (uint64_t)st.st_size;
+    src->ops = &file_source_ops;
+    if (strcmp(spec, "mem") == 0)
+    {
+        // Read it all now, the transfer then never waits for the disk
+        src->data = malloc(src->size ? src->size : 1);
+        if (!src->data || file_source_read(src, 0, src->data, src->size) != 0)
+        {
+            fprintf(stderr, "Could not load %s into memory\n", fileName);
+            close(src->fd);
+            free(src->data);
+            free(src);
+            return NULL;
+        }
+        close(src->fd);
+        src->fd = -1;
+        src->ops = &memory_source_ops;
+    }
+    return src;
+}
+
+uint64_t source_size(const struct xfer_source *src)
+{
+    return src->size;
+}
+
+int source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len)
+{
+    if (offset > src->size || len > src->size - offset)
+    {
+        fprintf(stderr, "Read past the end of the source\n");
+        return -1;
+    }
+    if (src->ops->read(src, offset, buf, len) != 0)
+    {
+        return -1;
+    }
+    TRACE(TR_READ, offset, len);
+    return 0;
+}
+
+int source_next_data(struct xfer_source *src, uint64_t offset, uint64_t *start, uint64_t *end)
+{
+    if (offset >= src->size)
+    {
+        return -1;
+    }
+    *start = offset;
+    *end = src->size;
+    if (src->ops != &file_source_ops)
+    {
+        return 0;
+    }
+
+    off_t data = lseek(src->fd, (off_t)offset, SEEK_DATA);
+    if (data < 0)
+    {
+        // ENXIO: nothing but a hole from here on; anything else means the
+        // file system can't say, so it is all data
+        return errno == ENXIO ? -1 : 0;
+    }
+    off_t hole = lseek(src->fd, data, SEEK_HOLE);
+    *start = (uint64_t)data;
+    if (hole > data && (uint64_t)hole < src->size)
+    {
+        *end = (uint64_t)hole;
+    }
+    return *start < src->size ? 0 : -1;
+}
+
+int source_fd(const struct xfer_source *src)
+{
+    return src->fd;
+}
+
+FILE *source_stream(struct xfer_source *src)
+{
+    if (!src->stream)
+    {
+        if (src->ops == &file_source_ops)
+        {
+            src->stream = fdopen(dup(src->fd), "rb");
+        }
+        else if (src->ops == &memory_source_ops && src->size > 0)
+        {
+            src->stream = fmemopen(src->data, src->size, "rb");
+        }
+    }
+    if (src->stream)
+    {
+        rewind(src->stream);
+    }
+    return src->stream;
+}
+
+void source_close(struct xfer_source *src)
+{
+    if (src->stream)
+    {
+        fclose(src->stream);
+    }
+    src->ops->close(src);
+    free(src);
+}
+
+// ---- sinks ----
+
+struct sink_ops
+{
+    int (*write)(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len);
+    int (*zero)(struct xfer_sink *sink, uint64_t offset, uint64_t len); // NULL = write zeros
+    int (*read)(struct xfer_sink *sink, uint64_t offset, void *buf, size_t len); // NULL = can't
+    int (*close)(struct xfer_sink *sink);
+};
+
+struct xfer_sink
+{
+    const struct sink_ops *ops;
+    int fd;          // file sinks
+    uint8_t *data;   // memory sinks
+    size_t capacity;
+    size_t used;
+    uint64_t checked; // verify sinks
+    uint64_t wrong;
+    uint64_t first_wrong;
+};
+
+static int file_sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(sink->fd, (const uint8_t *)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            perror("pwrite");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static int file_sink_read(struct xfer_sink *sink, uint64_t offset, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(sink->fd, (uint8_t *)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n < 0)
+            {
+                perror("pread");
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// The output starts out empty and nothing else writes to this range, so it
+// already reads as zeros; only a hole at the end needs the file extended
+static int file_sink_zero(struct xfer_sink *sink, uint64_t offset, uint64_t len)
+{
+    struct stat st;
+    if (fstat(sink->fd, &st) != 0)
+    {
+        perror("fstat");
+        return -1;
+    }
+    if ((uint64_t)st.st_size < offset + len && ftruncate(sink->fd, (off_t)(offset + len)) != 0)
+    {
+        perror("ftruncate");
+        return -1;
+    }
+    return 0;
+}
+
+static int file_sink_close(struct xfer_sink *sink)
+{
+    if (close(sink->fd) != 0)
+    {
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
+
+static int memory_sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len)
+{
+    if (offset + len > sink->capacity)
+    {
+        size_t capacity = sink->capacity ? sink->capacity : 1 << 20;
+        while (capacity < offset + len)
+        {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(sink->data, capacity);
+        if (!data)
+        {
+            perror("realloc");
+            return -1;
+        }
+        sink->data = data;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + offset, buf, len);
+    if (offset + len > sink->used)
+    {
+        sink->used = offset + len;
+    }
+    return 0;
+}
+
+static int memory_sink_read(struct xfer_sink *sink, uint64_t offset, void *buf, size_t len)
+{
+    if (offset > sink->used || len > sink->used - offset)
+    {
+        return -1;
+    }
+    memcpy(buf, sink->data + offset, len);
+    return 0;
+}
+
+static int memory_sink_close(struct xfer_sink *sink)
+{
+    free(sink->data);
+    return 0;
+}
+
+static int verify_sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len)
+{
+    uint8_t expected[4096];
+    const uint8_t *p = buf;
+    while (len > 0)
+    {
+        size_t n = len < sizeof(expected) ? len : sizeof(expected);
+        pattern_fill(offset, expected, n);
+        if (memcmp(p, expected, n) != 0)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                if (p[i] != expected[i] && sink->wrong++ == 0)
+                {
+                    sink->first_wrong = offset + i;
+                }
+            }
+        }
+        sink->checked += n;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int verify_sink_close(struct xfer_sink *sink)
+{
+    if (sink->wrong)
+    {
+        fprintf(stderr, "Pattern check failed: %llu of %llu bytes wrong, first at offset %llu\n",
+                (unsigned long long)sink->wrong, (unsigned long long)sink->checked,
+                (unsigned long long)sink->first_wrong);
+        return -1;
+    }
+    printf("Pattern check passed: %llu bytes\n", (unsigned long long)sink->checked);
+    return 0;
+}
+
+static int null_sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len)
+{
+    (void)sink;
+    (void)offset;
+    (void)buf;
+    (void)len;
+    return 0;
+}
+
+static int null_sink_zero(struct xfer_sink *sink, uint64_t offset, uint64_t len)
+{
+    (void)sink;
+    (void)offset;
+    (void)len;
+    return 0;
+}
+
+static int null_sink_close(struct xfer_sink *sink)
+{
+    (void)sink;
+    return 0;
+}
+
+static const struct sink_ops file_sink_ops = {file_sink_write, file_sink_zero, file_sink_read, file_sink_close};
+static const struct sink_ops memory_sink_ops = {memory_sink_write, NULL, memory_sink_read, memory_sink_close};
+static const struct sink_ops verify_sink_ops = {verify_sink_write, NULL, NULL, verify_sink_close};
+static const struct sink_ops null_sink_ops = {null_sink_write, null_sink_zero, NULL, null_sink_close};
+
+int sink_kind(const char *spec)
+{
+    if (strcmp(spec, "file") == 0 || (strncmp(spec, "file:", 5) == 0 && spec[5]))
+    {
+        return SINK_FILE;
+    }
+    if (strcmp(spec, "mem") == 0)
+    {
+        return SINK_MEMORY;
+    }
+    if (strcmp(spec, "verify") == 0)
+    {
+        return SINK_VERIFY;
+    }
+    if (strcmp(spec, "null") == 0)
+    {
+        return SINK_NULL;
+    }
+    return -1;
+}
+
+void sink_spec_nth(const char *spec, unsigned n, char *out, size_t size)
+{
+    if (n < 2 || sink_kind(spec) != SINK_FILE)
+    {
+        snprintf(out, size, "%s", spec);
+        return;
+    }
+    snprintf(out, size, "file:%s.%u", spec[4] == ':' ? spec + 5 : SINK_DEFAULT_PATH, n);
+}
+
+struct xfer_sink *sink_open(const char *spec)
+{
+    int kind = sink_kind(spec);
+    if (kind < 0)
+    {
+        fprintf(stderr, "Unknown sink: %s\n", spec);
+        return NULL;
+    }
+    struct xfer_sink *sink = calloc(1, sizeof(*sink));
+    if (!sink)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    sink->fd = -1;
+
+    switch (kind)
+    {
+    case SINK_FILE:
+    {
+        const char *path = spec[4] == ':' ? spec + 5 : SINK_DEFAULT_PATH;
+        sink->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (sink->fd < 0)
+        {
+            perror(path);
+            free(sink);
+            return NULL;
+        }
+        sink->ops = &file_sink_ops;
+        break;
+    }
+    case SINK_MEMORY:
+        sink->ops = &memory_sink_ops;
+        break;
+    case SINK_VERIFY:
+        sink->ops = &verify_sink_ops;
+        break;
+    default:
+        sink->ops = &null_sink_ops;
+        break;
+    }
+    return sink;
+}
+
+int sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len)
+{
+    return sink->ops->write(sink, offset, buf, len);
+}
+
+int sink_zero(struct xfer_sink *sink, uint64_t offset, uint64_t len)
+{
+    if (sink->ops->zero)
+    {
+        return sink->ops->zero(sink, offset, len);
+    }
+    static const uint8_t zeros[4096];
+    while (len > 0)
+    {
+        size_t n = len < sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if (sink->ops->write(sink, offset, zeros, n) != 0)
+        {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int sink_read(struct xfer_sink *sink, uint64_t offset, void *buf, size_t len)
+{
+    return sink->ops->read ? sink->ops->read(sink, offset, buf, len) : -1;
+}
+
+int sink_fd(const struct xfer_sink *sink)
+{
+    return sink->fd;
+}
+
+int sink_close(struct xfer_sink *sink)
+{
+    int rc = sink->ops->close(sink);
+    free(sink);
+    return rc;
+}
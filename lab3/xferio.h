@@ -0,0 +1,73 @@
+#ifndef XFERIO_H
+#define XFERIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Where the sender's bytes come from and where the receiver's bytes go, so a
+// transfer can be benchmarked without the disk in the way, and at sizes no
+// disk here could hold.
+//
+// Sources (deliver -S):
+//   file             the named file, read as it is sent (default)
+//   mem              the named file, read into memory before the clock starts
+//   pattern:<size>   generated bytes, e.g. pattern:10G; nothing is read at all
+// Sinks (server -o):
+//   file[:<path>]    write a file, finishedFile.jpeg by default
+//   mem              keep the data in memory, then drop it
+//   verify           check every byte against what pattern:<size> sends
+//   null             drop everything
+//
+// The pattern is a function of the byte offset only, so any fragment can be
+// generated or checked on its own, in whatever order it arrives.
+
+struct xfer_source;
+struct xfer_sink;
+
+// fileName is what the user asked for; pattern sources only use it as a label
+struct xfer_source *source_open(const char *spec, const char *fileName);
+uint64_t source_size(const struct xfer_source *src);
+// Copies len bytes at offset into buf; returns 0, or -1 if they can't all be read
+int source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len);
+// The first data extent that ends after offset, [*start, *end); the bytes
+// between extents are holes that read as zeros. Returns -1 if only holes
+// are left. Sources that can't tell are all data.
+int source_next_data(struct xfer_source *src, uint64_t offset, uint64_t *start, uint64_t *end);
+// A descriptor to hand to sendfile(), -1 if the data isn't in a file
+int source_fd(const struct xfer_source *src);
+// The whole source as a stream, for the chunker; NULL if it can't be had
+FILE *source_stream(struct xfer_source *src);
+void source_close(struct xfer_source *src);
+
+enum sink_kind
+{
+    SINK_FILE,
+    SINK_MEMORY,
+    SINK_VERIFY,
+    SINK_NULL,
+};
+
+// Returns the kind of sink spec describes, -1 if it describes none
+int sink_kind(const char *spec);
+// The spec for a receiver's nth output: a file sink gets ".n" appended to its
+// path from the second on, so concurrent transfers don't share a file
+void sink_spec_nth(const char *spec, unsigned n, char *out, size_t size);
+// A new, empty output (an existing file is truncated)
+struct xfer_sink *sink_open(const char *spec);
+int sink_write(struct xfer_sink *sink, uint64_t offset, const void *buf, size_t len);
+// len zero bytes at offset. A file sink writes nothing and leaves a hole.
+int sink_zero(struct xfer_sink *sink, uint64_t offset, uint64_t len);
+// Reads back what was written, for file and memory sinks; -1 for the others
+int sink_read(struct xfer_sink *sink, uint64_t offset, void *buf, size_t len);
+// The output file's descriptor, -1 for sinks that aren't files
+int sink_fd(const struct xfer_sink *sink);
+// Returns -1 if the output couldn't be finished or is wrong (a verify sink that saw
+// bytes off the pattern), 0 otherwise. The sink is freed either way.
+int sink_close(struct xfer_sink *sink);
+
+// "4096", "64K", "10G", ... (powers of 1024); returns -1 if malformed
+int parse_size(const char *text, uint64_t *size);
+
+#endif
@@ -0,0 +1,924 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+#include "xferio.h"
+
+// Deterministic discrete-event simulation of a transfer.
+//
+// deliver and server run unchanged, as two coroutines in this process. Every
+// socket, clock and timer call they make is linked (ld --wrap) to the
+// functions below instead, which model a network with a virtual clock: a
+// datagram queues for the link's bandwidth, then takes its delay to arrive,
+// and may be lost or held back to arrive out of order on the way. The clock
+// never moves while either side is busy; once both wait, it jumps to the
+// next arrival or deadline. A transfer then takes as long as processing its
+// packets takes, however long its round trips and timeouts are, and the loss,
+// reordering and the server's own drops all come from seeded generators, so
+// a run repeats exactly for the same seed.
+//
+//   ./xfersim -n 1G -d 100 -l 0.01 -- -f 8192 -j d.json -- -j s.json
+//
+// Everything after the first -- goes to deliver, after the second to the
+// server. deliver sends pattern:<size> and the server drops it; payload bytes
+// are neither generated nor checked, only their sizes matter to the link.
+// With -v the pattern is generated, checksummed and verified as in a real run.
+
+#define SIM_FD_BASE (1 << 20) // far above anything the kernel hands out
+#define SIM_FDS 64
+#define EPOLL_WATCH_MAX 8
+#define STACK_SIZE (16 << 20)
+#define SERVER_PORT 4950
+#define EPHEMERAL_PORT 40000
+#define IP_UDP_HEADERS 28
+#define PACKET_CAPACITY (FRAG_SIZE_MAX + FRAG_HEADER_MAX) // recycled, larger ones are one-offs
+#define NS_PER_S 1000000000ULL
+#define SPIN_NS 10000 // what a poll that returns at once costs, so busy waits reach their deadline
+#define CLOCK_START NS_PER_S // the virtual clock starts at 1 s, 0 reads as "never" to some callers
+#define EPOCH_S 1700000000   // CLOCK_REALTIME at CLOCK_START
+
+int deliver_main(int argc, char *argv[]);
+int server_main(int argc, char *argv[]);
+
+ssize_t __real_read(int fd, void *buf, size_t len);
+int __real_close(int fd);
+int __real_clock_gettime(clockid_t clock, struct timespec *ts);
+void __real_srand(unsigned seed);
+int __real_source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len);
+uint32_t __real_crc32c(uint32_t crc, const void *data, size_t len);
+
+struct sim_packet
+{
+    struct sim_packet *next; // in a socket's receive queue
+    uint64_t at;             // arrival, ns
+    uint64_t seq;            // ties at the same instant go in sending order
+    struct sockaddr_in from;
+    struct sockaddr_in to;
+    size_t len;
+    size_t capacity;
+    uint8_t data[];
+};
+
+enum sim_kind
+{
+    SIM_FREE,
+    SIM_SOCKET,
+    SIM_EPOLL,
+    SIM_TIMER,
+};
+
+struct sim_fd
+{
+    enum sim_kind kind;
+    int owner;
+    // SIM_SOCKET
+    struct sockaddr_in addr; // port 0 until bound
+    struct sim_packet *head, *tail;
+    uint64_t rcvtimeo; // ns, 0 = block forever
+    // SIM_EPOLL
+    struct epoll_event watch[EPOLL_WATCH_MAX];
+    int watched[EPOLL_WATCH_MAX];
+    int watches;
+    // SIM_TIMER
+    uint64_t expires; // ns, 0 = disarmed
+};
+
+// One direction of the path
+struct sim_link
+{
+    double bps;
+    uint64_t delay;  // one way, ns
+    double loss;     // share of datagrams lost
+    double reorder;  // share held back by up to jitter
+    uint64_t jitter; // ns
+    uint64_t queue;  // bytes that may wait for the link, more are dropped
+    uint64_t busy_until;
+    uint64_t packets, bytes, lost, overflowed, reordered;
+};
+
+enum sim_state
+{
+    PROC_RUNNABLE,
+    PROC_WAITING,
+    PROC_EXITED,
+};
+
+struct sim_proc
+{
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+    int argc;
+    char **argv;
+    struct in_addr ip;
+    struct sim_link *link; // what it sends goes over this
+    ucontext_t ctx; // where it starts
+    jmp_buf resume; // where it waits
+    bool started;
+    void *stack;
+    enum sim_state state;
+    uint64_t wake; // ns, UINT64_MAX = only an arrival wakes it
+    int status;
+};
+
+static uint64_t now = CLOCK_START;
+static uint64_t seed = 1;
+static uint64_t rng;
+static bool checkBytes = false;
+static struct sim_fd fds[SIM_FDS];
+static struct sim_proc procs[2]; // the server starts first, so it is bound before anything arrives
+static int current = -1;
+static jmp_buf scheduler;
+static struct sim_packet *freePackets;
+static struct sim_link forward, reverse;
+static struct sim_packet **heap; // arrivals, earliest first
+static size_t heapCount, heapCap;
+static uint64_t packetSeq;
+static uint16_t nextPort = EPHEMERAL_PORT;
+
+// xorshift64*, nothing here may depend on anything but the seed
+static double random_unit(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (double)((rng * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+static bool heap_before(const struct sim_packet *a, const struct sim_packet *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void heap_push(struct sim_packet *p)
+{
+    if (heapCount == heapCap)
+    {
+        heapCap = heapCap ? 2 * heapCap : 1024;
+        heap = realloc(heap, heapCap * sizeof(*heap));
+        if (!heap)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t i = heapCount++;
+    while (i > 0 && heap_before(p, heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = p;
+}
+
+static struct sim_packet *heap_pop(void)
+{
+    struct sim_packet *top = heap[0];
+    struct sim_packet *last = heap[--heapCount];
+    size_t i = 0;
+    while (2 * i + 1 < heapCount)
+    {
+        size_t c = 2 * i + 1;
+        if (c + 1 < heapCount && heap_before(heap[c + 1], heap[c]))
+        {
+            c++;
+        }
+        if (!heap_before(heap[c], last))
+        {
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static struct sim_packet *packet_alloc(size_t len)
+{
+    struct sim_packet *p = freePackets;
+    if (p && len <= p->capacity)
+    {
+        freePackets = p->next;
+        return p;
+    }
+    size_t capacity = len > PACKET_CAPACITY ? len : PACKET_CAPACITY;
+    p = malloc(sizeof(*p) + capacity);
+    if (p)
+    {
+        p->capacity = capacity;
+    }
+    return p;
+}
+
+static void packet_free(struct sim_packet *p)
+{
+    if (p->capacity != PACKET_CAPACITY)
+    {
+        free(p);
+        return;
+    }
+    p->next = freePackets;
+    freePackets = p;
+}
+
+static struct sim_fd *sim_fd(int fd, enum sim_kind kind)
+{
+    if (fd < SIM_FD_BASE || fd >= SIM_FD_BASE + SIM_FDS || fds[fd - SIM_FD_BASE].kind != kind)
+    {
+        return NULL;
+    }
+    return &fds[fd - SIM_FD_BASE];
+}
+
+static int sim_fd_alloc(enum sim_kind kind)
+{
+    for (int i = 0; i < SIM_FDS; i++)
+    {
+        if (fds[i].kind == SIM_FREE)
+        {
+            memset(&fds[i], 0, sizeof(fds[i]));
+            fds[i].kind = kind;
+            fds[i].owner = current;
+            return SIM_FD_BASE + i;
+        }
+    }
+    errno = EMFILE;
+    return -1;
+}
+
+// Gives the clock back to the scheduler until something arrives for this
+// side or the deadline passes; the caller checks again which it was
+static void sim_wait(uint64_t deadline)
+{
+    struct sim_proc *p = &procs[current];
+    p->state = PROC_WAITING;
+    p->wake = deadline;
+    if (!_setjmp(p->resume))
+    {
+        _longjmp(scheduler, 1);
+    }
+}
+
+static uint64_t deadline_ms(int timeout_ms)
+{
+    return timeout_ms < 0 ? UINT64_MAX : now + (uint64_t)timeout_ms * 1000000ULL;
+}
+
+// Clock
+
+int __wrap_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    uint64_t t = clock == CLOCK_REALTIME ? now - CLOCK_START + (uint64_t)EPOCH_S * NS_PER_S : now;
+    ts->tv_sec = (time_t)(t / NS_PER_S);
+    ts->tv_nsec = (long)(t % NS_PER_S);
+    return 0;
+}
+
+time_t __wrap_time(time_t *t)
+{
+    time_t s = (time_t)(EPOCH_S + (now - CLOCK_START) / NS_PER_S);
+    if (t)
+    {
+        *t = s;
+    }
+    return s;
+}
+
+void __wrap_srand(unsigned s)
+{
+    (void)s;
+    __real_srand((unsigned)seed); // the server seeds its drops from the time and pid
+}
+
+// Payload bytes, unless -v
+
+int __wrap_source_read(struct xfer_source *src, uint64_t offset, void *buf, size_t len)
+{
+    if (checkBytes)
+    {
+        return __real_source_read(src, offset, buf, len);
+    }
+    // Only so it doesn't go out as FRAG_FLAG_ZERO: the sparse check stops at the first
+    // nonzero byte, and nothing looks at the rest
+    memset(buf, 0xa5, len < 64 ? len : 64);
+    return 0;
+}
+
+uint32_t __wrap_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return checkBytes ? __real_crc32c(crc, data, len) : crc;
+}
+
+// Simulated hosts share no memory, whatever the real one does
+int __wrap_shm_host_id(uint8_t id[HOST_ID_LEN])
+{
+    (void)id;
+    return -1;
+}
+
+// Sockets
+
+int __wrap_socket(int domain, int type, int protocol)
+{
+    (void)protocol;
+    if (domain != AF_INET || (type & 0xf) != SOCK_DGRAM)
+    {
+        errno = EPROTONOSUPPORT; // TCP mode needs the real thing
+        return -1;
+    }
+    return sim_fd_alloc(SIM_SOCKET);
+}
+
+int __wrap_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+    struct sim_fd *s = sim_fd(fd, SIM_SOCKET);
+    if (!s || len < sizeof(struct sockaddr_in))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&s->addr, addr, sizeof(s->addr));
+    s->addr.sin_addr = procs[s->owner].ip;
+    return 0;
+}
+
+int __wrap_connect(int fd, const struct sockaddr *addr, socklen_t len)
+{
+    (void)addr;
+    (void)len;
+    return sim_fd(fd, SIM_SOCKET) ? 0 : (errno = EBADF, -1); // only used to ask for the path MTU
+}
+
+int __wrap_setsockopt(int fd, int level, int name, const void *value, socklen_t len)
+{
+    struct sim_fd *s = sim_fd(fd, SIM_SOCKET);
+    if (!s)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (level == SOL_SOCKET && name == SO_RCVTIMEO && len >= sizeof(struct timeval))
+    {
+        const struct timeval *tv = value;
+        s->rcvtimeo = (uint64_t)tv->tv_sec * NS_PER_S + (uint64_t)tv->tv_usec * 1000;
+    }
+    else if (level == SOL_SOCKET && name == 60) // SO_ZEROCOPY, there is no kernel to share buffers with
+    {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
+    return 0; // buffer sizes and the rest make no difference here
+}
+
+int __wrap_getsockopt(int fd, int level, int name, void *value, socklen_t *len)
+{
+    if (!sim_fd(fd, SIM_SOCKET))
+    {
+        errno = EBADF;
+        return -1;
+    }
+    int result = level == IPPROTO_IP && name == IP_MTU ? 1500 : 0;
+    if (*len >= sizeof(result))
+    {
+        memcpy(value, &result, sizeof(result));
+        *len = sizeof(result);
+    }
+    return 0;
+}
+
+ssize_t __wrap_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len)
+{
+    (void)flags;
+    struct sim_fd *s = sim_fd(fd, SIM_SOCKET);
+    if (!s || !to || to_len < sizeof(struct sockaddr_in))
+    {
+        errno = s ? EDESTADDRREQ : EBADF;
+        return -1;
+    }
+    if (s->addr.sin_port == 0)
+    {
+        s->addr.sin_family = AF_INET;
+        s->addr.sin_addr = procs[s->owner].ip;
+        s->addr.sin_port = htons(nextPort++);
+    }
+
+    // Wait for the link behind whatever is queued for it, unless the queue is full
+    struct sim_link *link = procs[s->owner].link;
+    uint64_t wire = len + IP_UDP_HEADERS;
+    uint64_t backlog = link->busy_until > now ? (uint64_t)((link->busy_until - now) * link->bps / 8e9) : 0;
+    link->packets++;
+    link->bytes += wire;
+    if (backlog + wire > link->queue)
+    {
+        link->overflowed++;
+        return (ssize_t)len;
+    }
+    link->busy_until = (link->busy_until > now ? link->busy_until : now) + (uint64_t)(wire * 8e9 / link->bps);
+    if (random_unit() < link->loss)
+    {
+        link->lost++;
+        return (ssize_t)len;
+    }
+
+    struct sim_packet *p = packet_alloc(len);
+    if (!p)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    p->next = NULL;
+    p->at = link->busy_until + link->delay;
+    if (link->reorder > 0 && random_unit() < link->reorder)
+    {
+        p->at += (uint64_t)(random_unit() * link->jitter);
+        link->reordered++;
+    }
+    p->seq = packetSeq++;
+    p->from = s->addr;
+    memcpy(&p->to, to, sizeof(p->to));
+    p->len = len;
+    memcpy(p->data, buf, len);
+    heap_push(p);
+    return (ssize_t)len;
+}
+
+ssize_t __wrap_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len)
+{
+    struct sim_fd *s = sim_fd(fd, SIM_SOCKET);
+    if (!s)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    uint64_t deadline = s->rcvtimeo ? now + s->rcvtimeo : UINT64_MAX;
+    while (!s->head)
+    {
+        if ((flags & MSG_DONTWAIT) || now >= deadline)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        sim_wait(deadline);
+    }
+
+    struct sim_packet *p = s->head;
+    s->head = p->next;
+    if (!s->head)
+    {
+        s->tail = NULL;
+    }
+    size_t n = p->len < len ? p->len : len;
+    memcpy(buf, p->data, n);
+    if (from && from_len)
+    {
+        socklen_t fit = *from_len < sizeof(p->from) ? *from_len : sizeof(p->from);
+        memcpy(from, &p->from, fit);
+        *from_len = sizeof(p->from);
+    }
+    packet_free(p);
+    return (ssize_t)n;
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    (void)fd;
+    (void)msg;
+    (void)flags;
+    errno = EAGAIN; // only ever asked for zero-copy completions, which there are none of
+    return -1;
+}
+
+int __wrap_poll(struct pollfd *pfds, nfds_t count, int timeout_ms)
+{
+    uint64_t deadline = deadline_ms(timeout_ms);
+    while (1)
+    {
+        int ready = 0;
+        for (nfds_t i = 0; i < count; i++)
+        {
+            struct sim_fd *s = sim_fd(pfds[i].fd, SIM_SOCKET);
+            pfds[i].revents = s && s->head && (pfds[i].events & POLLIN) ? POLLIN : 0;
+            ready += pfds[i].revents != 0;
+        }
+        if (ready > 0 || (now >= deadline && timeout_ms != 0))
+        {
+            return ready;
+        }
+        if (timeout_ms == 0)
+        {
+            sim_wait(now + SPIN_NS);
+            return 0;
+        }
+        sim_wait(deadline);
+    }
+}
+
+// epoll and timerfd, as far as the window sender uses them
+
+int __wrap_epoll_create1(int flags)
+{
+    (void)flags;
+    return sim_fd_alloc(SIM_EPOLL);
+}
+
+int __wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *ev)
+{
+    struct sim_fd *e = sim_fd(epfd, SIM_EPOLL);
+    if (!e || op != EPOLL_CTL_ADD || e->watches == EPOLL_WATCH_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    e->watched[e->watches] = fd;
+    e->watch[e->watches++] = *ev;
+    return 0;
+}
+
+int __wrap_epoll_wait(int epfd, struct epoll_event *events, int max, int timeout_ms)
+{
+    struct sim_fd *e = sim_fd(epfd, SIM_EPOLL);
+    if (!e)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    while (1)
+    {
+        int ready = 0;
+        uint64_t deadline = deadline_ms(timeout_ms);
+        for (int i = 0; i < e->watches && ready < max; i++)
+        {
+            struct sim_fd *s = sim_fd(e->watched[i], SIM_SOCKET);
+            struct sim_fd *t = sim_fd(e->watched[i], SIM_TIMER);
+            if ((s && s->head) || (t && t->expires && now >= t->expires))
+            {
+                events[ready] = e->watch[i];
+                events[ready++].events = EPOLLIN;
+            }
+            else if (t && t->expires && t->expires < deadline)
+            {
+                deadline = t->expires;
+            }
+        }
+        if (ready > 0 || (now >= deadline_ms(timeout_ms) && timeout_ms != 0))
+        {
+            return ready;
+        }
+        if (timeout_ms == 0)
+        {
+            sim_wait(now + SPIN_NS);
+            return 0;
+        }
+        sim_wait(deadline);
+    }
+}
+
+int __wrap_timerfd_create(int clock, int flags)
+{
+    (void)clock;
+    (void)flags;
+    return sim_fd_alloc(SIM_TIMER);
+}
+
+int __wrap_timerfd_settime(int fd, int flags, const struct itimerspec *value, struct itimerspec *old)
+{
+    struct sim_fd *t = sim_fd(fd, SIM_TIMER);
+    if (!t)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (old)
+    {
+        memset(old, 0, sizeof(*old));
+    }
+    uint64_t ns = (uint64_t)value->it_value.tv_sec * NS_PER_S + (uint64_t)value->it_value.tv_nsec;
+    t->expires = ns == 0 ? 0 : (flags & TFD_TIMER_ABSTIME) ? ns : now + ns; // one-shot only
+    return 0;
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t len)
+{
+    struct sim_fd *t = sim_fd(fd, SIM_TIMER);
+    if (!t)
+    {
+        return __real_read(fd, buf, len);
+    }
+    if (!t->expires || now < t->expires || len < sizeof(uint64_t))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    uint64_t expirations = 1;
+    memcpy(buf, &expirations, sizeof(expirations));
+    t->expires = 0;
+    return sizeof(expirations);
+}
+
+int __wrap_close(int fd)
+{
+    if (fd < SIM_FD_BASE)
+    {
+        return __real_close(fd);
+    }
+    struct sim_fd *f = &fds[fd - SIM_FD_BASE];
+    while (f->kind == SIM_SOCKET && f->head)
+    {
+        struct sim_packet *p = f->head;
+        f->head = p->next;
+        packet_free(p);
+    }
+    f->kind = SIM_FREE;
+    return 0;
+}
+
+// Scheduler
+
+static void deliver_packet(struct sim_packet *p)
+{
+    for (int i = 0; i < SIM_FDS; i++)
+    {
+        struct sim_fd *s = &fds[i];
+        if (s->kind == SIM_SOCKET && s->addr.sin_port == p->to.sin_port &&
+            s->addr.sin_addr.s_addr == p->to.sin_addr.s_addr && procs[s->owner].state != PROC_EXITED)
+        {
+            if (s->tail)
+            {
+                s->tail->next = p;
+            }
+            else
+            {
+                s->head = p;
+            }
+            s->tail = p;
+            if (procs[s->owner].state == PROC_WAITING)
+            {
+                procs[s->owner].state = PROC_RUNNABLE;
+            }
+            return;
+        }
+    }
+    packet_free(p); // nobody listening, as with a real port
+}
+
+static void proc_entry(int i)
+{
+    optind = 0; // getopt's state is shared, each side parses its own arguments from the start
+    procs[i].status = procs[i].main(procs[i].argc, procs[i].argv);
+    procs[i].state = PROC_EXITED;
+    _longjmp(scheduler, 1);
+}
+
+static int proc_start(struct sim_proc *p, int index)
+{
+    p->stack = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->stack == MAP_FAILED || getcontext(&p->ctx) != 0)
+    {
+        perror("coroutine stack");
+        return -1;
+    }
+    p->ctx.uc_stack.ss_sp = p->stack;
+    p->ctx.uc_stack.ss_size = STACK_SIZE;
+    makecontext(&p->ctx, (void (*)(void))proc_entry, 1, index);
+    p->state = PROC_RUNNABLE;
+    p->wake = UINT64_MAX;
+    return 0;
+}
+
+// Runs both sides until they exit, nothing can happen any more or the
+// clock passes limit. Returns false if it had to stop them.
+static bool run(uint64_t limit)
+{
+    while (procs[0].state != PROC_EXITED || procs[1].state != PROC_EXITED)
+    {
+        bool ran = false;
+        for (int i = 0; i < 2; i++)
+        {
+            if (procs[i].state == PROC_RUNNABLE)
+            {
+                // _setjmp rather than swapcontext, which makes a system call for the signal mask every time
+                current = i;
+                if (!_setjmp(scheduler))
+                {
+                    if (procs[i].started)
+                    {
+                        _longjmp(procs[i].resume, 1);
+                    }
+                    procs[i].started = true;
+                    setcontext(&procs[i].ctx);
+                }
+                current = -1;
+                ran = true;
+            }
+        }
+        if (ran)
+        {
+            continue;
+        }
+
+        // Both wait: move the clock to whatever happens first
+        uint64_t next = heapCount ? heap[0]->at : UINT64_MAX;
+        for (int i = 0; i < 2; i++)
+        {
+            if (procs[i].state == PROC_WAITING && procs[i].wake < next)
+            {
+                next = procs[i].wake;
+            }
+        }
+        if (next == UINT64_MAX || next > limit)
+        {
+            return false;
+        }
+        now = next > now ? next : now;
+        while (heapCount && heap[0]->at <= now)
+        {
+            deliver_packet(heap_pop());
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (procs[i].state == PROC_WAITING && procs[i].wake <= now)
+            {
+                procs[i].state = PROC_RUNNABLE;
+            }
+        }
+    }
+    return true;
+}
+
+static void print_link(const char *name, const struct sim_link *l)
+{
+    printf("  %s %" PRIu64 " datagrams, %.1f MB, %" PRIu64 " lost, %" PRIu64 " overflowed, %" PRIu64
+           " reordered\n",
+           name, l->packets, l->bytes / 1e6, l->lost, l->overflowed, l->reordered);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-b <Mbit/s>] [-d <one-way ms>] [-l <loss>] [-r <reorder share>] [-J <jitter ms>] "
+            "[-q <queue bytes>] [-n <size>] [-s <seed>] [-T <simulated s>] [-v] "
+            "[-- <deliver options> [-- <server options>]]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    double mbps = 100, delayMs = 100, loss = 0.01, reorder = 0, jitterMs = 5, limitS = 3600;
+    long long queueBytes = -1;
+    const char *size = "100M";
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:l:r:J:q:n:s:T:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            mbps = atof(optarg); // link bandwidth, both ways
+            break;
+        case 'd':
+            delayMs = atof(optarg); // one-way delay, the RTT is twice that
+            break;
+        case 'l':
+            loss = atof(optarg); // share of datagrams lost, both ways
+            break;
+        case 'r':
+            reorder = atof(optarg); // share held back by up to the jitter
+            break;
+        case 'J':
+            jitterMs = atof(optarg);
+            break;
+        case 'q':
+            queueBytes = atoll(optarg); // bottleneck queue, one bandwidth-delay product by default
+            break;
+        case 'n':
+            size = optarg; // bytes to transfer, e.g. 1G
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'T':
+            limitS = atof(optarg); // give up once this much simulated time has passed
+            break;
+        case 'v':
+            checkBytes = true; // generate, checksum and verify every payload byte
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    uint64_t bytes;
+    if (mbps <= 0 || delayMs < 0 || loss < 0 || loss >= 1 || reorder < 0 || reorder > 1 || jitterMs < 0 ||
+        parse_size(size, &bytes) != 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    forward.bps = mbps * 1e6;
+    forward.delay = (uint64_t)(delayMs * 1e6);
+    forward.loss = loss;
+    forward.reorder = reorder;
+    forward.jitter = (uint64_t)(jitterMs * 1e6);
+    forward.queue = queueBytes >= 0 ? (uint64_t)queueBytes : (uint64_t)(forward.bps * 2 * delayMs / 1e3 / 8);
+    if (forward.queue < 64 * 1024)
+    {
+        forward.queue = 64 * 1024;
+    }
+    reverse = forward;
+    rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    // Split what is left at the -- separators: deliver's options, then the server's
+    int deliverFirst = optind, deliverEnd = optind;
+    while (deliverEnd < argc && strcmp(argv[deliverEnd], "--") != 0)
+    {
+        deliverEnd++;
+    }
+    int serverFirst = deliverEnd < argc ? deliverEnd + 1 : argc;
+
+    char pattern[64], port[16];
+    snprintf(pattern, sizeof(pattern), "pattern:%" PRIu64, bytes);
+    snprintf(port, sizeof(port), "%d", SERVER_PORT);
+    char **deliverArgv = calloc((size_t)(deliverEnd - deliverFirst) + 8, sizeof(char *));
+    char **serverArgv = calloc((size_t)(argc - serverFirst) + 6, sizeof(char *));
+    if (!deliverArgv || !serverArgv)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    // Ours first, so the same options given after them win
+    int n = 0;
+    deliverArgv[n++] = "deliver";
+    deliverArgv[n++] = "-c";
+    deliverArgv[n++] = ""; // no peer cache, every run starts from nothing
+    deliverArgv[n++] = "-S";
+    deliverArgv[n++] = pattern;
+    for (int i = deliverFirst; i < deliverEnd; i++)
+    {
+        deliverArgv[n++] = argv[i];
+    }
+    deliverArgv[n++] = "10.0.0.2";
+    deliverArgv[n++] = port;
+    int deliverArgc = n;
+    n = 0;
+    serverArgv[n++] = "server";
+    serverArgv[n++] = "-o";
+    serverArgv[n++] = checkBytes ? "verify" : "null";
+    for (int i = serverFirst; i < argc; i++)
+    {
+        serverArgv[n++] = argv[i];
+    }
+    serverArgv[n++] = port;
+    int serverArgc = n;
+
+    procs[0] = (struct sim_proc){.name = "server", .main = server_main, .argc = serverArgc, .argv = serverArgv,
+                                 .link = &reverse};
+    procs[1] = (struct sim_proc){.name = "deliver", .main = deliver_main, .argc = deliverArgc, .argv = deliverArgv,
+                                 .link = &forward};
+    inet_pton(AF_INET, "10.0.0.2", &procs[0].ip);
+    inet_pton(AF_INET, "10.0.0.1", &procs[1].ip);
+    static char command[] = "ftp sim.bin\n";
+    stdin = fmemopen(command, strlen(command), "r");
+    if (!stdin || proc_start(&procs[0], 0) != 0 || proc_start(&procs[1], 1) != 0)
+    {
+        perror("fmemopen");
+        return EXIT_FAILURE;
+    }
+
+    struct timespec wallStart, wallEnd;
+    __real_clock_gettime(CLOCK_MONOTONIC, &wallStart);
+    bool finished = run(CLOCK_START + (uint64_t)(limitS * NS_PER_S));
+    __real_clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+    double wall = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9;
+
+    fflush(stdout);
+    printf("\nSimulated %.3f s in %.3f s (seed %" PRIu64 ")\n", (now - CLOCK_START) / 1e9, wall, seed);
+    print_link("deliver -> server:", &forward);
+    print_link("server -> deliver:", &reverse);
+    for (int i = 1; i >= 0; i--)
+    {
+        if (procs[i].state == PROC_EXITED)
+        {
+            printf("  %s exited with %d\n", procs[i].name, procs[i].status);
+        }
+        else
+        {
+            printf("  %s was still waiting%s\n", procs[i].name, finished ? "" : " when the simulation stopped");
+        }
+    }
+    return procs[1].state == PROC_EXITED && procs[1].status == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include "statpage.h"
+
+// Shows what running deliver/server processes are doing, read from the
+// pages they publish (see statpage.h). Nothing is sent to them, so asking
+// costs the transfer nothing.
+//
+//   ./xferstat            every process, once
+//   ./xferstat -w 1 <pid> one process, every second until it exits
+
+#define MAX_PAGES 64
+
+#define XFER_STATE_LABEL(name, label) [name] = label,
+static const char *state_labels[XS_COUNT] = {XFER_STATES(XFER_STATE_LABEL)};
+#undef XFER_STATE_LABEL
+
+struct watched
+{
+    int pid;
+    const struct stat_page *page;
+    uint64_t last_bytes; // bytes_done at the previous look, for the rate
+    uint64_t last_wire;  // bytes_on_wire, likewise
+    uint64_t last_ns;
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t load64(const _Atomic uint64_t *field)
+{
+    return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+static uint32_t load32(const _Atomic uint32_t *field)
+{
+    return atomic_load_explicit(field, memory_order_relaxed);
+}
+
+// NULL if pid has no page or it isn't one of ours
+static const struct stat_page *map_page(int pid)
+{
+    char name[64];
+    snprintf(name, sizeof(name), STATPAGE_PREFIX "%d", pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    void *p = mmap(NULL, sizeof(struct stat_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    const struct stat_page *page = p;
+    if (memcmp(page->magic, STATPAGE_MAGIC, sizeof(page->magic)) != 0 || page->size != sizeof(*page))
+    {
+        munmap(p, sizeof(struct stat_page));
+        return NULL;
+    }
+    return page;
+}
+
+// Pages of every process that has one, by their names under /dev/shm
+static size_t find_pids(int *pids, size_t max)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir)
+    {
+        perror("/dev/shm");
+        return 0;
+    }
+    size_t count = 0;
+    const char *prefix = STATPAGE_PREFIX + 1; // without the leading '/'
+    struct dirent *entry;
+    while (count < max && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+        {
+            pids[count++] = atoi(entry->d_name + strlen(prefix));
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+static void format_bytes(uint64_t bytes, char *out, size_t size)
+{
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = (double)bytes;
+    unsigned u = 0;
+    while (value >= 1024 && u < sizeof(units) / sizeof(units[0]) - 1)
+    {
+        value /= 1024;
+        u++;
+    }
+    snprintf(out, size, u ? "%.1f %s" : "%.0f %s", value, units[u]);
+}
+
+static void show(struct watched *w, uint64_t now)
+{
+    const struct stat_page *page = w->page;
+    uint32_t state = atomic_load_explicit(&page->state, memory_order_acquire);
+    uint64_t done = load64(&page->bytes_done);
+    uint64_t wire = load64(&page->bytes_on_wire);
+    uint64_t total = state >= XS_DATA ? load64(&page->bytes_total) : 0;
+    bool alive = kill(page->pid, 0) == 0 || errno != ESRCH;
+
+    char doneText[32], totalText[32];
+    format_bytes(done, doneText, sizeof(doneText));
+    format_bytes(total, totalText, sizeof(totalText));
+    double secs = (now - page->started_ns) / 1e9;
+    double dt = (now - w->last_ns) / 1e9;
+    double rate = dt > 0 && done >= w->last_bytes ? (done - w->last_bytes) * 8 / dt / 1e6 : 0;
+    double wireRate = dt > 0 && wire >= w->last_wire ? (wire - w->last_wire) * 8 / dt / 1e6 : 0;
+    w->last_bytes = done;
+    w->last_wire = wire;
+    w->last_ns = now;
+
+    printf("%d %s %s", page->pid, page->role, alive ? state < XS_COUNT ? state_labels[state] : "?" : "gone");
+    if (state >= XS_DATA)
+    {
+        printf(" '%.*s'", STATPAGE_NAME_MAX, page->name);
+    }
+    printf("  %.1f s\n", secs);
+
+    if (total)
+    {
+        printf("  %s of %s (%.1f%%)", doneText, totalText, 100.0 * done / total);
+    }
+    else
+    {
+        printf("  %s", doneText);
+    }
+    printf(", %.1f Mbit/s now, %.1f Mbit/s average\n", rate, secs > 0 ? done * 8 / secs / 1e6 : 0);
+
+    if (strcmp(page->role, "sender") == 0)
+    {
+        printf("  sent %" PRIu64 " of %" PRIu64 " fragments, %" PRIu64 " retransmitted, %" PRIu64
+               " timeouts\n",
+               load64(&page->frags_sent), load64(&page->frags_total), load64(&page->frags_retransmitted),
+               load64(&page->timeouts));
+        // A NACK mode sender only learns what arrived at the end; the wire shows it is moving
+        printf("  %.1f Mbit/s on the wire, cwnd %u, srtt %.3f ms, rto %.3f ms\n", wireRate,
+               load32(&page->cwnd), load32(&page->srtt_us) / 1e3, load32(&page->rto_us) / 1e3);
+    }
+    else
+    {
+        printf("  received %" PRIu64 " fragments of %" PRIu64 "\n", load64(&page->frags_received),
+               load64(&page->frags_total));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            interval = atof(optarg); // keep watching, one report every interval seconds
+            if (interval <= 0)
+            {
+                fprintf(stderr, "Invalid interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w seconds] [pid...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int pids[MAX_PAGES];
+    size_t count = 0;
+    if (optind < argc)
+    {
+        while (optind < argc && count < MAX_PAGES)
+        {
+            pids[count++] = atoi(argv[optind++]);
+        }
+    }
+    else
+    {
+        count = find_pids(pids, MAX_PAGES);
+    }
+
+    struct watched watched[MAX_PAGES];
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const struct stat_page *page = map_page(pids[i]);
+        if (!page)
+        {
+            fprintf(stderr, "No transfer stats for pid %d\n", pids[i]);
+            continue;
+        }
+        watched[n].pid = pids[i];
+        watched[n].page = page;
+        watched[n].last_bytes = load64(&page->bytes_done);
+        watched[n].last_wire = load64(&page->bytes_on_wire);
+        watched[n].last_ns = monotonic_ns();
+        n++;
+    }
+    if (n == 0)
+    {
+        if (count == 0)
+        {
+            fprintf(stderr, "No transfers running\n");
+        }
+        return EXIT_FAILURE;
+    }
+
+    // The rate needs two looks; a single report takes its second one shortly after
+    double wait = interval > 0 ? interval : 0.5;
+    for (;;)
+    {
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+
+        uint64_t now = monotonic_ns();
+        size_t running = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            show(&watched[i], now);
+            if (kill(watched[i].pid, 0) == 0 &&
+                atomic_load_explicit(&watched[i].page->state, memory_order_acquire) != XS_DONE)
+            {
+                running++;
+            }
+        }
+        if (interval <= 0 || running == 0)
+        {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "zerocopy.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define ZC_FREE UINT32_MAX // ring entry of a completed send
+#define SENDS_PER_BUFFER 4 // outstanding sends the ring has room for, on average
+
+int zc_init(struct zc_pool *p, int sockfd, uint32_t count, size_t size)
+{
+    memset(p, 0, sizeof(*p));
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    {
+        return -1;
+    }
+    p->sockfd = sockfd;
+    p->size = size;
+    p->count = count;
+    // A power of two, so ids map to the same entry across their wrap around
+    for (p->ring = 1; p->ring < count * SENDS_PER_BUFFER; p->ring *= 2)
+    {
+    }
+    p->buffers = malloc((size_t)count * size);
+    p->pending = calloc(count, sizeof(uint32_t));
+    p->owner = malloc(p->ring * sizeof(uint32_t));
+    if (!p->buffers || !p->pending || !p->owner)
+    {
+        free(p->buffers);
+        free(p->pending);
+        free(p->owner);
+        memset(p, 0, sizeof(*p));
+        errno = ENOMEM;
+        return -1;
+    }
+    for (uint32_t i = 0; i < p->ring; i++)
+    {
+        p->owner[i] = ZC_FREE;
+    }
+    return 0;
+}
+
+void zc_free(struct zc_pool *p)
+{
+    while (p->oldest_id != p->next_id && zc_reap(p, true) == 0)
+    {
+    }
+    free(p->buffers);
+    free(p->pending);
+    free(p->owner);
+    memset(p, 0, sizeof(*p));
+}
+
+static void complete(struct zc_pool *p, uint32_t lo, uint32_t hi, bool copied)
+{
+    for (uint32_t id = lo;; id++)
+    {
+        uint32_t *owner = &p->owner[id % p->ring];
+        if (id - p->oldest_id < p->next_id - p->oldest_id && *owner != ZC_FREE)
+        {
+            p->pending[*owner]--;
+            *owner = ZC_FREE;
+            p->copied += copied;
+        }
+        if (id == hi)
+        {
+            break;
+        }
+    }
+    while (p->oldest_id != p->next_id && p->owner[p->oldest_id % p->ring] == ZC_FREE)
+    {
+        p->oldest_id++;
+    }
+}
+
+int zc_reap(struct zc_pool *p, bool block)
+{
+    if (block)
+    {
+        // The error queue never blocks, but poll reports it as POLLERR
+        struct pollfd pfd = {p->sockfd, 0, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            return -1;
+        }
+    }
+
+    char control[128];
+    struct msghdr msg;
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(p->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                return 0;
+            }
+            perror("recvmsg(MSG_ERRQUEUE)");
+            return -1;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY && err.ee_errno == 0)
+            {
+                complete(p, err.ee_info, err.ee_data, err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+}
+
+int zc_wait(struct zc_pool *p, uint32_t i)
+{
+    while (p->pending[i] > 0)
+    {
+        if (zc_reap(p, true) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t zc_send(struct zc_pool *p, uint32_t i, size_t len, const struct sockaddr *addr, socklen_t addr_len)
+{
+    // The ring is full of sends the kernel still holds: let some finish first
+    while (p->next_id - p->oldest_id >= p->ring)
+    {
+        if (zc_reap(p, true) != 0)
+        {
+            return -1;
+        }
+    }
+    ssize_t sent;
+    while ((sent = sendto(p->sockfd, zc_buffer(p, i), len, MSG_ZEROCOPY, addr, addr_len)) < 0)
+    {
+        // ENOBUFS: the notifications waiting to be read have used up the socket's option memory
+        if (errno != ENOBUFS || p->oldest_id == p->next_id || zc_reap(p, true) != 0)
+        {
+            return -1; // no id taken
+        }
+    }
+    p->owner[p->next_id++ % p->ring] = i;
+    p->pending[i]++;
+    p->sends++;
+    return sent;
+}
@@ -0,0 +1,56 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// MSG_ZEROCOPY sends out of a fixed set of packet buffers.
+//
+// The kernel sends straight from a buffer handed to it with MSG_ZEROCOPY
+// and only says it is done with it later, through the socket's error
+// queue: every successful send gets the next 32 bit id, and a notification
+// covers a range of ids. Until then the buffer must not change. Here each
+// buffer counts its sends that haven't completed, and taking a buffer back
+// for new contents waits for that count to drop to zero. Sending the same
+// contents again (a retransmission) needs no wait.
+//
+// While notifications are queued the socket polls as POLLERR/EPOLLERR, so
+// a loop that sleeps on it has to call zc_reap() when it wakes up.
+
+struct zc_pool
+{
+    int sockfd;
+    uint8_t *buffers;   // count * size bytes
+    size_t size;        // bytes per buffer
+    uint32_t count;
+    uint32_t *pending;  // sends from each buffer the kernel hasn't completed
+    uint32_t *owner;    // buffer of the send with id i, at i % ring
+    uint32_t ring;
+    uint32_t next_id;   // id the kernel gives the next send
+    uint32_t oldest_id; // lowest id not known to be complete
+    uint64_t sends;
+    uint64_t copied;    // completions where the kernel had copied after all (loopback, no SG)
+};
+
+// Turns on SO_ZEROCOPY and allocates count buffers of size bytes; returns
+// -1 with errno set if the kernel or the socket can't do it
+int zc_init(struct zc_pool *p, int sockfd, uint32_t count, size_t size);
+// Waits for every send to complete, then frees the buffers
+void zc_free(struct zc_pool *p);
+
+static inline uint8_t *zc_buffer(struct zc_pool *p, uint32_t i)
+{
+    return p->buffers + (size_t)i * p->size;
+}
+
+// Handles every queued notification; with block, waits for at least one
+// first. Returns -1 on an error from the socket.
+int zc_reap(struct zc_pool *p, bool block);
+// Waits until buffer i may be overwritten
+int zc_wait(struct zc_pool *p, uint32_t i);
+// sendto() of the first len bytes of buffer i with MSG_ZEROCOPY
+ssize_t zc_send(struct zc_pool *p, uint32_t i, size_t len, const struct sockaddr *addr, socklen_t addr_len);
+
+#endif
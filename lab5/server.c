@@ -9,6 +9,25 @@
 #include <netdb.h>
 #include <stdbool.h>
 
+// USDT probes for perf and bpftrace, provider chat, e.g.
+//   bpftrace -e 'usdt:./server:chat:dispatch { @start[arg0] = nsecs; }
+//                usdt:./server:chat:dispatch_done { @us[arg1] = hist((nsecs - @start[arg0]) / 1000); }'
+// A nop each until a tracer attaches; nothing at all without <sys/sdt.h>.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHAT_SDT 1
+#endif
+#endif
+
+#ifdef CHAT_SDT
+#define PROBE1(name, a) DTRACE_PROBE1(chat, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(chat, name, a, b)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#endif
+
 #define LOGIN 1
 #define LO_ACK 2
 #define LO_NAK 3
@@ -198,6 +217,7 @@ int main(int argc, char *argv[])
                     }
                     else
                     {
+                        PROBE1(client_accept, client_socket);
                         FD_SET(client_socket, &master);
                         if (client_socket > fdmax)
                         {
@@ -226,6 +246,7 @@ int main(int argc, char *argv[])
                         {
                             perror("recv failed");
                         }
+                        PROBE1(client_disconnect, i);
                         close(i);
                         FD_CLR(i, &master);
 
@@ -246,6 +267,7 @@ int main(int argc, char *argv[])
                     else
                     {
                         buffer[n] = '\0'; // Null terminate buffer
+                        PROBE2(message_recv, i, n);
 
                         // Print received message for debugging
                         printf("Received from socket %d: %s\n", i, buffer);
@@ -254,6 +276,7 @@ int main(int argc, char *argv[])
                         struct message msg = deserialize_message(buffer);
 
                         // Process message based on type
+                        PROBE2(dispatch, i, msg.type);
                         switch (msg.type)
                         {
                         case REGISTER:
@@ -312,6 +335,7 @@ int main(int argc, char *argv[])
                                 }
                                 curr = &(*curr)->next;
                             }
+                            PROBE1(client_disconnect, i);
                             close(i);
                             FD_CLR(i, &master);
                             break;
@@ -349,6 +373,7 @@ int main(int argc, char *argv[])
                             break;
                         }
                         }
+                        PROBE2(dispatch_done, i, msg.type);
                     }
                 }
             }
@@ -716,6 +741,7 @@ void handle_message(struct message msg, int client_socket)
     {
         if (curr_client->sockfd != client_socket)
         {
+            PROBE2(fanout_send, curr_client->sockfd, strlen(message_serialized));
             send(curr_client->sockfd, message_serialized, strlen(message_serialized), 0);
         }
         curr_client = curr_client->next_participant;
@@ -832,6 +858,7 @@ void handle_private_message(struct message msg, int client_socket)
             char serialized[2048];
             serialize_message(&pm, serialized, sizeof(serialized));
             printf("Sending to %s (sock %d): %s\n", target->clientID, target->sockfd, serialized);
+            PROBE2(fanout_send, target->sockfd, strlen(serialized));
             if (send(target->sockfd, serialized, strlen(serialized), 0) < 0)
             {
                 perror("Send failed");